@@ -1,9 +1,21 @@
 default rel
 bits 64
 align 16
+; The instrumented build of the library counts swaps in C functions which
+; take the names of the context switches, and call them under other names.
+%ifdef _INSTRUMENTED_BUILD
+%define _cfib_swap _cfib_swap_raw
+%define _cfib_transfer _cfib_transfer_raw
+%define _cfib_ontop _cfib_ontop_raw
+%endif
 global _cfib_init_stack:function
 global _cfib_swap:function
-extern _cfib_exit_thread
+global _cfib_transfer:function
+global _cfib_ontop:function
+extern _cfib_exit_fiber
+%ifdef _INSTRUMENTED_BUILD
+extern _cfib_instr_enter
+%endif
 section .text
 
 ; Call initializer, reverse-called by _cfib_swap.
@@ -14,18 +26,40 @@ section .text
 ;
 ; _cfib_init_stack() saved the callable function and its argument pointer
 ; to r15 and r14 positions of the stack, and ince they were popped by
-; _cfib_swap(), we can use them as arguments.
+; _cfib_swap(), we can use them as arguments. It saved the fiber itself to
+; the rbx position, and since rbx is callee saved, it survives the call.
+;
+; When the function returns, _cfib_exit_fiber() marks the fiber finished
+; and swaps away from it for good, so it never returns here.
+;
+; If the fiber was started by _cfib_transfer() or _cfib_ontop(), rax holds
+; the transferred value, which becomes the 2nd argument of the function.
 ;
 ; Arguments:
 ; r14 = void* args, pointer to fiber arguments
 ; r15 = void (*func)(void*), pointer to fiber executed function
+; rbx = cfib_t*, the fiber
+; rax = void* data, the transferred value
 _cfib_call:
+%ifdef _INSTRUMENTED_BUILD
+    ; Account the first swap into the fiber, r12 is free to keep rax
+    mov r12, rax
+    mov rdi, rbx
+%ifndef _ELF_SHARED
+    call _cfib_instr_enter
+%else
+    call _cfib_instr_enter wrt ..plt
+%endif
+    mov rax, r12
+%endif
     mov rdi, r14 ; 1st argument rdi = void* args
+    mov rsi, rax ; 2nd argument rsi = void* data
     call r15 ; call the function ptr from r15
+    mov rdi, rbx ; 1st argument rdi = cfib_t* self
 %ifndef _ELF_SHARED
-    call _cfib_exit_thread
+    call _cfib_exit_fiber
 %else
-    call _cfib_exit_thread wrt ..plt ; call the thread exit vector via ELF plt
+    call _cfib_exit_fiber wrt ..plt ; call the fiber exit vector via ELF plt
 %endif
 
 ; This function synthesizes an initial stack for
@@ -36,7 +70,10 @@ _cfib_call:
 ; rdi = void** sp, pointer to rsp of the allocated stack
 ; rsi = void (*func)(void*), fiber executed function pointer
 ; rdx = void *args, arguments for the fiber
+; rcx = cfib_t*, the fiber
 _cfib_init_stack:
+    ; Keep the fiber in r9, rcx is needed below
+    mov r9, rcx
     ; Set rcx as base pointer to the new stack
     ; NOTE: empty stack's pointer should be aligned to page,
     ; and thus it ishould also must be aligned to 16-bytes.
@@ -53,6 +90,8 @@ _cfib_init_stack:
     mov [rcx + 0], rsi
     ; [rcx + 8] r14 = rdx, the void* argument pointer for fiber function
     mov [rcx + 8], rdx
+    ; [rcx + 32] rbx = r9, the fiber
+    mov [rcx + 32], r9
     ; load address of [rcx + 56] into rax
     lea rax, [rcx + 56]
     ; [rcx + 40] rbp will be pointed to [rcx + 56] which will be zeroed later.
@@ -101,3 +140,75 @@ _cfib_swap:
     pop rbp
     ; ... and return to next context
     ret
+
+; Swap context from current to next, passing a value over.
+;
+; Same as _cfib_swap, but the value in rdx and the fiber in rcx are returned
+; to the next context in rax and rdx. The next context was suspended in
+; _cfib_transfer or _cfib_ontop, so it receives them as the return value
+; struct {void* data; cfib_t* from}, or it was never started, so it
+; receives the value as the 2nd argument of it's function (see _cfib_call).
+;
+; Arguments:
+; rdi = void**, pointer to current context rsp
+; rsi = void*, rsp of the next context
+; rdx = void*, the value to pass
+; rcx = cfib_t*, the current context
+_cfib_transfer:
+    push rbp
+    push rbx
+    push r12
+    push r13
+    push r14
+    push r15
+    mov [rdi], rsp
+    mov rsp, rsi
+    pop r15
+    pop r14
+    pop r13
+    pop r12
+    pop rbx
+    pop rbp
+    ; Return {data, from} in rax:rdx
+    mov rax, rdx
+    mov rdx, rcx
+    ret
+
+; Swap context from current to next, and call a function on top of the next
+; context before it resumes.
+;
+; Same as _cfib_transfer, but after the pivot, the function in r8 is called
+; as fn(data, from) on the stack of the next context, and the next context
+; receives what it returns instead of data. Since the function no longer
+; runs on the stack of the current context, it can release that stack.
+;
+; Arguments:
+; rdi = void**, pointer to current context rsp
+; rsi = void*, rsp of the next context
+; rdx = void*, the value to pass
+; rcx = cfib_t*, the current context
+; r8 = void* (*fn)(void*, cfib_t*), the function to call on top
+_cfib_ontop:
+    push rbp
+    push rbx
+    push r12
+    push r13
+    push r14
+    push r15
+    mov [rdi], rsp
+    mov rsp, rsi
+    pop r15
+    pop r14
+    pop r13
+    pop r12
+    pop rbx
+    pop rbp
+    ; rsp points to the return address, so pushing from aligns it at
+    ; 16-byte boundary for the call
+    push rcx
+    mov rdi, rdx
+    mov rsi, rcx
+    call r8
+    ; Return {fn(data, from), from} in rax:rdx
+    pop rdx
+    ret
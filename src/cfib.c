@@ -3,6 +3,7 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <errno.h>
 
 #ifdef _PROFILED_BUILD
 
@@ -14,17 +15,44 @@
 
 #endif /* #ifdef _PROFILED_BUILD  */
 
+#ifdef _WITH_C11_ATOMICS
+#include <stdatomic.h>
+#endif
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#ifdef _INSTRUMENTED_BUILD
+#include <stddef.h>
+#ifdef __x86_64__
+#include <x86intrin.h>
+#endif
+#endif /* #ifdef _INSTRUMENTED_BUILD */
+
 #ifdef _WITH_SYSAPI_POSIX
 
 #include <unistd.h>
 #include <sys/mman.h>
 #include <pthread.h>
 #include <signal.h>
+#include <time.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
 
 #ifndef MAP_ANONYMOUS
 #define MAP_ANONYMOUS MAP_ANON
 #endif
 
+// Growable stacks need the stack registry to find the faulting fiber, and
+// the profiled build grows all stacks anyway
+#if !defined(_PROFILED_BUILD) && defined(_WITH_C11_ATOMICS) && defined(MAP_NORESERVE)
+#define _CFIB_GROW
+#endif
+
 #elif defined (_WITH_SYSAPI_WINDOWS)
     #error "TODO: WINAPI support."
 #endif
@@ -34,14 +62,28 @@ _Thread_local struct _cfib_tls _cfib_tls = {
     .previous = NULL
 };
 
+// A finished CFIB_AUTO_RECYCLE fiber, waiting to be released
+static _Thread_local cfib_t* _recycled = NULL;
+
 static cfib_attr_t _default_attr = {
     .stack_size = 1<<16,
     .flags = 0x0,
     .tag = NULL
 };
 
+// The space taken by a CFIB_ONSTACK fiber at the top of it's stack mapping,
+// rounded up to whole cache lines
+#define _ONSTACK_SIZE ((sizeof(cfib_t) + 63) & ~(size_t)63)
+
+// @internal Returns the end of the stack mapping of 'fib', which is above
+// the stack floor if the fiber lives in the mapping.
+static inline unsigned char* _stack_top(const cfib_t* fib)
+{
+    return fib->stack_floor + ((fib->_flags & CFIB_ONSTACK) ? _ONSTACK_SIZE : 0);
+}
+
 // @internal Implemented in assembler module
-void _cfib_init_stack(unsigned char** sp, cfib_func start_addr, void* args);
+void _cfib_init_stack(unsigned char** sp, cfib_func start_addr, void* args, cfib_t* fib);
 
 static inline uint_fast32_t _get_sys_page_size()
 {
@@ -63,88 +105,414 @@ static inline uint_fast32_t _align_size_to_page(uint_fast32_t size)
     return size;
 }
 
-#ifdef _PROFILED_BUILD
+#if defined(_WITH_C11_ATOMICS) && defined(_WITH_SYSAPI_POSIX)
+
+/* Registry of stack ranges.
+ *
+ * Maps the number of every page of every live fiber stack, guard page
+ * included, to the fiber, so that any address can be resolved to a fiber,
+ * also from a signal handler. The map is a radix tree of three levels, each
+ * indexed by 12 bits of the page number. Nodes are installed with CAS and
+ * never freed, and all entries are read and written atomically, so a lookup
+ * takes three loads and no locks, no matter how many fibers there are.
+ * Registering a stack costs a store per page.
+ */
+
+#define _REG_BITS 12
+#define _REG_FANOUT (1 << _REG_BITS)
+#define _REG_MASK (_REG_FANOUT - 1)
+#define _REG_NODE_SIZE (_REG_FANOUT * sizeof(_Atomic(void*)))
+
+static _Atomic(void*) _reg_root[_REG_FANOUT];
+
+// @internal Returns the child node in 'slot', installing a new one if
+// 'create' is set.
+static _Atomic(void*)* _reg_child(_Atomic(void*)* slot, int create)
+{
+    void* node = atomic_load_explicit(slot, memory_order_acquire);
+    if(node != NULL || !create)
+        return (_Atomic(void*)*)node;
+    node = mmap(0, _REG_NODE_SIZE, PROT_READ|PROT_WRITE, MAP_ANONYMOUS|MAP_PRIVATE, -1, 0);
+    if(node == MAP_FAILED)
+        return NULL;
+    void* expected = NULL;
+    if(!atomic_compare_exchange_strong_explicit(slot, &expected, node, memory_order_acq_rel, memory_order_acquire)) {
+        // Another thread installed one first
+        munmap(node, _REG_NODE_SIZE);
+        node = expected;
+    }
+    return (_Atomic(void*)*)node;
+}
+
+// @internal Sets the entries of the pages in [begin, end) to 'fib', or
+// clears them if 'fib' is NULL. Returns 0 if a node could not be allocated.
+static int _reg_set(const unsigned char* begin, const unsigned char* end, cfib_t* fib)
+{
+    unsigned shift = (unsigned)__builtin_ctz(_get_sys_page_size());
+    uintptr_t key = (uintptr_t)begin >> shift;
+    uintptr_t last = ((uintptr_t)end - 1) >> shift;
+    if((last >> (3 * _REG_BITS)) != 0)
+        return 0;
+    _Atomic(void*)* leaf = NULL;
+    for(; key <= last; key++) {
+        if(leaf == NULL || (key & _REG_MASK) == 0) {
+            _Atomic(void*)* mid = _reg_child(&_reg_root[key >> (2 * _REG_BITS)], fib != NULL);
+            leaf = mid != NULL ? _reg_child(&mid[(key >> _REG_BITS) & _REG_MASK], fib != NULL) : NULL;
+            if(leaf == NULL) {
+                if(fib != NULL)
+                    return 0;
+                // Nothing to clear in this leaf
+                key |= _REG_MASK;
+                continue;
+            }
+        }
+        atomic_store_explicit(&leaf[key & _REG_MASK], (void*)fib, memory_order_release);
+    }
+    return 1;
+}
+
+// @internal Registers the stack of a fiber, or unregisters it if 'fib' is
+// NULL.
+static void _reg_stack(cfib_t* stack_owner, cfib_t* fib)
+{
+    const unsigned char* begin = stack_owner->stack_ceiling;
+#if !defined(_PROFILED_BUILD) && !defined(__FreeBSD__)
+    // The guard page, so that stack overflows resolve to the fiber as well
+    begin -= _get_sys_page_size();
+#endif
+    if(!_reg_set(begin, _stack_top(stack_owner), fib) && fib != NULL)
+        fprintf(stderr, "libcfib: WARNING: failed to register stack [%p:%p), cfib_find_by_addr() will not find it!\n",
+                (void*)begin, (void*)_stack_top(stack_owner));
+}
+
+cfib_t* cfib_find_by_addr(const void* addr)
+{
+    uintptr_t key = (uintptr_t)addr >> __builtin_ctz(_get_sys_page_size());
+    if((key >> (3 * _REG_BITS)) != 0)
+        return NULL;
+    _Atomic(void*)* mid = (_Atomic(void*)*)atomic_load_explicit(&_reg_root[key >> (2 * _REG_BITS)], memory_order_acquire);
+    if(mid == NULL)
+        return NULL;
+    _Atomic(void*)* leaf = (_Atomic(void*)*)atomic_load_explicit(&mid[(key >> _REG_BITS) & _REG_MASK], memory_order_acquire);
+    if(leaf == NULL)
+        return NULL;
+    return (cfib_t*)atomic_load_explicit(&leaf[key & _REG_MASK], memory_order_acquire);
+}
+
+#else /* #if defined(_WITH_C11_ATOMICS) && defined(_WITH_SYSAPI_POSIX) */
+
+#define _reg_stack(stack_owner, fib)
+
+cfib_t* cfib_find_by_addr(const void* addr)
+{
+    return NULL;
+}
+
+#endif /* #if defined(_WITH_C11_ATOMICS) && defined(_WITH_SYSAPI_POSIX) */
+
+#ifdef _WITH_C11_ATOMICS
+
+/* Per-tag stack statistics.
+ *
+ * Fibers are grouped by their tag (see CFIB_TAG_CTOR), and the stack usage
+ * of each group is counted here: in the profiled build by the SIGSEGV
+ * handler below, page fault by page fault, and in the other builds from the
+ * high water marks of painted fibers (see CFIB_STACK_PAINT). The counters
+ * are updated with atomics only, so that the signal handler can use them.
+ * cfib_prof_dump() turns them into a report.
+ */
+
+// Max. number of distinct tags, the rest are counted in the default tag
+#define _PROF_MAX_TAGS 256
+// Histogram bucket i counts depths of [2^i, 2^(i+1)) pages
+#define _PROF_HIST_BUCKETS 32
+
 typedef struct {
     const char* _name;
-    uintptr_t _magic;
-    uint32_t num_faults;
-    uint32_t max_stack_size;
-    atomic_bool _sync;
-} cfib_tag_t;
+    atomic_uint num_fibers;
+    atomic_uint num_faults;
+    atomic_uint num_samples;
+    atomic_uint max_stack_size;
+    atomic_uint depth_hist[_PROF_HIST_BUCKETS];
+    // Stack size of the tag from a stack profile, 0 if none
+    atomic_uint profile_size;
+} _prof_tag_t;
 
-static cfib_tag_t _default_tag = {._name = "__DEFAULT__"};
+// Tag 0 is the default tag, for fibers created without one
+static _prof_tag_t _prof_tags[_PROF_MAX_TAGS] = {{._name = "__DEFAULT__"}};
+// NULL for the tags which are only known by name, from a stack profile
+static _Atomic(struct _cfib_tag*) _prof_tag_keys[_PROF_MAX_TAGS];
+static atomic_uint _prof_num_tags = 1;
 
-#define _atomic_test_and_set(flag) atomic_flag_test_and_set_explicit(flag, memory_order_relaxed)
-#define _atomic_clear(flag) atomic_flag_clear_explicit(flag, memory_order_release)
+// @internal Counts a stack depth of 'stack_size' bytes, async-signal-safe.
+static void _prof_tag_add(_prof_tag_t* tag, unsigned stack_size)
+{
+    unsigned max = atomic_load_explicit(&tag->max_stack_size, memory_order_relaxed);
+    while(max < stack_size
+          && !atomic_compare_exchange_weak_explicit(&tag->max_stack_size, &max, stack_size, memory_order_relaxed, memory_order_relaxed));
+    unsigned depth = stack_size / _get_sys_page_size();
+    unsigned bucket = depth == 0 ? 0 : 31 - (unsigned)__builtin_clz(depth);
+    atomic_fetch_add_explicit(&tag->depth_hist[bucket], 1, memory_order_relaxed);
+}
 
 #ifdef _WITH_SYSAPI_POSIX
-static pthread_once_t _prof_init_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t _prof_tag_lock = PTHREAD_MUTEX_INITIALIZER;
 
-static struct sigaction _prof_oact;
+static void _profile_init();
+static pthread_once_t _profile_once = PTHREAD_ONCE_INIT;
 
-void _prof_segv_handler(int sig, siginfo_t *nfo, void *uap) {
-    if(nfo->si_addr == NULL)
-        goto next;
-    if(_cfib_tls.current == NULL)
-        goto next;
-    cfib_t* faulting_fib = NULL;
-    cfib_t* fibs[] ={_cfib_tls.current, _cfib_tls.previous};
-    for(int i = 0; i < 2; i++) {
-        if( nfo->si_addr >= (void*)fibs[i]->stack_ceiling
-            && nfo->si_addr < (void*)fibs[i]->stack_floor )
-        {
-            faulting_fib = fibs[i];
-            break;
-        }
+// @internal Returns the index of the tag named 'name' which has no key yet,
+// or 'n' if there is none. Called with _prof_tag_lock held.
+static unsigned _prof_tag_find_name(const char* name, unsigned n)
+{
+    unsigned i = 1;
+    while(i < n && (atomic_load_explicit(&_prof_tag_keys[i], memory_order_relaxed) != NULL || strcmp(_prof_tags[i]._name, name) != 0))
+        i++;
+    return i;
+}
+
+// @internal Appends a tag, returns it's index, or 0 if the table is full.
+// Called with _prof_tag_lock held.
+static unsigned _prof_tag_append(struct _cfib_tag* tag, const char* name)
+{
+    unsigned n = atomic_load_explicit(&_prof_num_tags, memory_order_relaxed);
+    if(n == _PROF_MAX_TAGS) {
+        fprintf(stderr, "libcfib: WARNING: too many fiber tags, counting %s as %s\n", name, _prof_tags[0]._name);
+        return 0;
     }
-    if(faulting_fib == NULL)
-        goto next;
-    void *stack_ceiling = faulting_fib->stack_ceiling;
-    void *stack_floor = faulting_fib->stack_floor;
-    unsigned page_size = _get_sys_page_size();
-    char *page_addr = (char*)nfo->si_addr - ((uintptr_t)nfo->si_addr % page_size);
-    if(page_addr == stack_ceiling) {
-        fprintf(stderr, "libcfib: Stack break @ %p\n", nfo->si_addr);
-        goto next;
+    _prof_tags[n]._name = name;
+    atomic_store_explicit(&_prof_tag_keys[n], tag, memory_order_relaxed);
+    atomic_store_explicit(&_prof_num_tags, n + 1, memory_order_release);
+    return n;
+}
+
+// @internal Returns the counters of a tag, registering the tag on it's
+// first use. Not called from the signal handler.
+static _prof_tag_t* _prof_tag_get(struct _cfib_tag* tag)
+{
+    if(tag == NULL)
+        return &_prof_tags[0];
+    unsigned n = atomic_load_explicit(&_prof_num_tags, memory_order_acquire);
+    for(unsigned i = 1; i < n; i++)
+        if(atomic_load_explicit(&_prof_tag_keys[i], memory_order_acquire) == tag)
+            return &_prof_tags[i];
+    // Tags named in the stack profile must be known before registering
+    pthread_once(&_profile_once, _profile_init);
+    pthread_mutex_lock(&_prof_tag_lock);
+    n = atomic_load_explicit(&_prof_num_tags, memory_order_relaxed);
+    unsigned i = 1;
+    while(i < n && atomic_load_explicit(&_prof_tag_keys[i], memory_order_relaxed) != tag)
+        i++;
+    if(i == n) {
+        i = _prof_tag_find_name(tag->_name, n);
+        if(i < n)
+            atomic_store_explicit(&_prof_tag_keys[i], tag, memory_order_release);
+        else
+            i = _prof_tag_append(tag, tag->_name);
     }
-    int res = mprotect(page_addr, page_size, PROT_READ|PROT_WRITE);
-    assert("Profiling SIGSEGV handler failed to remove guard page from stack!" && res == 0);
-    fprintf(stderr, "libcfib: SEGV @ addr = %p, page = [%p:%p), stack = [%p:%p)", nfo->si_addr, page_addr, page_addr + page_size, stack_ceiling, stack_floor);
-    assert(faulting_fib->_private != NULL);
-    cfib_tag_t* tag = (cfib_tag_t*)faulting_fib->_private;
-    fprintf(stderr, ", group = %s", tag->_name);
-    unsigned stack_diff = (unsigned)((uintptr_t)stack_floor - (uintptr_t)page_addr);
-    while( atomic_exchange_explicit(&tag->_sync, 1, memory_order_acquire) );
-    tag->num_faults++;
-    if(tag->max_stack_size < stack_diff)
-        tag->max_stack_size = stack_diff;
-    atomic_store_explicit(&tag->_sync, 0, memory_order_release);
-    fputs("\n", stderr);
-    return;
-//next_clear:
-//    atomic_flag_clear_explicit(&_prof_tbl_lock, memory_order_release);
-next:
-    if(_prof_oact.sa_flags & SA_SIGINFO)
-        _prof_oact.sa_sigaction(sig, nfo, uap);
-    else
-        _prof_oact.sa_handler(sig);
+    pthread_mutex_unlock(&_prof_tag_lock);
+    return &_prof_tags[i];
 }
 
-static void _prof_init_thread() {
-    static _Thread_local int called_before = 0;
-    assert(!called_before);
-    size_t sigstk_size = MINSIGSTKSZ + 16 * _get_sys_page_size();
+// @internal Returns the stack size of a tag from the stack profile, or 0.
+static inline unsigned _prof_tag_size(struct _cfib_tag* tag)
+{
+    return atomic_load_explicit(&_prof_tag_get(tag)->profile_size, memory_order_relaxed);
+}
+
+static pthread_once_t _prof_report_once = PTHREAD_ONCE_INIT;
+
+static void _prof_dump_at_exit()
+{
+    cfib_prof_dump(getenv("CFIB_PROF_REPORT"));
+}
+
+// @internal Arranges the report to be written at exit, if asked for.
+static void _prof_report_init()
+{
+    if(getenv("CFIB_PROF_REPORT") != NULL)
+        atexit(_prof_dump_at_exit);
+}
+
+/* Stack profiles.
+ *
+ * A stack profile is a text file with a line "<tag name> <stack size>" for
+ * each tag. It is loaded from the file named by CFIB_STACK_PROFILE when the
+ * first tagged fiber is created. The profiled build writes the file back at
+ * exit with the sizes it measured, keeping the tags it did not see.
+ */
+
+// Safety margin added to the measured stack sizes, in percent
+#define _PROFILE_DEF_MARGIN 25
+
+int cfib_stack_profile_load(const char* path)
+{
+    FILE* in = fopen(path, "r");
+    if(in == NULL)
+        return -1;
+    char line[256];
+    char name[128];
+    unsigned long size;
+    int count = 0;
+    while(fgets(line, sizeof(line), in) != NULL) {
+        if(line[0] == '#' || sscanf(line, "%127s %lu", name, &size) != 2)
+            continue;
+        pthread_mutex_lock(&_prof_tag_lock);
+        unsigned n = atomic_load_explicit(&_prof_num_tags, memory_order_relaxed);
+        unsigned i = 1;
+        while(i < n && strcmp(_prof_tags[i]._name, name) != 0)
+            i++;
+        // Only known by name until a fiber with the tag is created
+        if(i == n)
+            i = _prof_tag_append(NULL, strdup(name));
+        if(i != 0)
+            atomic_store_explicit(&_prof_tags[i].profile_size, (unsigned)size, memory_order_relaxed);
+        pthread_mutex_unlock(&_prof_tag_lock);
+        count++;
+    }
+    fclose(in);
+    return count;
+}
+
+int cfib_stack_profile_save(const char* path, unsigned margin_percent)
+{
+    FILE* out = fopen(path, "w");
+    if(out == NULL) {
+        fprintf(stderr, "libcfib: WARNING: cfib_stack_profile_save() failed to open %s\n", path);
+        return -1;
+    }
+    fprintf(out, "# libcfib stack profile: <tag> <stack size>\n");
+    unsigned n = atomic_load_explicit(&_prof_num_tags, memory_order_acquire);
+    for(unsigned i = 1; i < n; i++) {
+        _prof_tag_t* tag = &_prof_tags[i];
+        size_t size = atomic_load_explicit(&tag->profile_size, memory_order_relaxed);
+        if(atomic_load_explicit(&tag->num_faults, memory_order_relaxed) != 0
+           || atomic_load_explicit(&tag->num_samples, memory_order_relaxed) != 0) {
+            size_t max = atomic_load_explicit(&tag->max_stack_size, memory_order_relaxed);
+            max = _align_size_to_page(max + max * margin_percent / 100);
+            // A run which did not go as deep does not shrink the size
+            if(max > size)
+                size = max;
+        }
+        if(size != 0)
+            fprintf(out, "%s %zu\n", tag->_name, size);
+    }
+    return fclose(out) == 0 ? 0 : -1;
+}
+
+#ifdef _PROFILED_BUILD
+static void _profile_save_at_exit()
+{
+    const char* margin = getenv("CFIB_STACK_PROFILE_MARGIN");
+    cfib_stack_profile_save(getenv("CFIB_STACK_PROFILE"), margin != NULL ? (unsigned)atoi(margin) : _PROFILE_DEF_MARGIN);
+}
+#endif
+
+static void _profile_init()
+{
+    const char* path = getenv("CFIB_STACK_PROFILE");
+    if(path == NULL)
+        return;
+#ifdef _PROFILED_BUILD
+    // Keep the sizes of the tags which this run does not see
+    cfib_stack_profile_load(path);
+    atexit(_profile_save_at_exit);
+#else
+    if(cfib_stack_profile_load(path) < 0)
+        fprintf(stderr, "libcfib: WARNING: failed to load stack profile %s\n", path);
+#endif
+}
+#elif defined(_WITH_SYSAPI_WINDOWS)
+    #error "TODO: WINAPI support."
+#endif
+
+const char* cfib_get_tag_name(const cfib_t* fib)
+{
+    const _prof_tag_t* tag = (const _prof_tag_t*)fib->_private;
+    return tag != NULL ? tag->_name : NULL;
+}
+
+#else /* #ifdef _WITH_C11_ATOMICS */
+
+const char* cfib_get_tag_name(const cfib_t* fib)
+{
+    return NULL;
+}
+
+int cfib_stack_profile_load(const char* path)
+{
+    return -1;
+}
+
+int cfib_stack_profile_save(const char* path, unsigned margin_percent)
+{
+    return -1;
+}
+
+#endif /* #ifdef _WITH_C11_ATOMICS */
+
+#if defined(_WITH_SYSAPI_POSIX) && (defined(_PROFILED_BUILD) || defined(_CFIB_GROW))
+
+/* SIGSEGV handling, shared by the stack profiler and growable stacks.
+ *
+ * Both handle faults on the stacks of fibers, which happen when a stack is
+ * out of room, so the handlers run on the alternate signal stack of the
+ * thread. Faults which are not theirs are passed on to the handler which
+ * was installed before.
+ */
+
+// @internal Writes a message and an address to stderr, async-signal-safe.
+static void _sig_write_addr(const char* msg, const void* addr)
+{
+    char buf[128];
+    size_t len = strlen(msg);
+    if(len > sizeof(buf) - 20)
+        len = sizeof(buf) - 20;
+    memcpy(buf, msg, len);
+    buf[len++] = '0';
+    buf[len++] = 'x';
+    for(int shift = 60; shift >= 0; shift -= 4)
+        buf[len++] = "0123456789abcdef"[((uintptr_t)addr >> shift) & 0xF];
+    buf[len++] = '\n';
+    ssize_t res = write(STDERR_FILENO, buf, len);
+    (void)res;
+}
+
+#define _SIG_STACK_SIZE (MINSIGSTKSZ + 16 * (size_t)_get_sys_page_size())
+
+// @internal Gives the calling thread an alternate signal stack, unless it
+// has one already. Stores the new stack of _SIG_STACK_SIZE bytes to
+// 'sigstk', or NULL if the thread had one. Returns 0 on success, -1 on error.
+static int _sig_init_thread(void** sigstk)
+{
+    *sigstk = NULL;
+    stack_t old;
+    if(sigaltstack(NULL, &old) == 0 && !(old.ss_flags & SS_DISABLE))
+        return 0;
+    size_t sigstk_size = _SIG_STACK_SIZE;
     void *sigstk_mem = mmap(0, sigstk_size, PROT_READ|PROT_WRITE, MAP_ANONYMOUS|MAP_PRIVATE, -1, 0);
-    stack_t sigstk = {
+    if(sigstk_mem == MAP_FAILED) {
+        fprintf(stderr, "libcfib: WARNING: failed to mmap() alternate signal stack!\n");
+        return -1;
+    }
+    stack_t new_stk = {
         .ss_sp = sigstk_mem,
         .ss_size = sigstk_size,
         .ss_flags = 0
     };
-    assert( sigaltstack(&sigstk, NULL) == 0 );
-    called_before = 1;
+    if(sigaltstack(&new_stk, NULL) != 0) {
+        fprintf(stderr, "libcfib: WARNING: sigaltstack() failed!\n");
+        munmap(sigstk_mem, sigstk_size);
+        return -1;
+    }
+    *sigstk = sigstk_mem;
+    return 0;
 }
 
-static void _prof_init() {
+// @internal Installs 'handler' for SIGSEGV, and stores the previous action
+// to 'oact'. Returns 0 on success, -1 on error.
+static int _sig_install_segv(void (*handler)(int, siginfo_t*, void*), struct sigaction* oact)
+{
     sigset_t sigmask;
     sigemptyset(&sigmask);
     sigaddset(&sigmask, SIGURG);
@@ -155,16 +523,177 @@ static void _prof_init() {
     sigaddset(&sigmask, SIGTTOU);
     sigaddset(&sigmask, SIGIO);
     sigaddset(&sigmask, SIGWINCH);
+#ifdef SIGINFO
+    // BSD only
     sigaddset(&sigmask, SIGINFO);
+#endif
     struct sigaction act = {
-        .sa_sigaction = _prof_segv_handler,
+        .sa_sigaction = handler,
         .sa_flags = SA_SIGINFO|SA_ONSTACK|SA_RESTART,
         .sa_mask = sigmask
     };
-    assert( sigaction(SIGSEGV, &act, &_prof_oact) == 0 );
+    if(sigaction(SIGSEGV, &act, oact) != 0) {
+        fprintf(stderr, "libcfib: WARNING: failed to install SIGSEGV handler!\n");
+        return -1;
+    }
+    return 0;
+}
+
+// @internal Passes a signal on to the previous action 'oact'.
+static void _sig_chain(const struct sigaction* oact, int sig, siginfo_t *nfo, void *uap)
+{
+    if(oact->sa_flags & SA_SIGINFO)
+        oact->sa_sigaction(sig, nfo, uap);
+    else if(oact->sa_handler == SIG_DFL || oact->sa_handler == SIG_IGN)
+        // The faulting instruction is restarted, and the default action taken
+        signal(sig, SIG_DFL);
+    else
+        oact->sa_handler(sig);
+}
+
+#endif /* #if defined(_WITH_SYSAPI_POSIX) && (defined(_PROFILED_BUILD) || defined(_CFIB_GROW)) */
+
+#ifdef _PROFILED_BUILD
+
+/* The stack profiler.
+ *
+ * All but the top page of a profiled stack are guarded, and the SIGSEGV
+ * handler below unguards the pages one by one as the stack grows into them.
+ * The handler records each fault in the counters of the fiber's tag, and in
+ * a lock-free ring buffer of the faulting thread. It does not lock, allocate
+ * or use stdio, so faults are cheap and safe wherever they happen.
+ */
+
+// Number of events in the ring of each thread, a power of two
+#define _PROF_RING_SIZE 1024
+
+typedef struct {
+    uint64_t time_ns;
+    uintptr_t addr;
+    uint32_t tag;
+    uint32_t depth;
+} _prof_event_t;
+
+// A single producer (the signal handler of the owning thread) ring, which
+// overwrites the oldest events when full
+typedef struct _prof_ring {
+    atomic_size_t head;
+    // Guarded by _prof_dump_lock
+    size_t tail;
+    size_t dropped;
+    unsigned thread;
+    struct _prof_ring* _next;
+    _prof_event_t events[_PROF_RING_SIZE];
+} _prof_ring_t;
+
+static _Thread_local _prof_ring_t* _prof_ring = NULL;
+static _Atomic(_prof_ring_t*) _prof_rings = NULL;
+static atomic_uint _prof_num_threads = 0;
+
+static uint64_t _prof_start_ns = 0;
+
+#ifdef _WITH_SYSAPI_POSIX
+static pthread_once_t _prof_init_once = PTHREAD_ONCE_INIT;
+
+static struct sigaction _prof_oact;
+
+static inline uint64_t _prof_clock_ns()
+{
+    // clock_gettime() is async-signal-safe
+    struct timespec tp;
+    clock_gettime(CLOCK_MONOTONIC, &tp);
+    return (uint64_t)tp.tv_sec * 1000000000 + (uint64_t)tp.tv_nsec;
+}
+
+static void _prof_record(_prof_tag_t* tag, const void* addr, unsigned stack_diff)
+{
+    atomic_fetch_add_explicit(&tag->num_faults, 1, memory_order_relaxed);
+    _prof_tag_add(tag, stack_diff);
+    _prof_ring_t* ring = _prof_ring;
+    if(ring == NULL)
+        return;
+    size_t i = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    _prof_event_t* ev = &ring->events[i & (_PROF_RING_SIZE - 1)];
+    ev->time_ns = _prof_clock_ns();
+    ev->addr = (uintptr_t)addr;
+    ev->tag = (uint32_t)(tag - _prof_tags);
+    ev->depth = stack_diff / _get_sys_page_size();
+    atomic_store_explicit(&ring->head, i + 1, memory_order_release);
+}
+
+void _prof_segv_handler(int sig, siginfo_t *nfo, void *uap) {
+    if(nfo->si_addr == NULL)
+        goto next;
+    // Any fiber of any thread, not only the current one
+    cfib_t* faulting_fib = cfib_find_by_addr(nfo->si_addr);
+    if(faulting_fib == NULL || faulting_fib->_private == NULL)
+        goto next;
+    void *stack_ceiling = faulting_fib->stack_ceiling;
+    void *stack_floor = faulting_fib->stack_floor;
+    unsigned page_size = _get_sys_page_size();
+    char *page_addr = (char*)nfo->si_addr - ((uintptr_t)nfo->si_addr % page_size);
+    if(page_addr == stack_ceiling) {
+        _sig_write_addr("libcfib: Stack break @ ", nfo->si_addr);
+        goto next;
+    }
+    if(mprotect(page_addr, page_size, PROT_READ|PROT_WRITE) != 0) {
+        _sig_write_addr("libcfib: ERROR: profiler failed to remove guard page from stack @ ", page_addr);
+        goto next;
+    }
+    unsigned stack_diff = (unsigned)((uintptr_t)stack_floor - (uintptr_t)page_addr);
+    _prof_record((_prof_tag_t*)faulting_fib->_private, nfo->si_addr, stack_diff);
+    return;
+next:
+    _sig_chain(&_prof_oact, sig, nfo, uap);
+}
+
+static void _prof_init_thread() {
+    static _Thread_local int called_before = 0;
+    assert(!called_before);
+    // The faults are not handled without it, which was warned about
+    void* sigstk;
+    _sig_init_thread(&sigstk);
+    // The ring outlives the thread, so that it's events can still be dumped
+    _prof_ring_t* ring = mmap(0, sizeof(_prof_ring_t), PROT_READ|PROT_WRITE, MAP_ANONYMOUS|MAP_PRIVATE, -1, 0);
+    assert("libcfib: failed to allocate profiler event ring !!!" && ring != MAP_FAILED);
+    ring->thread = atomic_fetch_add_explicit(&_prof_num_threads, 1, memory_order_relaxed);
+    ring->_next = atomic_load_explicit(&_prof_rings, memory_order_relaxed);
+    while(!atomic_compare_exchange_weak_explicit(&_prof_rings, &ring->_next, ring, memory_order_release, memory_order_relaxed));
+    _prof_ring = ring;
+    called_before = 1;
+}
+
+static void _prof_init() {
+    if(_sig_install_segv(_prof_segv_handler, &_prof_oact) != 0)
+        fprintf(stderr, "libcfib: WARNING: the stacks of the fibers cannot grow!\n");
+    _prof_start_ns = _prof_clock_ns();
+    pthread_once(&_prof_report_once, _prof_report_init);
     fprintf(stderr, "libcfib: Fiber profiler enabled.\n");
 }
 
+// @internal Moves the new events of a ring to 'out', returns their number.
+static size_t _prof_ring_drain(_prof_ring_t* ring, _prof_event_t* out)
+{
+    size_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+    size_t start = ring->tail;
+    if(head - start > _PROF_RING_SIZE)
+        start = head - _PROF_RING_SIZE;
+    for(size_t i = start; i < head; i++)
+        out[i - start] = ring->events[i & (_PROF_RING_SIZE - 1)];
+    // Events overwritten while copying are dropped, along with the slot of
+    // an event which may be being written right now
+    atomic_thread_fence(memory_order_acquire);
+    size_t now = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    size_t valid = start;
+    if(now + 1 > _PROF_RING_SIZE && now + 1 - _PROF_RING_SIZE > valid)
+        valid = now + 1 - _PROF_RING_SIZE;
+    if(valid > head)
+        valid = head;
+    ring->dropped += valid - ring->tail;
+    ring->tail = head;
+    memmove(out, out + (valid - start), (head - valid) * sizeof(_prof_event_t));
+    return head - valid;
+}
 
 #elif defined(_WITH_SYSAPI_WINDOWS) /* #ifdef _WITH_SYSAPI_POSIX */
     #error "TODO: WINAPI support."
@@ -172,120 +701,1362 @@ static void _prof_init() {
 
 #endif /* #ifdef _PROFILED_BUILD */
 
-cfib_t* cfib_init_thread()
+#if defined(_WITH_C11_ATOMICS) && defined(_WITH_SYSAPI_POSIX)
+
+static pthread_mutex_t _prof_dump_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// @internal Returns the number of histogram buckets in use by any tag.
+static unsigned _prof_hist_used(unsigned num_tags)
 {
-    static _Thread_local int called_before = 0;
-    if(called_before) {
-        fprintf(stderr, "libcfib_C11: WARNING: cfib_init_thread() called more than once per thread!\n");
-        return _cfib_tls.current;
+    unsigned used = 1;
+    for(unsigned t = 0; t < num_tags; t++)
+        for(unsigned b = used; b < _PROF_HIST_BUCKETS; b++)
+            if(atomic_load_explicit(&_prof_tags[t].depth_hist[b], memory_order_relaxed) != 0)
+                used = b + 1;
+    return used;
+}
+
+static void _prof_dump_csv(FILE* out, unsigned num_tags)
+{
+    unsigned buckets = _prof_hist_used(num_tags);
+    fprintf(out, "tag,fibers,faults,samples,max_stack_size");
+    for(unsigned b = 0; b < buckets; b++)
+        fprintf(out, ",pages_%u", 1u << b);
+    fputc('\n', out);
+    for(unsigned t = 0; t < num_tags; t++) {
+        _prof_tag_t* tag = &_prof_tags[t];
+        fprintf(out, "%s,%u,%u,%u,%u", tag->_name,
+                atomic_load_explicit(&tag->num_fibers, memory_order_relaxed),
+                atomic_load_explicit(&tag->num_faults, memory_order_relaxed),
+                atomic_load_explicit(&tag->num_samples, memory_order_relaxed),
+                atomic_load_explicit(&tag->max_stack_size, memory_order_relaxed));
+        for(unsigned b = 0; b < buckets; b++)
+            fprintf(out, ",%u", atomic_load_explicit(&tag->depth_hist[b], memory_order_relaxed));
+        fputc('\n', out);
     }
-#if defined(_PROFILED_BUILD) && defined (_WITH_SYSAPI_POSIX)
-    _prof_init_thread();
-    pthread_once(&_prof_init_once, _prof_init);
-#elif defined(_PROFILED_BUILD) && defined (_WITH_SYSAPI_WINDOWS)
-    #error "TODO: WINAPI profiling support."
-#endif
-    _cfib_tls.current = calloc(1, sizeof(cfib_t));
-    _cfib_tls.current->_magic = (uintptr_t)_cfib_tls.current ^ _CFIB_MGK1;
-    called_before = 1;
-    return _cfib_tls.current;
 }
 
-cfib_t* cfib_new(cfib_func start_routine, void* args, const cfib_attr_t* attr)
+static void _prof_dump_json(FILE* out, unsigned num_tags)
 {
-    cfib_t* ret = (cfib_t*)calloc(1, sizeof(cfib_t));
-    if(ret == NULL)
-        return NULL;
-    cfib_attr_t _attr;
-    unsigned page_size = _get_sys_page_size();
-    if(attr != NULL) {
-        _attr.stack_size = _align_size_to_page(attr->stack_size);
-        if(_attr.stack_size < (2 * page_size))
-            _attr.stack_size = 2 * page_size;
-        _attr.flags = attr->flags;
-        _attr.tag = attr->tag;
-        attr = &_attr;
-    } else
-        attr = &_default_attr;
+    fprintf(out, "{\n  \"page_size\": %u,\n  \"tags\": [", (unsigned)_get_sys_page_size());
+    for(unsigned t = 0; t < num_tags; t++) {
+        _prof_tag_t* tag = &_prof_tags[t];
+        fprintf(out, "%s\n    {\"name\": \"%s\", \"fibers\": %u, \"faults\": %u, \"samples\": %u, \"max_stack_size\": %u, \"depth_pages\": [",
+                t > 0 ? "," : "", tag->_name,
+                atomic_load_explicit(&tag->num_fibers, memory_order_relaxed),
+                atomic_load_explicit(&tag->num_faults, memory_order_relaxed),
+                atomic_load_explicit(&tag->num_samples, memory_order_relaxed),
+                atomic_load_explicit(&tag->max_stack_size, memory_order_relaxed));
+        const char* sep = "";
+        for(unsigned b = 0; b < _PROF_HIST_BUCKETS; b++) {
+            unsigned n = atomic_load_explicit(&tag->depth_hist[b], memory_order_relaxed);
+            if(n == 0)
+                continue;
+            fprintf(out, "%s{\"min\": %u, \"max\": %u, \"count\": %u}", sep, 1u << b, (2u << b) - 1, n);
+            sep = ", ";
+        }
+        fprintf(out, "]}");
+    }
+    fprintf(out, "\n  ]");
 #ifdef _PROFILED_BUILD
-    void *stack_ceiling = NULL;
-    int res = posix_memalign(&stack_ceiling, page_size, attr->stack_size);
-    if(res != 0) {
-        fprintf(stderr, "libcfib: cfib_new() failed to allocate profiled stack !!!");
-        goto _errexit;
+    fprintf(out, ",\n  \"threads\": [");
+    _prof_event_t* events = malloc(_PROF_RING_SIZE * sizeof(_prof_event_t));
+    const char* sep = "";
+    for(_prof_ring_t* ring = atomic_load_explicit(&_prof_rings, memory_order_acquire); ring != NULL && events != NULL; ring = ring->_next) {
+        size_t n = _prof_ring_drain(ring, events);
+        fprintf(out, "%s\n    {\"thread\": %u, \"dropped\": %zu, \"events\": [", sep, ring->thread, ring->dropped);
+        for(size_t i = 0; i < n; i++)
+            fprintf(out, "%s\n      {\"time_ns\": %llu, \"addr\": \"%#lx\", \"tag\": \"%s\", \"depth_pages\": %u}",
+                    i > 0 ? "," : "", (unsigned long long)(events[i].time_ns - _prof_start_ns),
+                    (unsigned long)events[i].addr, _prof_tags[events[i].tag]._name, events[i].depth);
+        fprintf(out, "%s]}", n > 0 ? "\n    " : "");
+        sep = ",";
     }
-    res = mprotect(stack_ceiling, attr->stack_size - _get_sys_page_size(), PROT_NONE);
-    assert("libcfib: cfib_new() failed to apply guard on profiled stack !!!" && res == 0);
-    ret->stack_ceiling = (unsigned char*)stack_ceiling;
-    ret->sp = ret->stack_floor = ret->stack_ceiling + attr->stack_size;
-    if(attr->tag != NULL)
-        ret->_private = (void*)attr->tag();
+    free(events);
+    fprintf(out, "\n  ]");
+#endif
+    fprintf(out, "\n}\n");
+}
+
+int cfib_prof_dump(const char* path)
+{
+    FILE* out = stderr;
+    if(path != NULL && (out = fopen(path, "w")) == NULL) {
+        fprintf(stderr, "libcfib: WARNING: cfib_prof_dump() failed to open %s\n", path);
+        return -1;
+    }
+    size_t len = path != NULL ? strlen(path) : 0;
+    int csv = len >= 4 && strcmp(path + len - 4, ".csv") == 0;
+    pthread_mutex_lock(&_prof_dump_lock);
+    unsigned num_tags = atomic_load_explicit(&_prof_num_tags, memory_order_acquire);
+    if(csv)
+        _prof_dump_csv(out, num_tags);
     else
-        ret->_private = (void*)&_default_tag;
+        _prof_dump_json(out, num_tags);
+    pthread_mutex_unlock(&_prof_dump_lock);
+    if(out != stderr && fclose(out) != 0)
+        return -1;
+    return 0;
+}
 
-#else /* #ifdef _PROFILED_BUILD  */
+#else /* #if defined(_WITH_C11_ATOMICS) && defined(_WITH_SYSAPI_POSIX) */
 
-#ifdef _WITH_SYSAPI_POSIX
-#if defined(__FreeBSD__)
-    int mmap_flags = MAP_STACK|MAP_PRIVATE;
+int cfib_prof_dump(const char* path)
+{
+    // Nothing is counted without atomics
+    return -1;
+}
+
+#endif /* #if defined(_WITH_C11_ATOMICS) && defined(_WITH_SYSAPI_POSIX) */
+
+#ifdef _INSTRUMENTED_BUILD
+
+/* Switch statistics.
+ *
+ * The instrumented build assembles the context switches as _cfib_swap_raw()
+ * and so on, and puts the functions below in front of them. They do not
+ * look at _cfib_tls, which cfib_swap_from() does not update, but account
+ * the fiber which is suspended before the switch, and the same fiber again
+ * when it resumes after the switch. A fiber which has never run resumes in
+ * _cfib_call instead, which calls _cfib_instr_enter(). A running fiber has
+ * a nonzero swap_tick.
+ *
+ * The statistics are kept in a block of their own, which only this build
+ * allocates, so the other builds do not carry them in every cfib_t. A fiber
+ * whose block could not be allocated is not counted.
+ */
+
+struct _instr_stats {
+    unsigned long long num_swaps;
+    unsigned long long run_ticks;
+    // Tick at which the fiber was last swapped in
+    unsigned long long swap_tick;
+};
+
+void _cfib_swap_raw(unsigned char** sp1, unsigned char* sp2);
+cfib_transfer_t _cfib_transfer_raw(unsigned char** sp1, unsigned char* sp2, void* data, cfib_t* from);
+cfib_transfer_t _cfib_ontop_raw(unsigned char** sp1, unsigned char* sp2, void* data, cfib_t* from, cfib_ontop_fn fn);
+
+// @internal Returns the current tick, TSC cycles if we have them.
+static inline unsigned long long _instr_now()
+{
+#if defined(__x86_64__)
+    return __rdtsc();
+#elif defined(_WITH_SYSAPI_POSIX)
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000ULL + (unsigned long long)ts.tv_nsec;
 #else
-    int mmap_flags = MAP_ANONYMOUS|MAP_PRIVATE;
+    #error "TODO: tick source for the instrumented build."
 #endif
+}
+
+// @internal Allocates the statistics of a fiber, returns NULL on failure.
+static struct _instr_stats* _instr_alloc(cfib_t* fib)
+{
+    fib->_reserved.instr = calloc(1, sizeof(struct _instr_stats));
+    return (struct _instr_stats*)fib->_reserved.instr;
+}
+
+// @internal Accounts the end of a run of the fiber.
+static inline void _instr_suspend(cfib_t* fib)
+{
+    struct _instr_stats* st = (struct _instr_stats*)fib->_reserved.instr;
+    if(st == NULL)
+        return;
+    st->run_ticks += _instr_now() - st->swap_tick;
+    st->swap_tick = 0;
+}
+
+// @internal Accounts a swap into the fiber.
+static inline void _instr_resume(cfib_t* fib)
+{
+    struct _instr_stats* st = (struct _instr_stats*)fib->_reserved.instr;
+    if(st == NULL)
+        return;
+    st->num_swaps++;
+    st->swap_tick = _instr_now();
+}
+
+// @internal Returns the fiber whose stack pointer is saved to sp1.
+static inline cfib_t* _instr_owner(unsigned char** sp1)
+{
+    return (cfib_t*)((unsigned char*)sp1 - offsetof(cfib_t, sp));
+}
+
+// @internal Called from assembler when a fiber runs for the first time.
+void _cfib_instr_enter(cfib_t* fib)
+{
+    _instr_resume(fib);
+}
+
+void _cfib_swap(unsigned char** sp1, unsigned char* sp2)
+{
+    cfib_t* self = _instr_owner(sp1);
+    _instr_suspend(self);
+    _cfib_swap_raw(sp1, sp2);
+    _instr_resume(self);
+}
+
+cfib_transfer_t _cfib_transfer(unsigned char** sp1, unsigned char* sp2, void* data, cfib_t* from)
+{
+    cfib_t* self = _instr_owner(sp1);
+    _instr_suspend(self);
+    cfib_transfer_t ret = _cfib_transfer_raw(sp1, sp2, data, from);
+    _instr_resume(self);
+    return ret;
+}
+
+cfib_transfer_t _cfib_ontop(unsigned char** sp1, unsigned char* sp2, void* data, cfib_t* from, cfib_ontop_fn fn)
+{
+    cfib_t* self = _instr_owner(sp1);
+    _instr_suspend(self);
+    cfib_transfer_t ret = _cfib_ontop_raw(sp1, sp2, data, from, fn);
+    _instr_resume(self);
+    return ret;
+}
+
+int cfib_stats(const cfib_t* fib, cfib_stats_t* stats)
+{
+    const struct _instr_stats* st = (const struct _instr_stats*)fib->_reserved.instr;
+    if(st == NULL)
+        return -1;
+    stats->num_swaps = st->num_swaps;
+    stats->run_ticks = st->run_ticks;
+    if(st->swap_tick != 0)
+        stats->run_ticks += _instr_now() - st->swap_tick;
+    return 0;
+}
+
+#else
+
+int cfib_stats(const cfib_t* fib, cfib_stats_t* stats)
+{
+    // The swap path of this build does not count anything
+    return -1;
+}
+
+#endif /* #ifdef _INSTRUMENTED_BUILD */
+
+/* Fiber-local storage.
+ *
+ * A fiber gets an array of CFIB_KEYS_MAX values on the first call to
+ * cfib_setspecific(), so cfib_getspecific() is an index into it. The keys
+ * are global, and created and deleted under a lock. The destructors are
+ * copied under the lock before they are run, so a key may be created in
+ * another thread meanwhile.
+ */
+
+static void (*_key_destructors[CFIB_KEYS_MAX])(void*);
+static unsigned char _key_used[CFIB_KEYS_MAX];
+#ifdef _WITH_SYSAPI_POSIX
+static pthread_mutex_t _key_lock = PTHREAD_MUTEX_INITIALIZER;
+#define _KEY_LOCK() pthread_mutex_lock(&_key_lock)
+#define _KEY_UNLOCK() pthread_mutex_unlock(&_key_lock)
+#else
+    #error "TODO: WINAPI support."
+#endif
+
+int cfib_key_create(cfib_key_t* key, void (*destructor)(void*))
+{
+    _KEY_LOCK();
+    for(cfib_key_t k = 0; k < CFIB_KEYS_MAX; k++) {
+        if(!_key_used[k]) {
+            _key_used[k] = 1;
+            _key_destructors[k] = destructor;
+            _KEY_UNLOCK();
+            *key = k;
+            return 0;
+        }
+    }
+    _KEY_UNLOCK();
+    return EAGAIN;
+}
+
+int cfib_key_delete(cfib_key_t key)
+{
+    int ret = EINVAL;
+    _KEY_LOCK();
+    if(key < CFIB_KEYS_MAX && _key_used[key]) {
+        _key_used[key] = 0;
+        _key_destructors[key] = NULL;
+        ret = 0;
+    }
+    _KEY_UNLOCK();
+    return ret;
+}
+
+int cfib_setspecific(cfib_key_t key, const void* value)
+{
+    if(key >= CFIB_KEYS_MAX)
+        return EINVAL;
+    cfib_t* self = cfib_get_current();
+    if(self->_reserved.specific == NULL) {
+        if(value == NULL)
+            return 0;
+        self->_reserved.specific = calloc(CFIB_KEYS_MAX, sizeof(void*));
+        if(self->_reserved.specific == NULL)
+            return ENOMEM;
+    }
+    self->_reserved.specific[key] = (void*)value;
+    return 0;
+}
+
+// @internal Runs the destructors of the fiber-local values of a fiber, and
+// frees it's slot array.
+static void _fls_release(cfib_t* fib)
+{
+    void (*destructors[CFIB_KEYS_MAX])(void*);
+    for(int iter = 0; iter < CFIB_DESTRUCTOR_ITERATIONS; iter++) {
+        int called = 0;
+        _KEY_LOCK();
+        memcpy(destructors, _key_destructors, sizeof(destructors));
+        _KEY_UNLOCK();
+        for(cfib_key_t k = 0; k < CFIB_KEYS_MAX; k++) {
+            void* value = fib->_reserved.specific[k];
+            if(value != NULL && destructors[k] != NULL) {
+                fib->_reserved.specific[k] = NULL;
+                destructors[k](value);
+                called = 1;
+            }
+        }
+        if(!called)
+            break;
+    }
+    free(fib->_reserved.specific);
+    fib->_reserved.specific = NULL;
+}
+
+cfib_t* cfib_init_thread()
+{
+    static _Thread_local int called_before = 0;
+    if(called_before) {
+        fprintf(stderr, "libcfib_C11: WARNING: cfib_init_thread() called more than once per thread!\n");
+        return _cfib_tls.current;
+    }
+#if defined(_PROFILED_BUILD) && defined (_WITH_SYSAPI_POSIX)
+    _prof_init_thread();
+    pthread_once(&_prof_init_once, _prof_init);
+#elif defined(_PROFILED_BUILD) && defined (_WITH_SYSAPI_WINDOWS)
+    #error "TODO: WINAPI profiling support."
+#endif
+    _cfib_tls.current = calloc(1, sizeof(cfib_t));
+    _cfib_tls.current->_magic = (uintptr_t)_cfib_tls.current ^ _CFIB_MGK1;
+#ifdef _INSTRUMENTED_BUILD
+    // The thread's own fiber is running from now on
+    struct _instr_stats* st = _instr_alloc(_cfib_tls.current);
+    if(st != NULL)
+        st->swap_tick = _instr_now();
+#endif
+    called_before = 1;
+    return _cfib_tls.current;
+}
+
+#if !defined(_PROFILED_BUILD) && defined(_WITH_SYSAPI_POSIX)
+
+/* Stack pool.
+ *
+ * Mapping a stack costs an mmap() and an mprotect() for the guard page, and
+ * unmapping it costs a munmap() with the TLB shootdown that comes with it.
+ * When the pool is enabled for a thread (see cfib_pool_set_high_water()),
+ * cfib_unmap() does not release the stack but pushes it to a per-thread free
+ * list, and cfib_new() pops a stack from there before it considers mapping a
+ * new one. A pooled stack keeps it's guard page, so it can be reused as-is.
+ *
+ * The free lists are bucketed by the page aligned stack size. Most programs
+ * use only a handful of different stack sizes, so a small array of buckets
+ * searched linearly is good enough. If all buckets are taken by other sizes,
+ * the stack is simply unmapped.
+ *
+ * The list node of a pooled stack is stored at the top (floor end) of the
+ * stack itself, since that page is resident anyway.
+ */
+#define _CFIB_POOL_BUCKETS 8
+
+struct _cfib_pool_node {
+    struct _cfib_pool_node* next;
+    // Bytes at the top of the stack which may be non-zero
+    size_t dirty;
+};
+
+struct _cfib_pool {
+    size_t high_water;
+    size_t cached;
+    struct {
+        size_t stack_size;
+        struct _cfib_pool_node* head;
+    } buckets[_CFIB_POOL_BUCKETS];
+};
+
+static _Thread_local struct _cfib_pool _pool = {
+    .high_water = 0,
+    .cached = 0
+};
+
+#endif /* #if !defined(_PROFILED_BUILD) && defined(_WITH_SYSAPI_POSIX) */
+
+#ifdef _WITH_SYSAPI_POSIX
+
+/* The pooled stacks and the pending auto-recycled fiber of a thread are
+ * released by a thread-specific data destructor when the thread exits.
+ */
+static pthread_once_t _pool_key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t _pool_key;
+static _Thread_local int _pool_key_set = 0;
+
+static void _pool_thread_exit(void* unused)
+{
+    // Releasing the fiber may pool it's stack, which registers us again
+    _pool_key_set = 0;
+    cfib_pool_trim();
+}
+
+static void _pool_key_init()
+{
+    pthread_key_create(&_pool_key, _pool_thread_exit);
+}
+
+// @internal Makes sure the destructor runs when this thread exits.
+static inline void _pool_thread_exit_register()
+{
+    if(_pool_key_set)
+        return;
+    pthread_once(&_pool_key_once, _pool_key_init);
+    pthread_setspecific(_pool_key, (void*)&_recycled);
+    _pool_key_set = 1;
+}
+
+#endif /* #ifdef _WITH_SYSAPI_POSIX */
+
+#ifndef _PROFILED_BUILD
+
+#ifdef _WITH_SYSAPI_POSIX
+
+#ifdef __linux__
+
+// The size of a transparent huge page on AMD64
+#define _HUGEPAGE_SIZE ((size_t)1 << 21)
+
+// From <linux/mempolicy.h>, which is not always installed
+#define _MPOL_PREFERRED 1
+#define _MPOL_MF_MOVE   (1 << 1)
+
+static pthread_once_t _numa_once = PTHREAD_ONCE_INIT;
+// The highest NUMA node, 0 if there is only one, or the kernel has no NUMA
+static int _numa_max_node = 0;
+
+static void _numa_init()
+{
+    FILE* f = fopen("/sys/devices/system/node/possible", "r");
+    if(f == NULL)
+        return;
+    int first, last;
+    if(fscanf(f, "%d-%d", &first, &last) == 2)
+        _numa_max_node = last;
+    fclose(f);
+}
+
+// @internal Gives 'len' bytes at 'm' a preferred memory policy for the NUMA
+// node which 'attr' asks for, and migrates the pages already there.
+static void _stack_bind(unsigned char* m, size_t len, const cfib_attr_t* attr)
+{
+    pthread_once(&_numa_once, _numa_init);
+    if(_numa_max_node == 0)
+        return;
+    int node;
+    if(attr->flags & CFIB_NUMA_NODE) {
+        node = attr->numa_node;
+    } else {
+        unsigned cpu, local;
+        if(syscall(SYS_getcpu, &cpu, &local, NULL) != 0)
+            return;
+        node = (int)local;
+    }
+    unsigned long mask[16] = {0};
+    const int bits = 8 * sizeof(unsigned long);
+    if(node < 0 || node > _numa_max_node || node >= bits * 16)
+        return;
+    mask[node / bits] = 1UL << (node % bits);
+    // If this fails, e.g. mbind() is not supported, the stack just stays
+    // wherever it is first touched
+    syscall(SYS_mbind, m, len, _MPOL_PREFERRED, mask, (unsigned long)(bits * 16), _MPOL_MF_MOVE);
+}
+
+#endif /* #ifdef __linux__ */
+
+#ifdef _CFIB_GROW
+
+/* Growable stacks.
+ *
+ * A CFIB_STACK_GROW stack is reserved with MAP_NORESERVE and no access, and
+ * only it's top _GROW_COMMIT bytes are committed, ie. made accessible. When
+ * the fiber touches the part below, the SIGSEGV handler commits the pages
+ * down to the fault, and _GROW_STEP bytes more so that a deep call does not
+ * fault on every page, and the fiber goes on. The committed part is always
+ * the top of the stack, down to the stack_committed member of the fiber.
+ * The guard page below the stack ceiling is never committed, so a fault
+ * there means that the fiber hit the limit. That is reported, and passed on to the previous
+ * handler, which by default kills the process.
+ */
+
+#define _GROW_COMMIT (2 * (size_t)_get_sys_page_size())
+#define _GROW_STEP (4 * (size_t)_get_sys_page_size())
+
+static pthread_once_t _grow_init_once = PTHREAD_ONCE_INIT;
+
+static struct sigaction _grow_oact;
+
+// Frees the alternate signal stacks of the threads when they exit
+static pthread_key_t _grow_key;
+
+// Set if the handler or the key could not be installed
+static int _grow_init_failed = 0;
+
+// Set once this thread is ready for growable stacks
+static _Thread_local int _grow_thread_ready = 0;
+
+static void _grow_segv_handler(int sig, siginfo_t *nfo, void *uap)
+{
+    if(nfo->si_addr == NULL)
+        goto next;
+    // Any fiber of any thread, the current one may be out of date
+    cfib_t* fib = cfib_find_by_addr(nfo->si_addr);
+    if(fib == NULL || !(fib->_flags & CFIB_STACK_GROW))
+        goto next;
+    unsigned char* page_addr = (unsigned char*)nfo->si_addr - ((uintptr_t)nfo->si_addr % _get_sys_page_size());
+    if(page_addr < fib->stack_ceiling) {
+        _sig_write_addr("libcfib: ERROR: growable stack overflow, limit reached by fiber @ ", fib);
+        goto next;
+    }
+    // A fault on a committed page is not ours
+    if(page_addr >= fib->_reserved.stack_committed)
+        goto next;
+    unsigned char* begin = (size_t)(page_addr - fib->stack_ceiling) > _GROW_STEP ? page_addr - _GROW_STEP : fib->stack_ceiling;
+    if(mprotect(begin, (size_t)(fib->_reserved.stack_committed - begin), PROT_READ|PROT_WRITE) != 0) {
+        _sig_write_addr("libcfib: ERROR: failed to commit growable stack @ ", page_addr);
+        goto next;
+    }
+    fib->_reserved.stack_committed = begin;
+    return;
+next:
+    _sig_chain(&_grow_oact, sig, nfo, uap);
+}
+
+static void _grow_thread_exit(void* sigstk)
+{
+    stack_t cur;
+    // Someone may have replaced it, leave theirs alone
+    if(sigaltstack(NULL, &cur) == 0 && cur.ss_sp == sigstk) {
+        stack_t off = {.ss_sp = NULL, .ss_size = 0, .ss_flags = SS_DISABLE};
+        sigaltstack(&off, NULL);
+    }
+    munmap(sigstk, _SIG_STACK_SIZE);
+}
+
+static void _grow_init()
+{
+    if(pthread_key_create(&_grow_key, _grow_thread_exit) != 0) {
+        fprintf(stderr, "libcfib: WARNING: pthread_key_create() failed!\n");
+        _grow_init_failed = 1;
+        return;
+    }
+    if(_sig_install_segv(_grow_segv_handler, &_grow_oact) != 0)
+        _grow_init_failed = 1;
+}
+
+#endif /* #ifdef _CFIB_GROW */
+
+// @internal Maps 'len' bytes for stacks, advised as 'attr' asks. With
+// CFIB_HUGEPAGE, the end of the mapping, where the top of the (last) stack
+// is, is aligned to a huge page. Returns NULL if mapping failed.
+static unsigned char* _map_stacks(size_t len, const cfib_attr_t* attr)
+{
 #if defined(__FreeBSD__)
-    void *m = mmap(0, attr->stack_size, PROT_READ|PROT_WRITE, mmap_flags, -1, 0);
+    int mmap_flags = MAP_STACK|MAP_PRIVATE;
 #else
-    void *m = mmap(0, attr->stack_size + page_size, PROT_READ|PROT_WRITE, mmap_flags, -1, 0);
+    int mmap_flags = MAP_ANONYMOUS|MAP_PRIVATE;
 #endif
-    if(m == MAP_FAILED) {
-        fprintf(stderr, "libcfib: WARNING: cfib_new() failed to mmap() stack!\n");
-        goto _errexit;
+    int prot = PROT_READ|PROT_WRITE;
+#ifdef _CFIB_GROW
+    if(attr->flags & CFIB_STACK_GROW) {
+        // Reserved only, _stack_map() commits the top
+        prot = PROT_NONE;
+        mmap_flags |= MAP_NORESERVE;
     }
+#endif
+    size_t slack = 0;
+#if defined(__linux__) && defined(MADV_HUGEPAGE)
+    if((attr->flags & CFIB_HUGEPAGE) && len >= _HUGEPAGE_SIZE)
+        slack = _HUGEPAGE_SIZE;
+#endif
+    unsigned char *m = mmap(0, len + slack, prot, mmap_flags, -1, 0);
+    if(m == MAP_FAILED)
+        return NULL;
+    if(slack != 0) {
+        // Cut the slack off both ends
+        unsigned char* end = (unsigned char*)((uintptr_t)(m + len + slack) & ~(uintptr_t)(_HUGEPAGE_SIZE - 1));
+        if(end - len > m)
+            munmap(m, (size_t)(end - len - m));
+        if(end < m + len + slack)
+            munmap(end, (size_t)(m + len + slack - end));
+        m = end - len;
+    }
+#ifdef __linux__
+#ifdef MADV_HUGEPAGE
+    // Fails if THP is not supported, which is fine
+    if(attr->flags & CFIB_HUGEPAGE)
+        madvise(m, len, MADV_HUGEPAGE);
+#endif
+    if(attr->flags & (CFIB_NUMA_LOCAL|CFIB_NUMA_NODE))
+        _stack_bind(m, len, attr);
+#endif
+    return m;
+}
+
+#endif /* #ifdef _WITH_SYSAPI_POSIX */
+
+// @internal Maps a new stack of 'stack_size' bytes with a guard page below it.
+// Returns the stack ceiling, or NULL if mapping failed.
+static unsigned char* _stack_map(size_t stack_size, const cfib_attr_t* attr)
+{
+#ifdef _WITH_SYSAPI_POSIX
+    unsigned page_size = _get_sys_page_size();
+#if defined(__FreeBSD__)
+    unsigned char *m = _map_stacks(stack_size, attr);
+#else
+    unsigned char *m = _map_stacks(stack_size + page_size, attr);
+#endif
+    if(m == NULL)
+        return NULL;
 #ifndef __FreeBSD__
     assert("Failed to set guard page!" && mprotect(m, page_size, PROT_NONE) == 0);
     m += page_size;
 #endif
-    ret->stack_ceiling = (unsigned char*)m;
-    ret->sp = ret->stack_floor = ret->stack_ceiling + attr->stack_size;
+#ifdef _CFIB_GROW
+    if((attr->flags & CFIB_STACK_GROW) && mprotect(m + stack_size - _GROW_COMMIT, _GROW_COMMIT, PROT_READ|PROT_WRITE) != 0) {
+        munmap(m - page_size, stack_size + page_size);
+        return NULL;
+    }
+#endif
+    return m;
+#elif defined (_WITH_SYSAPI_WINDOWS)
+    #error "TODO: WINAPI support."
+#endif
+}
+
+// @internal Unmaps a stack mapped by _stack_map(), including it's guard page.
+static void _stack_unmap(unsigned char* stack_ceiling, size_t stack_size)
+{
+#ifdef _WITH_SYSAPI_POSIX
+#ifdef __FreeBSD__
+    munmap(stack_ceiling, stack_size);
+#else
+    munmap(stack_ceiling - _get_sys_page_size(), stack_size + _get_sys_page_size());
+#endif
 #elif defined (_WITH_SYSAPI_WINDOWS)
     #error "TODO: WINAPI support."
 #endif
+}
+
+#ifdef _WITH_SYSAPI_POSIX
+
+// @internal Pops a pooled stack of 'stack_size' bytes, or returns NULL.
+// Stores the number of possibly non-zero bytes at it's top to 'dirty'.
+static unsigned char* _pool_pop(size_t stack_size, size_t* dirty)
+{
+    for(int i = 0; i < _CFIB_POOL_BUCKETS; i++) {
+        if(_pool.buckets[i].stack_size != stack_size)
+            continue;
+        struct _cfib_pool_node* node = _pool.buckets[i].head;
+        if(node == NULL)
+            return NULL;
+        _pool.buckets[i].head = node->next;
+        _pool.cached -= stack_size;
+        *dirty = node->dirty;
+        return (unsigned char*)(node + 1) - stack_size;
+    }
+    return NULL;
+}
+
+// @internal Pushes a stack to the pool. Returns 0 if the pool cannot take it.
+static int _pool_push(unsigned char* stack_ceiling, size_t stack_size, size_t dirty)
+{
+    if(_pool.cached + stack_size > _pool.high_water)
+        return 0;
+    int free_bucket = -1;
+    for(int i = 0; i < _CFIB_POOL_BUCKETS; i++) {
+        if(_pool.buckets[i].stack_size == stack_size) {
+            free_bucket = i;
+            break;
+        }
+        if(free_bucket < 0 && _pool.buckets[i].head == NULL)
+            free_bucket = i;
+    }
+    if(free_bucket < 0)
+        return 0;
+    // Make sure the cached stacks get unmapped when this thread exits
+    _pool_thread_exit_register();
+    struct _cfib_pool_node* node = (struct _cfib_pool_node*)(stack_ceiling + stack_size) - 1;
+    _pool.buckets[free_bucket].stack_size = stack_size;
+    node->next = _pool.buckets[free_bucket].head;
+    node->dirty = dirty > sizeof(*node) ? dirty : sizeof(*node);
+    _pool.buckets[free_bucket].head = node;
+    _pool.cached += stack_size;
+    return 1;
+}
+
+#endif /* #ifdef _WITH_SYSAPI_POSIX */
+
+#endif /* #ifndef _PROFILED_BUILD */
 
+int cfib_grow_init_thread()
+{
+#ifdef _CFIB_GROW
+    if(_grow_thread_ready)
+        return 0;
+    pthread_once(&_grow_init_once, _grow_init);
+    if(_grow_init_failed)
+        return -1;
+    // The handler runs on it, since the fault is on the fiber's stack
+    void* sigstk;
+    if(_sig_init_thread(&sigstk) != 0)
+        return -1;
+    if(sigstk != NULL)
+        pthread_setspecific(_grow_key, sigstk);
+    _grow_thread_ready = 1;
+#endif
+    return 0;
+}
+
+void cfib_pool_set_high_water(size_t bytes)
+{
+#if !defined(_PROFILED_BUILD) && defined(_WITH_SYSAPI_POSIX)
+    _pool.high_water = bytes;
+    if(_pool.cached > _pool.high_water)
+        cfib_pool_trim();
+#endif
+}
+
+// @internal Releases the pending auto-recycled fiber, if any. Must not be
+// called on it's stack.
+static void _release_recycled()
+{
+    if(_recycled != NULL) {
+        cfib_release(_recycled);
+        _recycled = NULL;
+    }
+}
+
+void cfib_pool_trim()
+{
+    _release_recycled();
+#if !defined(_PROFILED_BUILD) && defined(_WITH_SYSAPI_POSIX)
+    for(int i = 0; i < _CFIB_POOL_BUCKETS; i++) {
+        size_t stack_size = _pool.buckets[i].stack_size;
+        struct _cfib_pool_node* node = _pool.buckets[i].head;
+        while(node != NULL) {
+            struct _cfib_pool_node* next = node->next;
+            _stack_unmap((unsigned char*)(node + 1) - stack_size, stack_size);
+            node = next;
+        }
+        _pool.buckets[i].head = NULL;
+        _pool.buckets[i].stack_size = 0;
+    }
+    _pool.cached = 0;
+#endif
+}
+
+// @internal Copies 'attr' into 'buf' with the stack size sanitized, or
+// returns the default attributes if 'attr' is NULL.
+static const cfib_attr_t* _resolve_attr(const cfib_attr_t* attr, cfib_attr_t* buf)
+{
+    if(attr == NULL)
+        return &_default_attr;
+    unsigned page_size = _get_sys_page_size();
+    buf->stack_size = attr->stack_size;
+#if !defined(_PROFILED_BUILD) && defined(_WITH_C11_ATOMICS) && defined(_WITH_SYSAPI_POSIX)
+    // The stack profile knows better, the profiled build measures instead
+    if(attr->tag != NULL) {
+        unsigned profile_size = _prof_tag_size(attr->tag());
+        if(profile_size != 0)
+            buf->stack_size = profile_size;
+    }
+#endif
+    buf->stack_size = _align_size_to_page(buf->stack_size);
+    if(buf->stack_size < (2 * page_size))
+        buf->stack_size = 2 * page_size;
+    buf->flags = attr->flags;
+#ifdef _PROFILED_BUILD
+    // Profiled stacks are not mapped
+    buf->flags &= ~CFIB_ONSTACK;
+#endif
+#ifndef _CFIB_GROW
+    buf->flags &= ~CFIB_STACK_GROW;
+#endif
+    buf->tag = attr->tag;
+    buf->numa_node = attr->numa_node;
+    return buf;
+}
+
+// @internal Initializes the stack window of an allocated fiber whose stack
+// ceiling has already been set, and marks the fiber valid.
+static void _init_fiber(cfib_t* fib, cfib_func start_routine, void* args, const cfib_attr_t* attr)
+{
+    fib->sp = fib->stack_floor = fib->stack_ceiling + attr->stack_size;
+    if(attr->flags & CFIB_ONSTACK)
+        fib->sp = fib->stack_floor -= _ONSTACK_SIZE;
+#ifdef _CFIB_GROW
+    if(attr->flags & CFIB_STACK_GROW)
+        fib->_reserved.stack_committed = fib->stack_ceiling + attr->stack_size - _GROW_COMMIT;
+#endif
+#ifdef _PROFILED_BUILD
+    _prof_tag_t* tag = _prof_tag_get(attr->tag != NULL ? attr->tag() : NULL);
+    atomic_fetch_add_explicit(&tag->num_fibers, 1, memory_order_relaxed);
+    fib->_private = (void*)tag;
+#elif defined(_WITH_C11_ATOMICS) && defined(_WITH_SYSAPI_POSIX)
+    if(attr->tag != NULL || (attr->flags & CFIB_STACK_PAINT)) {
+        _prof_tag_t* tag = _prof_tag_get(attr->tag != NULL ? attr->tag() : NULL);
+        atomic_fetch_add_explicit(&tag->num_fibers, 1, memory_order_relaxed);
+        fib->_private = (void*)tag;
+        pthread_once(&_prof_report_once, _prof_report_init);
+    }
+#endif
+#ifdef _INSTRUMENTED_BUILD
+    _instr_alloc(fib);
+#endif
+    _cfib_init_stack(&fib->sp, start_routine, args, fib);
+    fib->_magic = (uintptr_t)fib ^ _CFIB_MGK1;
+}
+
+#ifdef _PROFILED_BUILD
+// @internal Allocates a profiled stack, all of which but the top page is
+// guarded, so that the profiler sees every page the stack grows into.
+static unsigned char* _prof_stack_alloc(size_t stack_size)
+{
+    void *stack_ceiling = NULL;
+    int res = posix_memalign(&stack_ceiling, _get_sys_page_size(), stack_size);
+    if(res != 0) {
+        fprintf(stderr, "libcfib: cfib_new() failed to allocate profiled stack !!!");
+        return NULL;
+    }
+    res = mprotect(stack_ceiling, stack_size - _get_sys_page_size(), PROT_NONE);
+    assert("libcfib: cfib_new() failed to apply guard on profiled stack !!!" && res == 0);
+    return (unsigned char*)stack_ceiling;
+}
+#endif
+
+#if !defined(_PROFILED_BUILD) && defined(_WITH_SYSAPI_POSIX)
+
+/* Stack painting.
+ *
+ * The stack of a fiber created with CFIB_STACK_PAINT is zero filled, and
+ * the pages it has never touched are not mapped in. The deepest page which
+ * is resident, and the deepest non-zero word in it, tell how deep the stack
+ * has grown since. A fresh mapping is zero filled and not resident, so only
+ * reused stacks need to be painted, by dropping the pages they dirtied.
+ */
+
+// @internal Returns the first non-zero word in [p, end), or 'end'. Both
+// must be 128 byte aligned.
+static const unsigned char* _scan_nonzero(const unsigned char* p, const unsigned char* end)
+{
+#if defined(__AVX2__)
+    for(; p < end; p += 128) {
+        __m256i v = _mm256_or_si256(
+                _mm256_or_si256(_mm256_load_si256((const __m256i*)p), _mm256_load_si256((const __m256i*)(p + 32))),
+                _mm256_or_si256(_mm256_load_si256((const __m256i*)(p + 64)), _mm256_load_si256((const __m256i*)(p + 96))));
+        if(!_mm256_testz_si256(v, v))
+            break;
+    }
+#elif defined(__SSE2__)
+    const __m128i zero = _mm_setzero_si128();
+    for(; p < end; p += 64) {
+        __m128i v = _mm_or_si128(
+                _mm_or_si128(_mm_load_si128((const __m128i*)p), _mm_load_si128((const __m128i*)(p + 16))),
+                _mm_or_si128(_mm_load_si128((const __m128i*)(p + 32)), _mm_load_si128((const __m128i*)(p + 48))));
+        if(_mm_movemask_epi8(_mm_cmpeq_epi8(v, zero)) != 0xFFFF)
+            break;
+    }
+#endif
+    const uintptr_t* w = (const uintptr_t*)p;
+    while((const unsigned char*)w < end && *w == 0)
+        w++;
+    return (const unsigned char*)w;
+}
+
+// @internal Paints a reused stack, of which 'dirty' bytes at the top may
+// be non-zero.
+static void _paint_stack(unsigned char* stack_ceiling, size_t stack_size, size_t dirty)
+{
+    size_t page_size = _get_sys_page_size();
+    unsigned char* stack_floor = stack_ceiling + stack_size;
+    if(dirty > stack_size)
+        dirty = stack_size;
+    // The top page is needed again right away, clear it in place
+    size_t top = dirty < page_size ? dirty : page_size;
+    memset(stack_floor - top, 0, top);
+    if(dirty <= page_size)
+        return;
+    unsigned char* begin = stack_floor - page_size - _align_size_to_page(dirty - page_size);
+    size_t len = (size_t)(stack_floor - page_size - begin);
+#ifdef __linux__
+    // Zero fills the pages, and they are not resident until touched again
+    if(madvise(begin, len, MADV_DONTNEED) == 0)
+        return;
+#endif
+    memset(begin, 0, len);
+}
+
+// @internal Adds the high water mark of a painted fiber to it's tag.
+// Returns the number of bytes at the top of the stack which may be
+// non-zero, which is the whole stack unless it is painted.
+static size_t _paint_sample(cfib_t* fib)
+{
+    if(!(fib->_flags & CFIB_STACK_PAINT))
+        return (size_t)(_stack_top(fib) - fib->stack_ceiling);
+    size_t used = cfib_stack_high_water(fib);
+#ifdef _WITH_C11_ATOMICS
+    _prof_tag_t* tag = (_prof_tag_t*)fib->_private;
+    if(tag != NULL) {
+        atomic_fetch_add_explicit(&tag->num_samples, 1, memory_order_relaxed);
+        _prof_tag_add(tag, (unsigned)used);
+    }
+#endif
+    return used;
+}
+
+#endif /* #if !defined(_PROFILED_BUILD) && defined(_WITH_SYSAPI_POSIX) */
+
+size_t cfib_stack_high_water(const cfib_t* fib)
+{
+#if !defined(_PROFILED_BUILD) && defined(_WITH_SYSAPI_POSIX)
+    size_t page_size = _get_sys_page_size();
+    unsigned char* p = fib->stack_ceiling;
+    // Page by page, so the fiber itself counts for CFIB_ONSTACK
+    unsigned char* floor = _stack_top(fib);
+    // Find the deepest page the stack has touched
+    unsigned char vec[512];
+    while(p < floor) {
+        size_t pages = (size_t)(floor - p) / page_size;
+        if(pages > sizeof(vec))
+            pages = sizeof(vec);
+        if(mincore(p, pages * page_size, (void*)vec) != 0)
+            break;
+        size_t i = 0;
+        while(i < pages && !(vec[i] & 1))
+            i++;
+        p += i * page_size;
+        if(i < pages)
+            break;
+    }
+    if(p == floor)
+        return 0;
+    // If the page holds nothing but zeros, the stack has still touched it
+    const unsigned char* used = _scan_nonzero(p, p + page_size);
+    return (size_t)(floor - (used < p + page_size ? used : p));
+#else
+    return 0;
+#endif
+}
+
+cfib_t* cfib_new(cfib_func start_routine, void* args, const cfib_attr_t* attr)
+{
+    cfib_attr_t _attr;
+    attr = _resolve_attr(attr, &_attr);
+#ifndef _PROFILED_BUILD
+    // Reuse a finished fiber as is, if it's stack has the right size and
+    // layout. The profiled build does not, since the stack would not be
+    // guarded anymore.
+    if(_recycled != NULL && (size_t)(_stack_top(_recycled) - _recycled->stack_ceiling) == attr->stack_size
+            && (_recycled->_flags & (CFIB_ONSTACK|CFIB_STACK_GROW)) == (attr->flags & (CFIB_ONSTACK|CFIB_STACK_GROW))) {
+        cfib_t* ret = _recycled;
+        unsigned char* m = ret->stack_ceiling;
+        unsigned char* committed = ret->_reserved.stack_committed;
+        _recycled = NULL;
+#ifdef _WITH_SYSAPI_POSIX
+        size_t dirty = _paint_sample(ret);
+        if(attr->flags & CFIB_STACK_PAINT)
+            _paint_stack(m, attr->stack_size, dirty);
+#endif
+#ifdef _INSTRUMENTED_BUILD
+        free(ret->_reserved.instr);
+#endif
+        memset(ret, 0, sizeof(cfib_t));
+        ret->stack_ceiling = m;
+        _init_fiber(ret, start_routine, args, attr);
+        // A growable stack stays as far grown as it was
+        if(attr->flags & CFIB_STACK_GROW)
+            ret->_reserved.stack_committed = committed;
+        ret->_flags = attr->flags & (CFIB_AUTO_RECYCLE|CFIB_STACK_PAINT|CFIB_ONSTACK|CFIB_STACK_GROW);
+        return ret;
+    }
+#endif
+    // Put the stack of a finished fiber to the pool, it may be popped below
+    _release_recycled();
+#ifdef _PROFILED_BUILD
+    cfib_t* ret = (cfib_t*)calloc(1, sizeof(cfib_t));
+    if(ret == NULL)
+        return NULL;
+    ret->stack_ceiling = _prof_stack_alloc(attr->stack_size);
+    if(ret->stack_ceiling == NULL) {
+        free(ret);
+        return NULL;
+    }
+#else /* #ifdef _PROFILED_BUILD  */
+    cfib_t* ret = NULL;
+    unsigned char *m = NULL;
+#ifdef _CFIB_GROW
+    // The first fault would kill the process
+    if((attr->flags & CFIB_STACK_GROW) && cfib_grow_init_thread() != 0)
+        return NULL;
+#endif
+#ifdef _WITH_SYSAPI_POSIX
+    size_t dirty;
+    // Pooled stacks are committed as a whole, growable ones are not pooled
+    if(!(attr->flags & CFIB_STACK_GROW))
+        m = _pool_pop(attr->stack_size, &dirty);
+    if(m != NULL && (attr->flags & CFIB_STACK_PAINT))
+        _paint_stack(m, attr->stack_size, dirty);
+#ifdef __linux__
+    // The pooled stack may have been used on another node
+    if(m != NULL && (attr->flags & (CFIB_NUMA_LOCAL|CFIB_NUMA_NODE)))
+        _stack_bind(m, attr->stack_size, attr);
+#endif
+#endif
+    if(m == NULL)
+        m = _stack_map(attr->stack_size, attr);
+    if(m == NULL) {
+        fprintf(stderr, "libcfib: WARNING: cfib_new() failed to mmap() stack!\n");
+        return NULL;
+    }
+    if(attr->flags & CFIB_ONSTACK) {
+        // The fiber takes the top of the mapping, the stack starts below it
+        ret = (cfib_t*)(m + attr->stack_size - _ONSTACK_SIZE);
+        memset(ret, 0, sizeof(cfib_t));
+    } else {
+        ret = (cfib_t*)calloc(1, sizeof(cfib_t));
+        if(ret == NULL) {
+            _stack_unmap(m, attr->stack_size);
+            return NULL;
+        }
+    }
+    ret->stack_ceiling = m;
 #endif /* #ifdef _PROFILED_BUILD */
-    _cfib_init_stack(&ret->sp, start_routine, args);
-    ret->_magic = (uintptr_t)ret ^ _CFIB_MGK1;
+    _init_fiber(ret, start_routine, args, attr);
+    ret->_flags = attr->flags & (CFIB_AUTO_RECYCLE|CFIB_STACK_PAINT|CFIB_ONSTACK|CFIB_STACK_GROW);
+    _reg_stack(ret, ret);
+    return ret;
+}
+
+cfib_t* cfib_new_reserve(cfib_func start_routine, size_t size, void** reserved, const cfib_attr_t* attr)
+{
+    cfib_t* ret = cfib_new(start_routine, NULL, attr);
+    if(ret == NULL)
+        return NULL;
+    size = (size + 15) & ~(size_t)15;
+    if(size + _get_sys_page_size() > (size_t)(ret->stack_floor - ret->stack_ceiling)) {
+        fprintf(stderr, "libcfib: WARNING: cfib_new_reserve() can not reserve %zu bytes of a %zu byte stack!\n", size, (size_t)(ret->stack_floor - ret->stack_ceiling));
+        cfib_release(ret);
+        return NULL;
+    }
+    // The fiber has not run, so it's initial frame can be synthesized again
+    // below the reserved space
+    ret->sp = ret->stack_floor - size;
+    *reserved = ret->sp;
+    _cfib_init_stack(&ret->sp, start_routine, *reserved, ret);
+    return ret;
+}
+
+#if !defined(_PROFILED_BUILD) && defined(_WITH_SYSAPI_POSIX)
+#ifdef __FreeBSD__
+#define _SLAB_GUARD_SIZE 0
+#else
+#define _SLAB_GUARD_SIZE _get_sys_page_size()
+#endif
+#endif
+
+cfib_t* cfib_new_batch(size_t n, const cfib_func* start_routines, void* const* args, const cfib_attr_t* attr)
+{
+    if(n == 0)
+        return NULL;
+    cfib_t* ret = (cfib_t*)calloc(n, sizeof(cfib_t));
+    if(ret == NULL)
+        return NULL;
+    cfib_attr_t _attr;
+    attr = _resolve_attr(attr, &_attr);
+    // The fibers are allocated as an array, and the stacks as one mapping
+    if(attr == &_attr)
+        _attr.flags &= ~(CFIB_ONSTACK|CFIB_STACK_GROW);
+#ifdef _PROFILED_BUILD
+    for(size_t i = 0; i < n; i++) {
+        ret[i].stack_ceiling = _prof_stack_alloc(attr->stack_size);
+        if(ret[i].stack_ceiling == NULL) {
+            while(i-- > 0)
+                free(ret[i].stack_ceiling);
+            goto _errexit;
+        }
+    }
+#elif defined(_WITH_SYSAPI_POSIX)
+    /* All stacks are carved out of a single mapping, each preceded by it's
+     * own guard page:
+     *
+     * [guard][stack 0][guard][stack 1] ... [guard][stack n-1]
+     *
+     * This costs one mmap() and n mprotect() calls, and each stack is laid
+     * out exactly like one mapped by _stack_map(), so they can be unmapped or
+     * pooled one by one with cfib_unmap() as well.
+     */
+    size_t stride = attr->stack_size + _SLAB_GUARD_SIZE;
+    if(n > SIZE_MAX / stride)
+        goto _errexit;
+    unsigned char *m = _map_stacks(stride * n, attr);
+    if(m == NULL) {
+        fprintf(stderr, "libcfib: WARNING: cfib_new_batch() failed to mmap() stacks!\n");
+        goto _errexit;
+    }
+    for(size_t i = 0; i < n; i++) {
+#ifndef __FreeBSD__
+        // Without it, an overflow would corrupt the neighbouring stack
+        if(mprotect(m + i * stride, _SLAB_GUARD_SIZE, PROT_NONE) != 0) {
+            fprintf(stderr, "libcfib: WARNING: cfib_new_batch() failed to set guard page!\n");
+            munmap(m, stride * n);
+            goto _errexit;
+        }
+#endif
+        ret[i].stack_ceiling = m + i * stride + _SLAB_GUARD_SIZE;
+    }
+#elif defined (_WITH_SYSAPI_WINDOWS)
+    #error "TODO: WINAPI support."
+#endif
+    for(size_t i = 0; i < n; i++) {
+        _init_fiber(&ret[i], start_routines[i], args != NULL ? args[i] : NULL, attr);
+        // The stacks are fresh, so already painted
+        ret[i]._flags = attr->flags & CFIB_STACK_PAINT;
+        _reg_stack(&ret[i], &ret[i]);
+    }
     return ret;
 _errexit:
-    if(ret != NULL) free(ret);
+    free(ret);
     return NULL;
 }
 
+void cfib_unmap_batch(cfib_t* fibs, size_t n)
+{
+    if(fibs == NULL || n == 0)
+        return;
+#ifdef _PROFILED_BUILD
+    for(size_t i = 0; i < n; i++)
+        cfib_unmap(&fibs[i]);
+#elif defined(_WITH_SYSAPI_POSIX)
+    for(size_t i = 0; i < n; i++) {
+        if(fibs[i]._reserved.specific != NULL)
+            _fls_release(&fibs[i]);
+#ifdef _INSTRUMENTED_BUILD
+        free(fibs[i]._reserved.instr);
+#endif
+        _paint_sample(&fibs[i]);
+        _reg_stack(&fibs[i], NULL);
+    }
+    unsigned char* m = fibs[0].stack_ceiling - _SLAB_GUARD_SIZE;
+    munmap(m, (size_t)(fibs[n - 1].stack_floor - m));
+    memset(fibs, 0, n * sizeof(cfib_t));
+#elif defined (_WITH_SYSAPI_WINDOWS)
+    #error "TODO: WINAPI support."
+#endif
+    free(fibs);
+}
+
+#if !defined(_PROFILED_BUILD) && defined(_WITH_SYSAPI_POSIX)
+
+// Hot margin of the automatic reclaim policy of this thread, 0 if disabled
+static _Thread_local size_t _reclaim_margin = 0;
+static _Thread_local unsigned _reclaim_flags = 0;
+
+#ifdef _WITH_C11_ATOMICS
+static atomic_size_t _reclaimed_bytes = 0;
+#else
+static size_t _reclaimed_bytes = 0;
+#endif
+
+// Number of words checked below the hot margin by the automatic policy
+#define _RECLAIM_PROBE_WORDS 8
+
+// @internal Releases the stack pages between 'ceiling' and 'sp' - 'margin'.
+// With 'probe', does it only if the stack has data right below the margin,
+// ie. the stack has been deeper than that since the last release. 'fib' is
+// the owner of the stack, or NULL for a pooled stack.
+static size_t _reclaim(const cfib_t* fib, unsigned char* ceiling, unsigned char* sp, size_t margin, unsigned flags, int probe)
+{
+    size_t page_size = _get_sys_page_size();
+    // At least a page, which also leaves room for the frames of madvise()
+    // when a fiber releases it's own stack
+    if(margin < page_size)
+        margin = page_size;
+    if((size_t)(sp - ceiling) <= margin)
+        return 0;
+    unsigned char* limit = (unsigned char*)((uintptr_t)(sp - margin) & ~(uintptr_t)(page_size - 1));
+    if(limit <= ceiling)
+        return 0;
+#ifdef _CFIB_GROW
+    if(fib != NULL && (fib->_flags & CFIB_STACK_GROW)) {
+        // Below the committed part the pages are inaccessible, and hold
+        // nothing to release, so neither probe nor release them
+        if(limit <= fib->_reserved.stack_committed)
+            return 0;
+        ceiling = fib->_reserved.stack_committed;
+    }
+#endif
+    if(probe) {
+        const uintptr_t* words = (const uintptr_t*)limit - _RECLAIM_PROBE_WORDS;
+        uintptr_t used = 0;
+        for(int i = 0; i < _RECLAIM_PROBE_WORDS; i++)
+            used |= words[i];
+        if(used == 0)
+            return 0;
+    }
+    size_t len = (size_t)(limit - ceiling);
+    int res = -1;
+#ifdef MADV_FREE
+    // Not supported before Linux 4.5, fall back to MADV_DONTNEED
+    if(flags & CFIB_RECLAIM_LAZY)
+        res = madvise(ceiling, len, MADV_FREE);
+#endif
+    if(res != 0 && madvise(ceiling, len, MADV_DONTNEED) != 0)
+        return 0;
+    _reclaimed_bytes += len;
+    return len;
+}
+
+#endif /* #if !defined(_PROFILED_BUILD) && defined(_WITH_SYSAPI_POSIX) */
+
+size_t cfib_reclaim(cfib_t* fib, size_t hot_margin, unsigned flags)
+{
+#if !defined(_PROFILED_BUILD) && defined(_WITH_SYSAPI_POSIX)
+    unsigned char here;
+    // The saved stack pointer of a running fiber is stale
+    unsigned char* sp = fib == _cfib_tls.current ? &here : fib->sp;
+    return _reclaim(fib, fib->stack_ceiling, sp, hot_margin, flags, 0);
+#else
+    return 0;
+#endif
+}
+
+size_t cfib_reclaim_auto(cfib_t* fib)
+{
+#if !defined(_PROFILED_BUILD) && defined(_WITH_SYSAPI_POSIX)
+    if(_reclaim_margin == 0)
+        return 0;
+    unsigned char here;
+    unsigned char* sp = fib == _cfib_tls.current ? &here : fib->sp;
+    return _reclaim(fib, fib->stack_ceiling, sp, _reclaim_margin, _reclaim_flags, 1);
+#else
+    return 0;
+#endif
+}
+
+void cfib_reclaim_set_policy(size_t hot_margin, unsigned flags)
+{
+#if !defined(_PROFILED_BUILD) && defined(_WITH_SYSAPI_POSIX)
+    _reclaim_margin = hot_margin;
+    _reclaim_flags = flags;
+#endif
+}
+
+size_t cfib_reclaimed_bytes()
+{
+#if !defined(_PROFILED_BUILD) && defined(_WITH_SYSAPI_POSIX)
+    return _reclaimed_bytes;
+#else
+    return 0;
+#endif
+}
+
 void cfib_unmap(cfib_t* context) {
+    if(context->_reserved.specific != NULL)
+        _fls_release(context);
+#ifdef _INSTRUMENTED_BUILD
+    free(context->_reserved.instr);
+    context->_reserved.instr = NULL;
+#endif
+    _reg_stack(context, NULL);
 #ifdef _PROFILED_BUILD
 
+    // Pages which the stack never grew into are still guarded, and free()
+    // may write to them, so unguard the whole stack first.
+    mprotect(context->stack_ceiling, (size_t)(context->stack_floor - context->stack_ceiling), PROT_READ|PROT_WRITE);
     free(context->stack_ceiling);
+    memset(context, 0, sizeof(cfib_t));
 
 #else
 
+    unsigned char* stack_ceiling = context->stack_ceiling;
+    unsigned char* stack_top = _stack_top(context);
+    size_t stack_size = (size_t)(stack_top - stack_ceiling);
 #ifdef _WITH_SYSAPI_POSIX
-#ifdef __FreeBSD__
-    munmap(context->stack_ceiling, (size_t)(context->stack_floor - context->stack_ceiling));
-#else
-    context->stack_ceiling -= _get_sys_page_size();
-    munmap(context->stack_ceiling, (size_t)(context->stack_floor - context->stack_ceiling));
+    size_t dirty = _paint_sample(context);
+    int poolable = !(context->_flags & CFIB_STACK_GROW);
 #endif
-#elif _WITH_SYSAPI_WINDOWS
-    #error "TODO: WINAPI support."
+    // Also a CFIB_ONSTACK fiber, which goes away with it's stack: a pooled
+    // stack stays mapped, and a stale pointer must not pass for a fiber
+    memset(context, 0, sizeof(cfib_t));
+#ifdef _WITH_SYSAPI_POSIX
+    if(poolable && _pool_push(stack_ceiling, stack_size, dirty)) {
+        // A pooled stack is idle, release all of it but the hot top
+        if(_reclaim_margin != 0)
+            _reclaim(NULL, stack_ceiling, stack_top, _reclaim_margin, _reclaim_flags, 1);
+    } else
 #endif
+        _stack_unmap(stack_ceiling, stack_size);
 
 #endif
-    memset(context, 0, sizeof(cfib_t));
 }
 
-// @internal This function is called from assembler if a fiber returns.
-void _cfib_exit_thread() {
+void cfib_release(cfib_t* fib)
+{
+    int onstack = (fib->_flags & CFIB_ONSTACK) != 0;
+    cfib_unmap(fib);
+    if(!onstack)
+        free(fib);
+}
+
+void cfib_set_successor(cfib_t* fib, cfib_t* successor)
+{
+    fib->_successor = successor;
+}
+
+void cfib_join(cfib_t* fib)
+{
+    assert("cfib_join() called on a CFIB_AUTO_RECYCLE fiber !!!" && !(fib->_flags & CFIB_AUTO_RECYCLE));
+    while(!cfib_is_finished(fib))
+        cfib_swap(fib);
+}
+
+// @internal This function is called from assembler when the function of a
+// fiber returns. It marks the fiber finished, and leaves it for good. The
+// fiber is passed by the assembler, since _cfib_tls.current is not up to
+// date if the fiber was swapped in by cfib_swap_from().
+void _cfib_exit_fiber(cfib_t* self) {
+    // The destructors of fiber-local values run in the finishing fiber, and
+    // may swap away and back
+    if(self->_reserved.specific != NULL)
+        _fls_release(self);
+    cfib_t* next = self->_successor != NULL ? self->_successor : _cfib_tls.previous;
+    self->_flags |= _CFIB_FINISHED;
+    if(next == NULL || next == self || cfib_is_finished(next)) {
+        fprintf(stderr, "libcfib: ERROR: finished fiber %p has no live successor or resumer to return to !!!\n", (void*)self);
+        abort();
+    }
+    if(self->_flags & CFIB_AUTO_RECYCLE) {
+        // We are not on the stack of the previous one, release it now
+        _release_recycled();
+        _recycled = self;
 #ifdef _WITH_SYSAPI_POSIX
-    pthread_exit(NULL);
-#elif defined (_WITH_SYSAPI_WINDOWS)
-    #error "TODO: WINAPI support."
+        _pool_thread_exit_register();
 #endif
+    }
+    _cfib_tls.previous = self;
+    _cfib_tls.current = next;
+    _cfib_swap(&self->sp, next->sp);
+    // Never reached, nobody swaps back into a finished fiber
+    abort();
 }
@@ -50,7 +50,7 @@ extern "C" {
  * of this struct. At the time of writing, cfib_get_current() and
  * cfib_swap() were both such static inline functions.
  */
-typedef struct {
+typedef struct _cfib {
     /** Stack pointer of a saved context.
      *
      * Just before pivoting stack to new context's stack pointer, the old
@@ -84,8 +84,65 @@ typedef struct {
      * semantics are known only to the library.
      */
     void* _private;
+    /** Library-internal flags of the fiber.
+     */
+    unsigned _flags;
+    /** The fiber to swap into when this fiber finishes, see cfib_set_successor().
+     */
+    struct _cfib* _successor;
+    /** Link to the next fiber in an intrusive queue.
+     *
+     * The scheduler (see cfib_sched.h) threads it's ready queue through
+     * this member, so that queueing a fiber never allocates memory. A fiber
+     * can be in at most one such queue at a time.
+     */
+    struct _cfib* _next;
+    /** Library-internal data of the optional parts of the library.
+     *
+     * The scheduler (cfib_sched.h), the M:N runtime (cfib_mt.h), fiber-local
+     * storage and growable stacks keep their per-fiber state here, and the
+     * instrumented build points to it's switch statistics from here. Client
+     * code should NEVER access these members.
+     */
+    struct {
+        /** State of the fiber in the scheduler. */
+        unsigned state;
+        /** Set when the fiber has a pending remote wakeup. */
+        unsigned woken;
+        /** The scheduler which a fiber created via cfib_spawn() belongs to. */
+        void* owner;
+        /** Link in the remote wakeup inbox of the owning scheduler.
+         *
+         * Unlike the other members, this one is accessed atomically by
+         * several threads (see cfib_wake_remote()). NULL while not in an
+         * inbox.
+         */
+        struct _cfib* remote_next;
+        /** Entrypoint of a fiber created via cfib_mt_spawn(). */
+        void (*start_routine)(void*);
+        /** Fiber-local values, CFIB_KEYS_MAX of them, or NULL if none were
+         * set (see cfib_setspecific()).
+         */
+        void** specific;
+        /** The lowest committed address of a CFIB_STACK_GROW stack. */
+        unsigned char* stack_committed;
+        /** Switch statistics, allocated only by the instrumented build. */
+        void* instr;
+    } _reserved;
 } cfib_t;
 
+/** Per-fiber switch statistics, see cfib_stats().
+ */
+typedef struct {
+    /** Times the fiber has been swapped in. */
+    unsigned long long num_swaps;
+    /** Time the fiber has spent running, in TSC cycles on x86-64 and in
+     * nanoseconds of CLOCK_MONOTONIC elsewhere. Time spent in another
+     * thread of the process while the fiber was swapped in, e.g. blocked
+     * in a system call, is counted too. */
+    unsigned long long run_ticks;
+} cfib_stats_t;
+
 /** Function signature type for fiber entrypoint.
  *
  * This is the signature type for fiber entrypoint function. It can be used
@@ -110,10 +167,118 @@ typedef struct {
     unsigned stack_size;
     unsigned flags;
     struct _cfib_tag* (*tag)(void);
+    /** The NUMA node of the stack, if CFIB_NUMA_NODE is set. */
+    int numa_node;
 } cfib_attr_t;
 
 #define CFIB_STKEXEC    0x00000001
 #define CFIB_PREFAULT   0x00000016
+/** Release the fiber automatically when it finishes.
+ *
+ * When the function of such a fiber returns, the fiber is unmapped and
+ * freed as if by cfib_unmap() and free(), so it's stack goes back to the
+ * stack pool for reuse. The pointer to the fiber becomes invalid as soon
+ * as it finishes, so such a fiber can not be joined. A fiber can not
+ * release it's own stack, so the release is done by the next cfib_new(),
+ * cfib_pool_trim() or fiber completion in the same thread, or when the
+ * thread exits.
+ *
+ * Ignored by cfib_new_batch().
+ */
+#define CFIB_AUTO_RECYCLE 0x00000020
+/** Paint the stack, so that it's high water mark can be measured.
+ *
+ * The stack is zero filled when the fiber is created, and the pages it does
+ * not use stay unmapped. Fresh stacks already are like that, so only stacks
+ * reused from the stack pool are painted, by dropping their used pages with
+ * madvise(). See cfib_stack_high_water(). When a painted fiber is unmapped,
+ * it's high water mark is counted in the statistics of it's tag (see
+ * cfib_prof_dump()). cfib_swap() does not pay anything for this.
+ *
+ * Ignored in the profiled build of the library, which measures stacks with
+ * guard pages instead.
+ */
+#define CFIB_STACK_PAINT 0x00000040
+/** Back the stack with transparent huge pages.
+ *
+ * The stack is advised with madvise(MADV_HUGEPAGE), and if it is at least
+ * 2 MiB, mapped so that it's top ends on a 2 MiB boundary, where the kernel
+ * can back it with huge pages. For cfib_new_batch(), the whole mapping of
+ * the batch is advised and aligned, but the guard pages between the stacks
+ * split it, so smaller stacks do not get huge pages.
+ *
+ * Saves TLB misses for fibers which use deep stacks, at the cost of memory,
+ * since a huge page is resident as a whole. Fibers which use little of
+ * their stacks do not gain: the tops of aligned stacks compete for the same
+ * cache sets, which makes swapping among many of them slower.
+ *
+ * Stacks reused from the stack pool keep the pages they were mapped with.
+ * Ignored where THP is not supported, and in the profiled build.
+ */
+#define CFIB_HUGEPAGE    0x00000080
+/** Place the stack on the NUMA node of the calling thread.
+ *
+ * The node is the one of the CPU which the thread runs on when the fiber is
+ * created, and the stack is given a preferred memory policy for it with
+ * mbind(). Stacks reused from the stack pool are migrated to the node.
+ *
+ * Ignored on machines with a single NUMA node, where mbind() is not
+ * supported, and in the profiled build.
+ */
+#define CFIB_NUMA_LOCAL  0x00000100
+/** Place the stack on the NUMA node cfib_attr_t.numa_node.
+ *
+ * Like CFIB_NUMA_LOCAL, but with an explicit node. Ignored as well if the
+ * node does not exist. Takes precedence over CFIB_NUMA_LOCAL.
+ */
+#define CFIB_NUMA_NODE   0x00000200
+/** Place the fiber at the top of it's own stack mapping.
+ *
+ * The cfib_t lives right above the stack floor, rounded up to whole cache
+ * lines, instead of in a separate allocation, so creating the fiber takes a
+ * single mapping (or a stack from the pool), and swapping into it touches
+ * the same page for the fiber and the top of it's stack. The stack is
+ * smaller by the size of the cfib_t.
+ *
+ * Such a fiber goes away with it's stack in cfib_unmap(), so it must not be
+ * passed to free(). cfib_release() does the right thing for any fiber.
+ *
+ * Ignored by cfib_new_batch(), and in the profiled build.
+ */
+#define CFIB_ONSTACK     0x00000400
+/** Grow the stack on demand, up to cfib_attr_t.stack_size.
+ *
+ * The stack is reserved with MAP_NORESERVE, and only it's top two pages are
+ * committed at first. When the fiber grows the stack past the committed
+ * part, the fault is handled on the alternate signal stack of the thread,
+ * which commits the pages down to the fault and a few more, after which the
+ * fiber goes on. So the stack size can be the worst case of the fiber, while
+ * the memory committed to the stack is what the fiber actually used. The
+ * kernel does not fault on behalf of a system call, so a system call which
+ * writes to the part of the stack which is not committed yet, e.g. read()
+ * into a large buffer on the stack, fails with EFAULT instead.
+ *
+ * If the fiber overflows the whole stack, the overflow is reported on
+ * stderr, and the fault is passed on to the SIGSEGV handler which was
+ * installed before, by default crashing the process as usual.
+ *
+ * The first such fiber installs a SIGSEGV handler, which passes on the
+ * faults which are not it's own. The first such fiber created in a thread
+ * also gives the thread an alternate signal stack, unless it has one
+ * already, and it is unmapped when the thread exits. The workers of the M:N
+ * runtime (see cfib_mt.h) get theirs when they first run such a fiber. A
+ * thread which swaps into such a fiber created by another thread, without
+ * creating one itself, has to call cfib_grow_init_thread() first. If the
+ * handler or the alternate signal stack cannot be installed, cfib_new()
+ * fails. Growable stacks are not pooled (see cfib_pool_set_high_water()).
+ *
+ * Ignored by cfib_new_batch(), without C11 atomics, and in the profiled
+ * build, which grows all stacks page by page anyway.
+ */
+#define CFIB_STACK_GROW  0x00000800
+
+/* Values of cfib_t._flags */
+#define _CFIB_FINISHED  0x00000001
 
 struct _cfib_tls {
     cfib_t* current;
@@ -154,11 +319,31 @@ extern _Thread_local struct _cfib_tls _cfib_tls;
  * called. Prior to calling cfib_init_thread(), calling cfib_swap() will lead 
  * to program exit with an error message disciplining the programmer who was
  * too proud to read the fucking documentation.
+ *
+ * In the profiled build, also gives the thread an alternate signal stack,
+ * unless it has one, for the faults of the stack profiler. The other builds
+ * do it only when the thread creates it's first fiber with a growable stack
+ * (see CFIB_STACK_GROW).
  * 
  * @return a context for this thread's main fiber.
  */
 cfib_t* cfib_init_thread();
 
+/** Prepares the calling thread to run fibers with growable stacks.
+ *
+ * Gives the thread an alternate signal stack, unless it has one, which is
+ * unmapped when the thread exits. Called by the library when the thread
+ * creates it's first fiber with CFIB_STACK_GROW, and by the M:N runtime
+ * when a worker first runs one. Other threads which swap into such fibers
+ * must call it themselves. Does nothing after the first successful call in
+ * a thread, and in builds without growable stacks.
+ *
+ * @return 0 on success, or -1 if the SIGSEGV handler or the alternate signal
+ *         stack could not be installed (a warning is printed on stderr). The
+ *         fibers with growable stacks must not be run in the thread then.
+ */
+int cfib_grow_init_thread();
+
 /** Allocates a fiber and initialies it's stack.
  *
  * This function allocates a new fiber and it's stack, then initializes the 
@@ -196,17 +381,92 @@ cfib_t* cfib_init_thread();
  * @param[in] start_routine a pointer to a function to be executed when cfib_swap() is called on this context.
  * @param[in] args pointer to argument data passed as 1st argument to start_routine.
  * @param[in] attr attributes for this fiber, if NULL, defaults are used
- * @return pointer to the new fiber, or NULL if memory allocation failed.
+ * @return pointer to the new fiber, or NULL if memory allocation failed, or
+ *         if the thread could not be prepared for CFIB_STACK_GROW.
  */
 cfib_t* cfib_new(cfib_func start_routine, void* args, const cfib_attr_t* attr);
 
-#ifdef __cplusplus
-template <typename T>
-static inline cfib_t* cfib_new(void (*start_routine)(T*), T* args, const cfib_attr_t* attr) {
-    return cfib_new((cfib_fn)start_routine, (void*)args, attr);
-}
-#endif
+/** Create a fiber, with space for it's arguments on it's own stack.
+ *
+ * Works like cfib_new(), but 'size' bytes at the top of the stack of the
+ * new fiber are reserved, and passed to 'start_routine' as it's argument.
+ * The caller fills them in before the fiber is started, so the arguments
+ * of a fiber need no allocation of their own. The reserved space is
+ * aligned at 16 bytes, and it is valid until the fiber is unmapped.
+ *
+ * @param[in] start_routine a pointer to a function to be executed when cfib_swap() is called on this context.
+ * @param[in] size the number of bytes to reserve, at most the stack size minus one page.
+ * @param[out] reserved set to point to the reserved space.
+ * @param[in] attr attributes for this fiber, if NULL, defaults are used
+ * @return pointer to the new fiber, or NULL if memory allocation failed or 'size' is too large.
+ */
+cfib_t* cfib_new_reserve(cfib_func start_routine, size_t size, void** reserved, const cfib_attr_t* attr);
+
+/** Allocates 'n' fibers at once and initializes their stacks.
+ *
+ * Works like calling cfib_new() 'n' times, except that all stacks are carved
+ * out of one memory mapping (each stack still has it's own guard page) and
+ * all fibers are allocated as one array. This is much faster than 'n' calls
+ * to cfib_new() when creating large amounts of fibers, and keeps the number
+ * of memory mappings of the process low.
+ *
+ * Fiber 'i' of the batch starts executing 'start_routines[i]' with argument
+ * 'args[i]'. If 'args' is NULL, all fibers receive NULL as their argument.
+ *
+ * The whole batch should be destroyed with cfib_unmap_batch(). Individual
+ * fibers of the batch may be passed to cfib_unmap(), but then the batch
+ * must not be passed to cfib_unmap_batch() anymore; only free() the array.
+ *
+ * @param[in] n number of fibers to allocate.
+ * @param[in] start_routines array of 'n' fiber entrypoint functions.
+ * @param[in] args array of 'n' arguments, or NULL.
+ * @param[in] attr attributes for all of the fibers, if NULL, defaults are used
+ * @return pointer to an array of 'n' fibers, or NULL if 'n' is 0, or if memory
+ *         allocation or setting the guard pages failed.
+ */
+cfib_t* cfib_new_batch(size_t n, const cfib_func* start_routines, void* const* args, const cfib_attr_t* attr);
+
+/** Sets the fiber which 'fib' swaps into when it finishes.
+ *
+ * When the function of a fiber returns, the fiber is marked finished (see
+ * cfib_is_finished()), and execution swaps into it's successor. If the
+ * successor is NULL (the default), execution swaps back into the fiber
+ * which last swapped into 'fib', ie. it's resumer. A finished fiber must
+ * not be swapped into anymore, but it still needs to be released with
+ * cfib_unmap(), unless it was created with CFIB_AUTO_RECYCLE.
+ *
+ * @param[in] fib the fiber.
+ * @param[in] successor the fiber to swap into, or NULL for the resumer.
+ */
+void cfib_set_successor(cfib_t* fib, cfib_t* successor);
+
+/** Runs a fiber until it finishes.
+ *
+ * Swaps into 'fib', and again every time execution swaps back, until the
+ * function of 'fib' returns. If 'fib' has no successor, it returns into
+ * the joining fiber when it finishes. Returns immediately if 'fib' has
+ * finished already.
+ *
+ * @param[in] fib a fiber, which was not created with CFIB_AUTO_RECYCLE.
+ */
+void cfib_join(cfib_t* fib);
+
+/** Unmap the stacks of a batch of fibers and free the batch.
+ *
+ * Unmaps the stacks of all the fibers allocated by cfib_new_batch() with a
+ * single system call, and frees the array of fibers.
+ *
+ * @param[in] fibs the array returned by cfib_new_batch(), or NULL.
+ * @param[in] n the number of fibers in the batch, does nothing if 0.
+ */
+void cfib_unmap_batch(cfib_t* fibs, size_t n);
+
 
+/** Tells if the function of a fiber has returned.
+ */
+static inline int cfib_is_finished(const cfib_t* fib) {
+    return (fib->_flags & _CFIB_FINISHED) != 0;
+}
 
 static inline cfib_t* cfib_get_current() {
     assert("CALL cfib_init_thread() BEFORE CALLING cfib_get_current() !!!" && _cfib_tls.current != NULL && _cfib_tls.current->_magic == ((uintptr_t)_cfib_tls.current ^ _CFIB_MGK1));
@@ -282,18 +542,418 @@ static inline void cfib_swap__noassert__(cfib_t *to) {
     _cfib_swap(&_cfib_tls.previous->sp, to->sp);
 }
 
+/** Swap from one fiber to another, without touching thread-local data.
+ *
+ * Same as cfib_swap(), except that the caller tells which fiber is the
+ * current one, and _cfib_tls is neither read nor written. In a shared
+ * library every access to thread-local data may cost a call to
+ * __tls_get_addr(), so this is the cheapest swap there is, for code which
+ * keeps tabs on it's fibers anyway.
+ *
+ * Since cfib_get_current() and cfib_get_previous() are not updated, fibers
+ * switched by this function must not use anything which depends on them,
+ * like the scheduler (see cfib_sched.h), before they are again switched by
+ * cfib_swap(). A fiber swapped in by this function must also have a
+ * successor (see cfib_set_successor()) in case it's function returns.
+ *
+ * @param[in/out] from the current fiber, where execution state is saved.
+ * @param[in/out] to the context from which execution should continue.
+ */
+static inline void cfib_swap_from(cfib_t* from, cfib_t* to) {
+    _cfib_swap(&from->sp, to->sp);
+}
+
+/** The result of cfib_transfer() and cfib_transfer_ontop().
+ */
+typedef struct {
+    /** The value passed by the fiber which resumed us. */
+    void* data;
+    /** The fiber which resumed us. */
+    cfib_t* from;
+} cfib_transfer_t;
+
+/** Function signature type for functions called by cfib_transfer_ontop().
+ *
+ * The function gets the passed value and the fiber which called
+ * cfib_transfer_ontop(), and returns the value which is passed on instead.
+ */
+typedef void* (*cfib_ontop_fn)(void* data, cfib_t* from);
+
+/** Low-level context swap, passing a value over, implemented in assembler.
+ *
+ * Same as _cfib_swap(), but data and from are returned to the next context.
+ * Like _cfib_swap(), only the API/ABI of the inline functions which call
+ * this function is guaranteed to remain stable.
+ */
+cfib_transfer_t _cfib_transfer(unsigned char** sp1, unsigned char* sp2, void* data, cfib_t* from);
+
+/** Low-level context swap which calls a function on top of the next
+ * context, implemented in assembler.
+ */
+cfib_transfer_t _cfib_ontop(unsigned char** sp1, unsigned char* sp2, void* data, cfib_t* from, cfib_ontop_fn fn);
+
+/** Swap current fiber with the one provided as argument, passing a value.
+ *
+ * Like cfib_swap(), but the value is handed to the resumed fiber in
+ * registers, so neither side has to stash it anywhere. If the resumed fiber
+ * is suspended in cfib_transfer() or cfib_transfer_ontop(), that call
+ * returns the value and the current fiber. If it was never started, the
+ * value becomes the 2nd argument of it's function, which then has the
+ * signature void (*)(void* args, void* data). Example:
+ *
+ * void producer(void* args, void* data) {
+ *     cfib_transfer_t t = {data, NULL};
+ *     for(int i = 0; i < 3; i++)
+ *         t = cfib_transfer(cfib_get_previous(), (void*)(uintptr_t)i);
+ * }
+ *
+ * A fiber resumed by cfib_swap() gets an undefined value and fiber.
+ *
+ * @param[in/out] to the context from which execution should continue.
+ * @param[in] data the value to pass.
+ * @return the value passed by the fiber which resumes us, and that fiber.
+ */
+static inline cfib_transfer_t cfib_transfer(cfib_t* to, void* data) {
+    assert("CALL cfib_init_thread() BEFORE CALLING cfib_transfer() !!!" && _cfib_tls.current != NULL && _cfib_tls.current->_magic == ((uintptr_t)_cfib_tls.current ^ _CFIB_MGK1));
+    assert("Argument cfib_t* to was NOT created via cfib_new() !!!" && to != NULL && to->_magic == ((uintptr_t)to ^ _CFIB_MGK1));
+    cfib_t* self = _cfib_tls.current;
+    _cfib_tls.previous = self;
+    _cfib_tls.current = to;
+    return _cfib_transfer(&self->sp, to->sp, data, self);
+}
+
+/** Swap to a fiber, and run a function on top of it before it resumes.
+ *
+ * Like cfib_transfer(), but fn(data, current fiber) is called on the stack
+ * of the fiber swapped to, and the value it returns is passed on to that
+ * fiber instead of data. The current fiber is already suspended when fn
+ * runs, so fn may, for example, unmap and free it. A fiber which never
+ * gets resumed can thus release it's own stack:
+ *
+ * void* release(void* data, cfib_t* from) {
+ *     cfib_unmap(from);
+ *     free(from);
+ *     return data;
+ * }
+ * ...
+ * cfib_transfer_ontop(next, NULL, release); // never returns
+ *
+ * @param[in/out] to the context from which execution should continue.
+ * @param[in] data the value to pass to fn.
+ * @param[in] fn the function to call on top of to.
+ * @return the value passed by the fiber which resumes us, and that fiber.
+ */
+static inline cfib_transfer_t cfib_transfer_ontop(cfib_t* to, void* data, cfib_ontop_fn fn) {
+    assert("CALL cfib_init_thread() BEFORE CALLING cfib_transfer_ontop() !!!" && _cfib_tls.current != NULL && _cfib_tls.current->_magic == ((uintptr_t)_cfib_tls.current ^ _CFIB_MGK1));
+    assert("Argument cfib_t* to was NOT created via cfib_new() !!!" && to != NULL && to->_magic == ((uintptr_t)to ^ _CFIB_MGK1));
+    cfib_t* self = _cfib_tls.current;
+    _cfib_tls.previous = self;
+    _cfib_tls.current = to;
+    return _cfib_ontop(&self->sp, to->sp, data, self, fn);
+}
+
+/** Swap from one fiber to another passing a value, without touching
+ * thread-local data.
+ *
+ * The cfib_transfer() counterpart of cfib_swap_from(), with the same
+ * restrictions. Since the fiber which resumes us is returned, a pair of
+ * fibers can pass values back and forth without ever touching _cfib_tls:
+ *
+ * cfib_transfer_t t = cfib_transfer_from(self, other, data);
+ * ...
+ * t = cfib_transfer_from(self, t.from, reply);
+ *
+ * @param[in/out] from the current fiber, where execution state is saved.
+ * @param[in/out] to the context from which execution should continue.
+ * @param[in] data the value to pass.
+ * @return the value passed by the fiber which resumes us, and that fiber.
+ */
+static inline cfib_transfer_t cfib_transfer_from(cfib_t* from, cfib_t* to, void* data) {
+    return _cfib_transfer(&from->sp, to->sp, data, from);
+}
+
+/** Get the switch statistics of a fiber.
+ *
+ * Only the instrumented build of the library (libcfib_instrumented) counts
+ * these. In it, every swap counts one swap-in for the fiber swapped to, and
+ * adds the ticks since the last swap-in to the running time of the fiber
+ * swapped from. The running time of the current fiber includes the ticks
+ * up to this call. The counters live in a block which only the instrumented
+ * build allocates for each fiber, so the other builds neither store nor
+ * update them.
+ *
+ * @param[in] fib the fiber
+ * @param[out] stats the statistics of the fiber
+ * @return 0 on success, -1 if the library is not the instrumented build, or
+ *         if the statistics block of the fiber could not be allocated
+ */
+int cfib_stats(const cfib_t* fib, cfib_stats_t* stats);
+
+/** Maximum number of fiber-local storage keys.
+ */
+#define CFIB_KEYS_MAX 32
+/** How many times the destructors of fiber-local values are run, at most,
+ * if they keep setting values.
+ */
+#define CFIB_DESTRUCTOR_ITERATIONS 4
+
+/** A fiber-local storage key, see cfib_key_create().
+ */
+typedef unsigned cfib_key_t;
+
+/** Create a fiber-local storage key.
+ *
+ * Works like pthread_key_create(), but the values are per fiber. Every fiber
+ * starts with a NULL value for every key. When a fiber finishes, or is
+ * unmapped before it finishes, 'destructor' is called with each non-NULL
+ * value of the key, after the value is set to NULL. At completion, the
+ * destructors run in the finishing fiber. In cfib_unmap(), they run in the
+ * fiber which calls it, so they must not use cfib_getspecific().
+ *
+ * The thread's own fiber (see cfib_init_thread()) never finishes, so it's
+ * values are never destroyed.
+ *
+ * @param[out] key the new key.
+ * @param[in] destructor the destructor of the values, or NULL.
+ * @return 0 on success, EAGAIN if all CFIB_KEYS_MAX keys are in use.
+ */
+int cfib_key_create(cfib_key_t* key, void (*destructor)(void*));
+
+/** Delete a fiber-local storage key.
+ *
+ * Like pthread_key_delete(), no destructors are called. The values which
+ * fibers still have for the key are not cleared, and show up again if the
+ * key is reused.
+ *
+ * @return 0 on success, EINVAL if 'key' is not a valid key.
+ */
+int cfib_key_delete(cfib_key_t key);
+
+/** Set the value of a fiber-local storage key for the current fiber.
+ *
+ * The first value set for a fiber allocates the fiber's slot array.
+ *
+ * @return 0 on success, EINVAL if 'key' is not a valid key, ENOMEM if the
+ * slot array could not be allocated.
+ */
+int cfib_setspecific(cfib_key_t key, const void* value);
+
+/** Get the value of a fiber-local storage key for the current fiber.
+ *
+ * @return the value, or NULL if none was set.
+ */
+static inline void* cfib_getspecific(cfib_key_t key) {
+    assert("Argument key is NOT a fiber-local storage key !!!" && key < CFIB_KEYS_MAX);
+    void** specific = _cfib_tls.current->_reserved.specific;
+    return specific != NULL ? specific[key] : NULL;
+}
+
 /** Unmap the stack memory of the provided context.
  *
  * Upon calling cfib_free() on a fiber context, it's stack (and ONLY the stack)
  * is unmapped and the fiber can no longer be swap():ed into. The consideration
  * of where the original void *args -argument of the initial call to
  * cfib_init()/cfib_new() is freed is left to the user; likewise, this
- * function will NOT free the context pointer itself!
+ * function will NOT free the context pointer itself! Unless the fiber was
+ * created with CFIB_ONSTACK, in which case it is gone with it's stack.
  *
  * @param[in/out] context the fiber context the stack of which is to be unmapped.
  */
 void cfib_unmap(cfib_t* context);
 
+/** Unmap the stack of a fiber and free the fiber.
+ *
+ * Same as cfib_unmap() followed by free(), except for a fiber created with
+ * CFIB_ONSTACK, which is only unmapped. Not for fibers of a batch (see
+ * cfib_new_batch()).
+ *
+ * @param[in] fib the fiber, created by cfib_new() or cfib_new_reserve().
+ */
+void cfib_release(cfib_t* fib);
+
+/** Set the high-water mark of this thread's stack pool.
+ *
+ * When the high-water mark is non-zero, cfib_unmap() does not unmap the
+ * stack, but keeps it in a per-thread pool, from which cfib_new() takes
+ * stacks of matching size before mapping new ones. This saves the mmap(),
+ * mprotect() and munmap() system calls for short-lived fibers. The pool keeps
+ * at most 'bytes' worth of stacks; stacks beyond that are unmapped as usual.
+ *
+ * The pool is disabled (high-water mark is zero) by default. Lowering the
+ * high-water mark below the amount of currently pooled stacks trims the pool.
+ * Pooled stacks are unmapped automatically when the thread exits.
+ *
+ * In the profiled build of the library the pool is always disabled, because
+ * the profiler needs freshly guarded stacks.
+ *
+ * @param[in] bytes maximum amount of stack memory kept in the pool.
+ */
+void cfib_pool_set_high_water(size_t bytes);
+
+/** Unmap all stacks in this thread's stack pool.
+ */
+void cfib_pool_trim();
+
+/** Returns how deep the stack of a fiber has grown, in bytes.
+ *
+ * Finds the deepest resident page of the stack with mincore(), and the
+ * deepest non-zero word in that page with SSE2 or AVX2, if the library is
+ * compiled for them. If the page holds only zeros, all of it counts as
+ * used. The result is exact only for fibers created with CFIB_STACK_PAINT.
+ * Pages released with cfib_reclaim() or swapped out count as not used,
+ * unless the stack touches them again.
+ *
+ * Returns 0 in the profiled build of the library.
+ *
+ * @param[in] fib the fiber, which may be the current one.
+ */
+size_t cfib_stack_high_water(const cfib_t* fib);
+
+/** Flag of cfib_reclaim(): release the pages lazily.
+ *
+ * Uses madvise(MADV_FREE), which is cheaper, but the system takes the pages
+ * (and they stop counting in the RSS of the process) only when it runs low
+ * on memory. Until then, the pages keep their data. Without this flag,
+ * MADV_DONTNEED releases the pages immediately.
+ */
+#define CFIB_RECLAIM_LAZY 0x00000001
+
+/** Releases the stack pages of a fiber which lie deeper than 'hot_margin'.
+ *
+ * A stack which once went deep keeps it's pages resident, although the
+ * fiber may never need them again. This function gives the pages between
+ * the stack ceiling and the fiber's stack pointer minus 'hot_margin' back
+ * to the system with madvise(). The pages are mapped back in, zeroed, if
+ * the stack grows into them again.
+ *
+ * Can be called on a suspended fiber, or on the current fiber to release
+ * it's own stack below the caller. The margin is at least one page.
+ *
+ * Does nothing in the profiled build of the library, which manages the
+ * stack pages itself.
+ *
+ * @param[in] fib the fiber.
+ * @param[in] hot_margin bytes below the stack pointer to keep resident.
+ * @param[in] flags 0 or CFIB_RECLAIM_LAZY.
+ * @return the number of bytes released.
+ */
+size_t cfib_reclaim(cfib_t* fib, size_t hot_margin, unsigned flags);
+
+/** Sets the automatic stack reclaim policy of this thread.
+ *
+ * With a non-zero 'hot_margin', stack pages deeper than 'hot_margin' are
+ * released as if by cfib_reclaim() when a fiber parks in the scheduler of
+ * this thread (see cfib_sched.h), and when a stack is put to the stack pool.
+ * To keep the cost low, the pages are released only if the words right
+ * below the margin hold data, ie. if the stack has grown past the margin
+ * since it was last released. Lazily released pages may keep their data,
+ * and be released again on the next park.
+ *
+ * @param[in] hot_margin bytes below the stack pointer to keep resident, 0 disables the policy (default).
+ * @param[in] flags 0 or CFIB_RECLAIM_LAZY.
+ */
+void cfib_reclaim_set_policy(size_t hot_margin, unsigned flags);
+
+/** Applies the automatic reclaim policy of this thread to a fiber.
+ *
+ * @return the number of bytes released.
+ */
+size_t cfib_reclaim_auto(cfib_t* fib);
+
+/** Returns the total number of stack bytes released in this process.
+ *
+ * Counts the lengths of the released address ranges, which may include
+ * pages that were not resident.
+ */
+size_t cfib_reclaimed_bytes();
+
+/** Writes the report of the stack statistics.
+ *
+ * The stack usage of fibers is counted per tag (see CFIB_TAG_CTOR). In the
+ * profiled build of the library, every page a stack grows into is counted
+ * as a fault. In the other builds, the high water marks of painted fibers
+ * (see CFIB_STACK_PAINT) are counted as samples when they are unmapped.
+ *
+ * The report has, for each tag, the number of fibers created with it (of
+ * the untagged fibers, only painted ones are counted outside the profiled
+ * build), the number of faults and
+ * samples, the max. stack size seen, and the distribution of the fault
+ * depths or sampled high water marks in pages, in power of two buckets.
+ * The JSON report of the profiled build also has the recent faults of each
+ * thread; faults which did not fit in the ring buffer of the thread since
+ * the previous report are counted as dropped.
+ *
+ * If the environment variable CFIB_PROF_REPORT is set, the report is
+ * written to the file it names at exit.
+ *
+ * @param[in] path the file to write, CSV if the name ends with ".csv",
+ *                 otherwise JSON. NULL writes JSON to stderr.
+ * @return 0 on success, -1 on error or if the library has no C11 atomics.
+ */
+int cfib_prof_dump(const char* path);
+
+/** Finds the fiber whose stack contains an address.
+ *
+ * Every stack created by cfib_new() or cfib_new_batch() is registered in a
+ * lock-free radix tree of page numbers until it is unmapped, so any address
+ * on any fiber stack of any thread, including the guard page below the
+ * stack, resolves in constant time however many fibers there are. The
+ * stack of the thread itself (see cfib_init_thread()) is not registered.
+ *
+ * This function is async-signal-safe, and can be used in a SIGSEGV handler
+ * to tell which fiber faulted. It requires C11 atomics, and always returns
+ * NULL without them. The returned fiber is valid only as long as nobody
+ * unmaps it.
+ *
+ * @param[in] addr any address.
+ * @return the fiber, or NULL if 'addr' is not on a registered stack.
+ */
+cfib_t* cfib_find_by_addr(const void* addr);
+
+/** Returns the name of the tag of a fiber (see CFIB_TAG_CTOR).
+ *
+ * Async-signal-safe. Outside the profiled build, untagged fibers have no
+ * tag name, except painted ones, which have the default tag.
+ *
+ * @return the name, or NULL if the fiber has no tag.
+ */
+const char* cfib_get_tag_name(const cfib_t* fib);
+
+/** Loads a stack profile, ie. stack sizes for tags (see CFIB_TAG_CTOR).
+ *
+ * A stack profile is a text file with a line "<tag name> <stack size>" for
+ * each tag, and comment lines beginning with '#'. Once loaded, cfib_new()
+ * and cfib_new_batch() create the fibers of a tag listed in the profile
+ * with the stack size of the profile, instead of the one in 'attr'. The
+ * profiled build of the library ignores the sizes, and measures instead.
+ *
+ * The file named by the environment variable CFIB_STACK_PROFILE is loaded
+ * automatically when the first tagged fiber is created. The profiled build
+ * writes it back at exit, as by cfib_stack_profile_save(), with the margin
+ * from the environment variable CFIB_STACK_PROFILE_MARGIN (default 25).
+ * So a profiled run of a program produces the stack sizes for the normal
+ * runs.
+ *
+ * Requires C11 atomics, otherwise always fails.
+ *
+ * @param[in] path the file.
+ * @return number of tags loaded, or -1 if the file could not be read.
+ */
+int cfib_stack_profile_load(const char* path);
+
+/** Writes a stack profile (see cfib_stack_profile_load()).
+ *
+ * For each tag which has faults or samples (see cfib_prof_dump()), the
+ * size is the max. stack size seen, plus 'margin_percent' percent, rounded
+ * up to whole pages, but never less than the size loaded from a profile.
+ * The tags only loaded from a profile keep their sizes.
+ *
+ * @param[in] path the file.
+ * @param[in] margin_percent the safety margin.
+ * @return 0 on success, -1 on error.
+ */
+int cfib_stack_profile_save(const char* path, unsigned margin_percent);
+
 
 #define CFIB_TAG_DECL(identifier)\
 struct _cfib_tag* identifier();
@@ -309,6 +969,13 @@ struct _cfib_tag* identifier() {\
 
 #ifdef __cplusplus
 } /* extern "C" { */
+
+// A template can not have C linkage, so this overload lives outside of the
+// extern "C" block. See cfib.hpp for the C++ fiber class.
+template <typename T>
+static inline cfib_t* cfib_new(void (*start_routine)(T*), T* args, const cfib_attr_t* attr) {
+    return cfib_new((cfib_func)start_routine, (void*)args, attr);
+}
 #endif
 
 #ifdef NDEBUG
@@ -0,0 +1,236 @@
+#ifndef _CFIB_HPP_
+#define _CFIB_HPP_
+
+/** @file cfib.hpp
+ *
+ * Header-only C++11 layer on top of cfib.h.
+ *
+ * cfib::fiber runs any callable in a fiber. The callable is moved to the top
+ * of the fiber's own stack (see cfib_new_reserve()), so creating a fiber
+ * allocates nothing but the cfib_t and the stack, and with the stack pool
+ * (see cfib_pool_set_high_water()) not even the stack. The fiber is move-only,
+ * and it's destructor unmaps it.
+ *
+ * An exception which escapes the callable is caught in the fiber, and
+ * rethrown by the cfib::fiber::resume() call which the fiber finished in.
+ *
+ * Example:
+ *
+ * cfib_init_thread();
+ * int n = 0;
+ * cfib::fiber f([&n] {
+ *     for(int i = 0; i < 3; i++) {
+ *         n = i;
+ *         cfib::this_fiber::yield();
+ *     }
+ *     throw std::runtime_error("done");
+ * });
+ * while(!f.finished())
+ *     f.resume(); // throws std::runtime_error on the 4th round
+ *
+ * The C++ runtime keeps the state of exceptions which are being handled per
+ * thread, not per fiber, so a fiber must not swap away from inside a catch
+ * block.
+ */
+
+#include "cfib.h"
+
+#include <exception>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+namespace cfib {
+
+namespace detail {
+
+// The part of the reserved space which does not depend on the type of the
+// callable. It is at the very top of the stack, so it can be found from the
+// fiber alone, and the callable is right below it.
+struct frame_base {
+    uintptr_t magic;
+    // The fiber which last called fiber::resume()
+    cfib_t* resumer;
+    // The exception which escaped the callable, if any
+    std::exception_ptr ex;
+    // Destroys the callable, NULL once it is destroyed
+    void (*destroy)(frame_base*);
+};
+
+constexpr size_t align16(size_t size) {
+    return (size + 15) & ~(size_t)15;
+}
+
+inline frame_base* base_of(cfib_t* fib) {
+    return reinterpret_cast<frame_base*>(fib->stack_floor - align16(sizeof(frame_base)));
+}
+
+template <typename F>
+inline F* fn_of(frame_base* base) {
+    return reinterpret_cast<F*>(reinterpret_cast<unsigned char*>(base) - align16(sizeof(F)));
+}
+
+template <typename F>
+void destroy_fn(frame_base* base) {
+    fn_of<F>(base)->~F();
+    base->destroy = nullptr;
+}
+
+// The function of every cfib::fiber, called with the reserved space
+template <typename F>
+void entry(void* reserved) {
+    frame_base* base = reinterpret_cast<frame_base*>(static_cast<unsigned char*>(reserved) + align16(sizeof(F)));
+    try {
+        (*fn_of<F>(base))();
+    } catch(...) {
+        base->ex = std::current_exception();
+    }
+    base->destroy(base);
+}
+
+} /* namespace detail */
+
+/** A fiber which runs a callable.
+ */
+class fiber {
+public:
+    /** Constructs an empty fiber, which owns nothing.
+     */
+    fiber() noexcept : _fib(nullptr) {}
+
+    /** Creates a fiber which runs fn().
+     *
+     * The callable is moved or copied to the top of the new fiber's stack.
+     * The fiber starts to run on the first call to resume().
+     *
+     * @param[in] fn the callable, which takes no arguments.
+     * @param[in] attr attributes for this fiber, if NULL, defaults are used,
+     * CFIB_AUTO_RECYCLE is ignored.
+     * @throw std::bad_alloc if the fiber could not be created.
+     */
+    template <typename F, typename = typename std::enable_if<!std::is_same<typename std::decay<F>::type, fiber>::value>::type>
+    explicit fiber(F&& fn, const cfib_attr_t* attr = nullptr) : _fib(nullptr) {
+        typedef typename std::decay<F>::type fn_t;
+        static_assert(alignof(fn_t) <= 16, "cfib::fiber can not align the callable at more than 16 bytes");
+        // reset() releases the fiber, and a finished fiber has to stay around
+        // until then, so it must not release itself as well
+        cfib_attr_t _attr;
+        if(attr != nullptr && (attr->flags & CFIB_AUTO_RECYCLE)) {
+            _attr = *attr;
+            _attr.flags &= ~CFIB_AUTO_RECYCLE;
+            attr = &_attr;
+        }
+        void* reserved = nullptr;
+        _fib = cfib_new_reserve(&detail::entry<fn_t>, detail::align16(sizeof(fn_t)) + detail::align16(sizeof(detail::frame_base)), &reserved, attr);
+        if(_fib == nullptr)
+            throw std::bad_alloc();
+        try {
+            new(reserved) fn_t(std::forward<F>(fn));
+        } catch(...) {
+            cfib_release(_fib);
+            throw;
+        }
+        detail::frame_base* base = new(detail::base_of(_fib)) detail::frame_base();
+        base->magic = (uintptr_t)base ^ _CFIB_MGK2;
+        base->destroy = &detail::destroy_fn<fn_t>;
+    }
+
+    fiber(fiber&& other) noexcept : _fib(other._fib) {
+        other._fib = nullptr;
+    }
+
+    fiber& operator=(fiber&& other) noexcept {
+        if(this != &other) {
+            reset();
+            _fib = other._fib;
+            other._fib = nullptr;
+        }
+        return *this;
+    }
+
+    fiber(const fiber&) = delete;
+    fiber& operator=(const fiber&) = delete;
+
+    ~fiber() {
+        reset();
+    }
+
+    /** Releases the fiber, leaving this one empty.
+     *
+     * If the callable has not returned, it is destroyed, but the objects on
+     * the fiber's stack below it are not: the stack is not unwound. The
+     * fiber must not be the current one.
+     */
+    void reset() noexcept {
+        if(_fib == nullptr)
+            return;
+        assert("cfib::fiber destroyed while it is running !!!" && _fib != cfib_get_current__noassert__());
+        detail::frame_base* base = detail::base_of(_fib);
+        if(base->destroy != nullptr)
+            base->destroy(base);
+        base->~frame_base();
+        cfib_release(_fib);
+        _fib = nullptr;
+    }
+
+    /** Swaps into the fiber, until it yields or finishes.
+     *
+     * @throw anything which escaped the callable, when the fiber finished.
+     */
+    void resume() {
+        assert("cfib::fiber::resume() called on an empty or finished fiber !!!" && _fib != nullptr && !cfib_is_finished(_fib));
+        detail::frame_base* base = detail::base_of(_fib);
+        base->resumer = cfib_get_current();
+        // The fiber may have swapped elsewhere since it was last resumed, so
+        // it has to be told where to go when it finishes
+        cfib_set_successor(_fib, base->resumer);
+        cfib_swap(_fib);
+        if(base->ex) {
+            std::exception_ptr ex = std::move(base->ex);
+            base->ex = nullptr;
+            std::rethrow_exception(ex);
+        }
+    }
+
+    /** Tells if the callable has returned, or the fiber is empty.
+     */
+    bool finished() const noexcept {
+        return _fib == nullptr || cfib_is_finished(_fib);
+    }
+
+    explicit operator bool() const noexcept {
+        return _fib != nullptr;
+    }
+
+    /** The underlying fiber, which remains owned by this one.
+     */
+    cfib_t* native_handle() const noexcept {
+        return _fib;
+    }
+
+    void swap(fiber& other) noexcept {
+        std::swap(_fib, other._fib);
+    }
+
+private:
+    cfib_t* _fib;
+};
+
+namespace this_fiber {
+
+/** Swaps from the current fiber back to the one which resumed it.
+ *
+ * The current fiber must be a cfib::fiber.
+ */
+inline void yield() {
+    cfib_t* self = cfib_get_current();
+    assert("cfib::this_fiber::yield() called outside of a cfib::fiber !!!" && self->stack_floor != NULL && detail::base_of(self)->magic == ((uintptr_t)detail::base_of(self) ^ _CFIB_MGK2));
+    detail::frame_base* base = detail::base_of(self);
+    cfib_swap(base->resumer);
+}
+
+} /* namespace this_fiber */
+
+} /* namespace cfib */
+
+#endif /* _CFIB_HPP_ */
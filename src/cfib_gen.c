@@ -0,0 +1,110 @@
+#include "cfib_gen.h"
+
+/* Generators
+ *
+ * The state of a generator is reserved at the top of it's stack, so that
+ * the generator can find it from the current fiber in cfib_gen_yield().
+ */
+struct _cfib_gen {
+    cfib_t* fib;
+    // The fiber which last called cfib_gen_next()
+    cfib_t* consumer;
+    cfib_gen_t* input;
+    cfib_gen_func fn;
+    void* args;
+    int finished;
+};
+
+#define _GEN_SIZE ((sizeof(struct _cfib_gen) + 15) & ~(size_t)15)
+
+// @internal The function of every generator fiber.
+static void _gen_entry(void* reserved)
+{
+    cfib_gen_t* gen = (cfib_gen_t*)reserved;
+    gen->fn(gen->input, gen->args);
+    gen->finished = 1;
+    // Returns to the successor, which is the consumer
+}
+
+cfib_gen_t* cfib_gen_new(cfib_gen_func fn, cfib_gen_t* input, void* args, const cfib_attr_t* attr)
+{
+    // The consumer has to be able to look at a finished generator
+    cfib_attr_t _attr;
+    if(attr != NULL && (attr->flags & CFIB_AUTO_RECYCLE)) {
+        _attr = *attr;
+        _attr.flags &= ~CFIB_AUTO_RECYCLE;
+        attr = &_attr;
+    }
+    void* reserved = NULL;
+    cfib_t* fib = cfib_new_reserve(_gen_entry, _GEN_SIZE, &reserved, attr);
+    if(fib == NULL)
+        return NULL;
+    cfib_gen_t* gen = (cfib_gen_t*)reserved;
+    gen->fib = fib;
+    gen->consumer = NULL;
+    gen->input = input;
+    gen->fn = fn;
+    gen->args = args;
+    gen->finished = 0;
+    return gen;
+}
+
+void* cfib_gen_next(cfib_gen_t* gen)
+{
+    if(gen->finished)
+        return NULL;
+    cfib_t* self = cfib_get_current();
+    if(gen->consumer != self) {
+        // The generator returns to it's consumer when it finishes
+        gen->consumer = self;
+        cfib_set_successor(gen->fib, self);
+    }
+    void* ret = cfib_transfer(gen->fib, NULL).data;
+    // A finished generator returns via _cfib_exit_fiber(), which passes
+    // nothing over
+    return gen->finished ? NULL : ret;
+}
+
+void cfib_gen_yield(void* value)
+{
+    cfib_t* self = cfib_get_current();
+    cfib_gen_t* gen = (cfib_gen_t*)(self->stack_floor - _GEN_SIZE);
+    assert("cfib_gen_yield() called outside of a generator !!!" && self->stack_floor != NULL && gen->fib == self);
+    assert("cfib_gen_yield() called with NULL !!!" && value != NULL);
+    cfib_transfer(gen->consumer, value);
+}
+
+int cfib_gen_finished(const cfib_gen_t* gen)
+{
+    return gen->finished;
+}
+
+void cfib_gen_free(cfib_gen_t* gen)
+{
+    // The generator lives on the stack which is unmapped
+    cfib_release(gen->fib);
+}
+
+cfib_gen_t* cfib_pipeline_new(size_t n, const cfib_gen_func* stages, void* const* args, cfib_gen_t* input, const cfib_attr_t* attr)
+{
+    cfib_gen_t* last = input;
+    for(size_t i = 0; i < n; i++) {
+        cfib_gen_t* stage = cfib_gen_new(stages[i], last, args != NULL ? args[i] : NULL, attr);
+        if(stage == NULL) {
+            if(i > 0)
+                cfib_pipeline_free(last, i);
+            return NULL;
+        }
+        last = stage;
+    }
+    return last;
+}
+
+void cfib_pipeline_free(cfib_gen_t* last, size_t n)
+{
+    for(size_t i = 0; i < n; i++) {
+        cfib_gen_t* input = last->input;
+        cfib_gen_free(last);
+        last = input;
+    }
+}
@@ -0,0 +1,125 @@
+#ifndef _CFIB_GEN_H_
+#define _CFIB_GEN_H_
+
+/** @file cfib_gen.h
+ *
+ * Generators and pipelines of generators, built on cfib_transfer().
+ *
+ * A generator is a fiber which produces a stream of values. The consumer
+ * pulls the next value with cfib_gen_next(), which swaps into the generator,
+ * and the generator hands the value over with cfib_gen_yield(), which swaps
+ * back. The value is passed in registers, so each handoff is a single stack
+ * switch which touches no shared memory.
+ *
+ * A generator may consume the values of another generator, it's input. A
+ * chain of such generators is a pipeline (see cfib_pipeline_new()), where
+ * each stage pulls from the previous one, and the consumer pulls from the
+ * last one. The values are typically pointers to a buffer of the stage
+ * which yields them. The buffer may be reused for the next value, since the
+ * consumer is done with it by the time it asks for the next one, so no item
+ * is ever copied or allocated by the pipeline itself.
+ *
+ * The state of a generator lives at the top of it's own stack (see
+ * cfib_new_reserve()), so creating one allocates nothing but the fiber.
+ *
+ * Example:
+ *
+ * void count(cfib_gen_t* input, void* args) {
+ *     static int buf;
+ *     for(buf = 0; buf < 3; buf++)
+ *         cfib_gen_yield(&buf);
+ * }
+ * ...
+ * cfib_gen_t* gen = cfib_gen_new(count, NULL, NULL, NULL);
+ * int* i;
+ * while((i = cfib_gen_next(gen)) != NULL)
+ *     printf("%d\n", *i);
+ * cfib_gen_free(gen);
+ */
+
+#include "cfib.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct _cfib_gen cfib_gen_t;
+
+/** Function signature type for generators and pipeline stages.
+ *
+ * @param[in] input the generator to consume, or NULL if none.
+ * @param[in] args the argument given when the generator was created.
+ */
+typedef void (*cfib_gen_func)(cfib_gen_t* input, void* args);
+
+/** Creates a generator.
+ *
+ * The generator starts to run on the first call to cfib_gen_next(), and
+ * finishes when 'fn' returns.
+ *
+ * @param[in] fn the function of the generator.
+ * @param[in] input the generator which 'fn' consumes, or NULL.
+ * @param[in] args the 2nd argument of 'fn'.
+ * @param[in] attr attributes for the fiber, if NULL, defaults are used,
+ * CFIB_AUTO_RECYCLE is ignored.
+ * @return the generator, or NULL if memory allocation failed.
+ */
+cfib_gen_t* cfib_gen_new(cfib_gen_func fn, cfib_gen_t* input, void* args, const cfib_attr_t* attr);
+
+/** Gets the next value of a generator.
+ *
+ * Swaps into the generator, until it yields a value or finishes. A value
+ * stays valid until the next call to cfib_gen_next() on the generator.
+ *
+ * @param[in] gen the generator.
+ * @return the value, or NULL if the generator has finished.
+ */
+void* cfib_gen_next(cfib_gen_t* gen);
+
+/** Hands a value to the consumer of the current generator.
+ *
+ * Must be called from the fiber of a generator. Swaps back to the fiber
+ * which called cfib_gen_next(), which returns 'value'. Returns when the
+ * next value is asked for.
+ *
+ * @param[in] value the value, which must not be NULL.
+ */
+void cfib_gen_yield(void* value);
+
+/** Tells if the function of a generator has returned.
+ */
+int cfib_gen_finished(const cfib_gen_t* gen);
+
+/** Frees a generator.
+ *
+ * The generator need not be finished, but it's input is not freed. The
+ * objects on the generator's stack are not unwound.
+ */
+void cfib_gen_free(cfib_gen_t* gen);
+
+/** Creates a pipeline of 'n' generators.
+ *
+ * Stage 0 consumes 'input', which may be NULL, and stage 'i' consumes stage
+ * 'i - 1'. The values of the pipeline are those of the last stage.
+ *
+ * @param[in] n number of stages, at least 1.
+ * @param[in] stages array of 'n' stage functions.
+ * @param[in] args array of 'n' arguments, or NULL.
+ * @param[in] input the generator which stage 0 consumes, or NULL.
+ * @param[in] attr attributes for all the fibers, if NULL, defaults are used
+ * @return the last stage, or NULL if memory allocation failed.
+ */
+cfib_gen_t* cfib_pipeline_new(size_t n, const cfib_gen_func* stages, void* const* args, cfib_gen_t* input, const cfib_attr_t* attr);
+
+/** Frees the stages of a pipeline created by cfib_pipeline_new().
+ *
+ * @param[in] last the last stage.
+ * @param[in] n number of stages.
+ */
+void cfib_pipeline_free(cfib_gen_t* last, size_t n);
+
+#ifdef __cplusplus
+} /* extern "C" { */
+#endif
+
+#endif /* _CFIB_GEN_H_ */
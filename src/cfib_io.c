@@ -0,0 +1,284 @@
+// accept4() is a GNU extension
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include "cfib_io.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+
+#ifdef _WITH_SYSAPI_POSIX
+#include <unistd.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#elif defined (_WITH_SYSAPI_WINDOWS)
+    #error "TODO: WINAPI support."
+#endif
+
+/* Max number of events taken with one epoll_wait() */
+#define _MAX_EVENTS 64
+
+// Per-descriptor state of the reactor
+struct _cfib_io_fd {
+    cfib_t* reader;
+    cfib_t* writer;
+    int registered;
+};
+
+struct _cfib_io {
+    // Must be the first member, the poll callback casts it to _cfib_io
+    cfib_sched_source_t source;
+    int epfd;
+    // Descriptor states, indexed by descriptor
+    struct _cfib_io_fd* fds;
+    size_t num_fds;
+};
+
+static _Thread_local struct _cfib_io _io = {
+    .epfd = -1,
+    .fds = NULL,
+    .num_fds = 0
+};
+
+static inline void _io_wake(struct _cfib_io* io, struct _cfib_io_fd* st, cfib_t* fib)
+{
+    if(st->reader == fib)
+        st->reader = NULL;
+    if(st->writer == fib)
+        st->writer = NULL;
+    io->source.waiting--;
+    cfib_unpark(fib);
+}
+
+static int _io_poll(cfib_sched_source_t* source, long timeout_ns)
+{
+    struct _cfib_io* io = (struct _cfib_io*)source;
+    struct epoll_event evs[_MAX_EVENTS];
+    int timeout_ms = timeout_ns < 0 ? -1 : (int)((timeout_ns + 999999) / 1000000);
+    int n = epoll_wait(io->epfd, evs, _MAX_EVENTS, timeout_ms);
+    if(n < 0)
+        return errno == EINTR ? 0 : -1;
+    int woken = 0;
+    for(int i = 0; i < n; i++) {
+        int fd = evs[i].data.fd;
+        if(fd < 0 || (size_t)fd >= io->num_fds)
+            continue;
+        struct _cfib_io_fd* st = &io->fds[fd];
+        uint32_t ev = evs[i].events;
+        if(st->reader != NULL && (ev & (EPOLLIN|EPOLLRDHUP|EPOLLHUP|EPOLLERR))) {
+            _io_wake(io, st, st->reader);
+            woken++;
+        }
+        if(st->writer != NULL && (ev & (EPOLLOUT|EPOLLHUP|EPOLLERR))) {
+            _io_wake(io, st, st->writer);
+            woken++;
+        }
+    }
+    return woken;
+}
+
+// @internal Creates this thread's epoll instance on first use.
+static int _io_init()
+{
+    if(_io.epfd >= 0)
+        return 0;
+    _io.epfd = epoll_create1(EPOLL_CLOEXEC);
+    if(_io.epfd < 0)
+        return -1;
+    _io.source.fd = _io.epfd;
+    _io.source.waiting = 0;
+    _io.source.poll = _io_poll;
+    cfib_sched_add_source(&_io.source);
+    return 0;
+}
+
+// @internal Returns the state of 'fd', growing the state table if needed.
+static struct _cfib_io_fd* _io_fd(int fd)
+{
+    if((size_t)fd >= _io.num_fds) {
+        size_t n = _io.num_fds > 0 ? _io.num_fds : 64;
+        while(n <= (size_t)fd)
+            n *= 2;
+        struct _cfib_io_fd* fds = realloc(_io.fds, n * sizeof(struct _cfib_io_fd));
+        if(fds == NULL)
+            return NULL;
+        memset(fds + _io.num_fds, 0, (n - _io.num_fds) * sizeof(struct _cfib_io_fd));
+        _io.fds = fds;
+        _io.num_fds = n;
+    }
+    return &_io.fds[fd];
+}
+
+// @internal Parks the calling fiber until 'fd' is ready for 'events', or
+// until the deadline passes.
+static int _io_wait(int fd, short events, uint64_t deadline_ns)
+{
+    if(fd < 0) {
+        errno = EBADF;
+        return -1;
+    }
+    if(_io_init() < 0)
+        return -1;
+    struct _cfib_io_fd* st = _io_fd(fd);
+    if(st == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+    if(!st->registered) {
+        // Edge-triggered, so one registration covers all later waits
+        struct epoll_event ev = {
+            .events = EPOLLIN|EPOLLOUT|EPOLLRDHUP|EPOLLET,
+            .data.fd = fd
+        };
+        if(epoll_ctl(_io.epfd, EPOLL_CTL_ADD, fd, &ev) < 0 && errno != EEXIST)
+            return -1;
+        st->registered = 1;
+    }
+    if(((events & POLLIN) && st->reader != NULL) || ((events & POLLOUT) && st->writer != NULL)) {
+        errno = EBUSY;
+        return -1;
+    }
+    cfib_t* self = cfib_get_current();
+    if(events & POLLIN)
+        st->reader = self;
+    if(events & POLLOUT)
+        st->writer = self;
+    _io.source.waiting++;
+    if(cfib_park_until(deadline_ns) < 0 && (st->reader == self || st->writer == self)) {
+        // Still in the slots, so the reactor did not wake us: give them up
+        if(st->reader == self)
+            st->reader = NULL;
+        if(st->writer == self)
+            st->writer = NULL;
+        _io.source.waiting--;
+        errno = ETIMEDOUT;
+        return -1;
+    }
+    return 0;
+}
+
+ssize_t cfib_read(int fd, void* buf, size_t count)
+{
+    return cfib_read_until(fd, buf, count, CFIB_NO_DEADLINE);
+}
+
+ssize_t cfib_read_until(int fd, void* buf, size_t count, uint64_t deadline_ns)
+{
+    for(;;) {
+        ssize_t res = read(fd, buf, count);
+        if(res >= 0)
+            return res;
+        if(errno == EINTR)
+            continue;
+        if(errno != EAGAIN && errno != EWOULDBLOCK)
+            return -1;
+        if(_io_wait(fd, POLLIN, deadline_ns) < 0)
+            return -1;
+    }
+}
+
+ssize_t cfib_write(int fd, const void* buf, size_t count)
+{
+    return cfib_write_until(fd, buf, count, CFIB_NO_DEADLINE);
+}
+
+ssize_t cfib_write_until(int fd, const void* buf, size_t count, uint64_t deadline_ns)
+{
+    for(;;) {
+        ssize_t res = write(fd, buf, count);
+        if(res >= 0)
+            return res;
+        if(errno == EINTR)
+            continue;
+        if(errno != EAGAIN && errno != EWOULDBLOCK)
+            return -1;
+        if(_io_wait(fd, POLLOUT, deadline_ns) < 0)
+            return -1;
+    }
+}
+
+int cfib_accept(int fd, struct sockaddr* addr, socklen_t* addrlen)
+{
+    return cfib_accept_until(fd, addr, addrlen, CFIB_NO_DEADLINE);
+}
+
+int cfib_accept_until(int fd, struct sockaddr* addr, socklen_t* addrlen, uint64_t deadline_ns)
+{
+    for(;;) {
+        int res = accept4(fd, addr, addrlen, SOCK_NONBLOCK|SOCK_CLOEXEC);
+        if(res >= 0)
+            return res;
+        if(errno == EINTR)
+            continue;
+        if(errno != EAGAIN && errno != EWOULDBLOCK)
+            return -1;
+        if(_io_wait(fd, POLLIN, deadline_ns) < 0)
+            return -1;
+    }
+}
+
+int cfib_connect(int fd, const struct sockaddr* addr, socklen_t addrlen)
+{
+    return cfib_connect_until(fd, addr, addrlen, CFIB_NO_DEADLINE);
+}
+
+int cfib_connect_until(int fd, const struct sockaddr* addr, socklen_t addrlen, uint64_t deadline_ns)
+{
+    int res = connect(fd, addr, addrlen);
+    if(res == 0)
+        return 0;
+    if(errno != EINPROGRESS && errno != EINTR)
+        return -1;
+    // Connection completes in the background, and the socket becomes
+    // writable once it's done, successfully or not.
+    if(_io_wait(fd, POLLOUT, deadline_ns) < 0)
+        return -1;
+    int err = 0;
+    socklen_t len = sizeof(err);
+    if(getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0)
+        return -1;
+    if(err != 0) {
+        errno = err;
+        return -1;
+    }
+    return 0;
+}
+
+int cfib_poll_fd(int fd, short events)
+{
+    return cfib_poll_fd_until(fd, events, CFIB_NO_DEADLINE);
+}
+
+int cfib_poll_fd_until(int fd, short events, uint64_t deadline_ns)
+{
+    struct pollfd pfd = {.fd = fd, .events = events, .revents = 0};
+    for(;;) {
+        // Edge-triggered readiness only reports changes, so check first
+        int res = poll(&pfd, 1, 0);
+        if(res > 0)
+            return pfd.revents;
+        if(res < 0 && errno != EINTR)
+            return -1;
+        if(res == 0 && _io_wait(fd, events & (POLLIN|POLLOUT), deadline_ns) < 0)
+            return -1;
+    }
+}
+
+int cfib_close(int fd)
+{
+    if(fd >= 0 && (size_t)fd < _io.num_fds) {
+        struct _cfib_io_fd* st = &_io.fds[fd];
+        // Waiters retry their operations, and fail with EBADF
+        if(st->reader != NULL)
+            _io_wake(&_io, st, st->reader);
+        if(st->writer != NULL)
+            _io_wake(&_io, st, st->writer);
+        if(st->registered)
+            epoll_ctl(_io.epfd, EPOLL_CTL_DEL, fd, NULL);
+        st->registered = 0;
+    }
+    return close(fd);
+}
@@ -0,0 +1,82 @@
+#ifndef _CFIB_IO_H_
+#define _CFIB_IO_H_
+
+/** @file cfib_io.h
+ *
+ * Fiber-blocking I/O on top of the per-thread scheduler (see cfib_sched.h).
+ *
+ * The functions of this module look like their blocking POSIX counterparts,
+ * but they block only the calling fiber, not the thread. Each call first
+ * tries the non-blocking system call. If it would block (EAGAIN), the file
+ * descriptor is registered with the thread's edge-triggered epoll instance
+ * (the "reactor"), and the fiber parks until the descriptor becomes ready.
+ * The reactor is an event source of the scheduler, so the loop fiber waits
+ * in epoll_wait() when nothing else is runnable, and wakes all the fibers
+ * whose descriptors became ready with one call.
+ *
+ * File descriptors passed to these functions MUST be in non-blocking mode
+ * (O_NONBLOCK). Descriptors returned by cfib_accept() already are. Close the
+ * descriptors with cfib_close(), so that the reactor forgets them.
+ *
+ * At most one fiber may wait for reading and one for writing on the same
+ * descriptor at a time; others get -1 with errno set to EBUSY.
+ *
+ * Each blocking function has a variant ending in _until(), which waits at
+ * most until a deadline, in nanoseconds of cfib_clock_ns(). If the deadline
+ * passes first, the fiber gives up it's place in the reactor, and the call
+ * returns -1 with errno set to ETIMEDOUT.
+ *
+ * All functions must be called from fibers run by cfib_sched_run().
+ */
+
+#include "cfib_sched.h"
+
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** Reads from a descriptor like read(2), blocking only the calling fiber.
+ */
+ssize_t cfib_read(int fd, void* buf, size_t count);
+ssize_t cfib_read_until(int fd, void* buf, size_t count, uint64_t deadline_ns);
+
+/** Writes to a descriptor like write(2), blocking only the calling fiber.
+ *
+ * Like write(2), this may write less than 'count' bytes.
+ */
+ssize_t cfib_write(int fd, const void* buf, size_t count);
+ssize_t cfib_write_until(int fd, const void* buf, size_t count, uint64_t deadline_ns);
+
+/** Accepts a connection like accept(2), blocking only the calling fiber.
+ *
+ * @return the accepted descriptor in non-blocking mode, or -1 on error.
+ */
+int cfib_accept(int fd, struct sockaddr* addr, socklen_t* addrlen);
+int cfib_accept_until(int fd, struct sockaddr* addr, socklen_t* addrlen, uint64_t deadline_ns);
+
+/** Connects a socket like connect(2), blocking only the calling fiber.
+ */
+int cfib_connect(int fd, const struct sockaddr* addr, socklen_t addrlen);
+int cfib_connect_until(int fd, const struct sockaddr* addr, socklen_t addrlen, uint64_t deadline_ns);
+
+/** Waits until a descriptor is ready for I/O.
+ *
+ * @param[in] fd the descriptor.
+ * @param[in] events POLLIN, POLLOUT or both.
+ * @return the ready events (as in poll(2) revents), or -1 on error.
+ */
+int cfib_poll_fd(int fd, short events);
+int cfib_poll_fd_until(int fd, short events, uint64_t deadline_ns);
+
+/** Closes a descriptor used with the functions of this module.
+ */
+int cfib_close(int fd);
+
+#ifdef __cplusplus
+} /* extern "C" { */
+#endif
+
+#endif /* _CFIB_IO_H_ */
@@ -0,0 +1,337 @@
+#include "cfib_mt.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#ifdef _WITH_C11_ATOMICS
+#include <stdatomic.h>
+#else
+#error "Compiler does not support C11 _Atomic, cannot compile the M:N runtime!"
+#endif
+
+#ifdef _WITH_SYSAPI_POSIX
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#elif defined (_WITH_SYSAPI_WINDOWS)
+    #error "TODO: WINAPI support."
+#endif
+
+/* Chase-Lev work-stealing deque.
+ *
+ * This is the C11 formulation from the paper "Correct and Efficient
+ * Work-Stealing for Weak Memory Models" by Lê, Pop, Cohen and Zappa Nardelli.
+ * The owner pushes fibers to the bottom, and everybody (including the owner)
+ * takes fibers from the top with a CAS. We never pop from the bottom, because
+ * that would make the owner run the most recently yielded fiber first, and
+ * two fibers yielding to each other would starve the rest.
+ *
+ * When the circular array fills up, the owner replaces it with one twice as
+ * large. A thief may still be reading the old array, so old arrays are kept
+ * until the deque is destroyed.
+ */
+struct _ws_array {
+    size_t size;
+    struct _ws_array* prev;
+    _Atomic(cfib_t*) buf[];
+};
+
+struct _ws_deque {
+    atomic_size_t top;
+    atomic_size_t bottom;
+    _Atomic(struct _ws_array*) array;
+};
+
+#define _WS_INITIAL_SIZE 256
+#define _WS_EMPTY NULL
+#define _WS_ABORT ((cfib_t*)1)
+
+static struct _ws_array* _ws_array_new(size_t size, struct _ws_array* prev)
+{
+    struct _ws_array* a = malloc(sizeof(struct _ws_array) + size * sizeof(_Atomic(cfib_t*)));
+    if(a == NULL) {
+        fprintf(stderr, "libcfib: FATAL: out of memory in work-stealing deque!\n");
+        abort();
+    }
+    a->size = size;
+    a->prev = prev;
+    return a;
+}
+
+static void _ws_init(struct _ws_deque* d)
+{
+    atomic_init(&d->top, 0);
+    atomic_init(&d->bottom, 0);
+    atomic_init(&d->array, _ws_array_new(_WS_INITIAL_SIZE, NULL));
+}
+
+static void _ws_destroy(struct _ws_deque* d)
+{
+    struct _ws_array* a = atomic_load_explicit(&d->array, memory_order_relaxed);
+    while(a != NULL) {
+        struct _ws_array* prev = a->prev;
+        free(a);
+        a = prev;
+    }
+}
+
+// @internal Called by the owner of the deque only.
+static void _ws_push(struct _ws_deque* d, cfib_t* fib)
+{
+    size_t b = atomic_load_explicit(&d->bottom, memory_order_relaxed);
+    size_t t = atomic_load_explicit(&d->top, memory_order_acquire);
+    struct _ws_array* a = atomic_load_explicit(&d->array, memory_order_relaxed);
+    if(b - t > a->size - 1) {
+        struct _ws_array* grown = _ws_array_new(a->size * 2, a);
+        for(size_t i = t; i < b; i++)
+            atomic_store_explicit(&grown->buf[i % grown->size], atomic_load_explicit(&a->buf[i % a->size], memory_order_relaxed), memory_order_relaxed);
+        atomic_store_explicit(&d->array, grown, memory_order_release);
+        a = grown;
+    }
+    atomic_store_explicit(&a->buf[b % a->size], fib, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    atomic_store_explicit(&d->bottom, b + 1, memory_order_relaxed);
+}
+
+// @internal Returns _WS_EMPTY, _WS_ABORT if lost a race, or a fiber.
+static cfib_t* _ws_steal(struct _ws_deque* d)
+{
+    size_t t = atomic_load_explicit(&d->top, memory_order_acquire);
+    atomic_thread_fence(memory_order_seq_cst);
+    size_t b = atomic_load_explicit(&d->bottom, memory_order_acquire);
+    if(t >= b)
+        return _WS_EMPTY;
+    struct _ws_array* a = atomic_load_explicit(&d->array, memory_order_acquire);
+    cfib_t* fib = atomic_load_explicit(&a->buf[t % a->size], memory_order_relaxed);
+    if(!atomic_compare_exchange_strong_explicit(&d->top, &t, t + 1, memory_order_seq_cst, memory_order_relaxed))
+        return _WS_ABORT;
+    return fib;
+}
+
+struct _cfib_mt;
+
+struct _cfib_mt_worker {
+    struct _cfib_mt* rt;
+    unsigned index;
+    // State of the xorshift generator for picking steal victims
+    uint32_t rand;
+    pthread_t thread;
+    // The worker thread's own fiber, which runs the worker loop
+    cfib_t* loop;
+    // The fiber we just swapped out of, to be pushed to the deque once it's
+    // context has been saved, ie. after the swap
+    cfib_t* pending;
+    // The fiber which just finished, to be released after the swap
+    cfib_t* zombie;
+    struct _ws_deque deque;
+};
+
+struct _cfib_mt {
+    unsigned num_workers;
+    struct _cfib_mt_worker* workers;
+    // Number of fibers which have not finished yet
+    atomic_size_t live;
+    atomic_int stop;
+};
+
+static _Thread_local struct _cfib_mt_worker* _mt_self = NULL;
+
+// @internal Returns the worker of the calling thread. Fibers migrate between
+// threads, so this must not be inlined: the compiler would be free to reuse
+// the thread-local address computed before a swap, after the swap.
+static __attribute__((noinline)) struct _cfib_mt_worker* _get_worker()
+{
+    return _mt_self;
+}
+
+// @internal Deferred work of the fiber we swapped out of. Must be called
+// right after every swap, in the fiber that was swapped into.
+static void _post_switch(struct _cfib_mt_worker* w)
+{
+    if(w->pending != NULL) {
+        _ws_push(&w->deque, w->pending);
+        w->pending = NULL;
+    }
+    if(w->zombie != NULL) {
+        cfib_release(w->zombie);
+        w->zombie = NULL;
+        if(atomic_fetch_sub_explicit(&w->rt->live, 1, memory_order_acq_rel) == 1)
+            atomic_store_explicit(&w->rt->stop, 1, memory_order_release);
+    }
+}
+
+// @internal Takes the next fiber from own deque, or steals one.
+static cfib_t* _take_fiber(struct _cfib_mt_worker* w)
+{
+    cfib_t* fib;
+    while((fib = _ws_steal(&w->deque)) == _WS_ABORT);
+    if(fib != _WS_EMPTY)
+        return fib;
+    unsigned n = w->rt->num_workers;
+    if(n < 2)
+        return NULL;
+    // Start from a random victim, then try each other worker once
+    w->rand ^= w->rand << 13;
+    w->rand ^= w->rand >> 17;
+    w->rand ^= w->rand << 5;
+    unsigned victim = w->rand % n;
+    for(unsigned i = 0; i < n; i++, victim = (victim + 1) % n) {
+        if(victim == w->index)
+            continue;
+        fib = _ws_steal(&w->rt->workers[victim].deque);
+        if(fib != _WS_EMPTY && fib != _WS_ABORT)
+            return fib;
+    }
+    return NULL;
+}
+
+// @internal Returns the next fiber to run in this worker, or NULL.
+static cfib_t* _next_fiber(struct _cfib_mt_worker* w)
+{
+    cfib_t* fib = _take_fiber(w);
+    // A growable stack may have been created by another worker, and it's
+    // faults are handled on the alternate signal stack of this one. If that
+    // fails, which was warned about, the fiber still runs as long as it
+    // does not grow.
+    if(fib != NULL && (fib->_flags & CFIB_STACK_GROW))
+        cfib_grow_init_thread();
+    return fib;
+}
+
+static void _mt_entry(void* args)
+{
+    _post_switch(_get_worker());
+    cfib_t* self = cfib_get_current();
+    self->_reserved.start_routine(args);
+    // We can not release our own stack, so leave that to the next fiber
+    struct _cfib_mt_worker* w = _get_worker();
+    w->zombie = self;
+    cfib_t* next = _next_fiber(w);
+    cfib_swap(next != NULL ? next : w->loop);
+    // Never reached, nobody swaps back into a zombie
+    abort();
+}
+
+static cfib_t* _mt_new(cfib_func start_routine, void* args, const cfib_attr_t* attr)
+{
+    cfib_t* fib = cfib_new(_mt_entry, args, attr);
+    if(fib == NULL)
+        return NULL;
+    fib->_reserved.start_routine = start_routine;
+    return fib;
+}
+
+cfib_t* cfib_mt_spawn(cfib_func start_routine, void* args, const cfib_attr_t* attr)
+{
+    struct _cfib_mt_worker* w = _get_worker();
+    assert("cfib_mt_spawn() called outside of the M:N runtime !!!" && w != NULL);
+    cfib_t* fib = _mt_new(start_routine, args, attr);
+    if(fib == NULL)
+        return NULL;
+    atomic_fetch_add_explicit(&w->rt->live, 1, memory_order_relaxed);
+    _ws_push(&w->deque, fib);
+    return fib;
+}
+
+void cfib_mt_yield()
+{
+    struct _cfib_mt_worker* w = _get_worker();
+    assert("cfib_mt_yield() called outside of the M:N runtime !!!" && w != NULL);
+    cfib_t* next = _next_fiber(w);
+    if(next == NULL)
+        return;
+    w->pending = cfib_get_current();
+    cfib_swap(next);
+    // We may have been stolen, and be running on another worker now
+    _post_switch(_get_worker());
+}
+
+unsigned cfib_mt_worker_id()
+{
+    struct _cfib_mt_worker* w = _get_worker();
+    assert("cfib_mt_worker_id() called outside of the M:N runtime !!!" && w != NULL);
+    return w->index;
+}
+
+// @internal Backs off progressively while a worker finds nothing to run.
+static void _idle_backoff(unsigned* idle_rounds)
+{
+    if(*idle_rounds < 64) {
+        sched_yield();
+    } else {
+        struct timespec ts = {.tv_sec = 0, .tv_nsec = 50000};
+        nanosleep(&ts, NULL);
+    }
+    (*idle_rounds)++;
+}
+
+static void* _worker_main(void* arg)
+{
+    struct _cfib_mt_worker* w = (struct _cfib_mt_worker*)arg;
+    w->loop = cfib_init_thread();
+    _mt_self = w;
+    unsigned idle_rounds = 0;
+    while(!atomic_load_explicit(&w->rt->stop, memory_order_acquire)) {
+        cfib_t* next = _next_fiber(w);
+        if(next == NULL) {
+            _idle_backoff(&idle_rounds);
+            continue;
+        }
+        idle_rounds = 0;
+        cfib_swap(next);
+        _post_switch(w);
+    }
+    _mt_self = NULL;
+    return NULL;
+}
+
+int cfib_mt_run(unsigned num_workers, cfib_func start_routine, void* args, const cfib_attr_t* attr)
+{
+    if(num_workers == 0) {
+        long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+        num_workers = ncpu > 0 ? (unsigned)ncpu : 1;
+    }
+    struct _cfib_mt rt;
+    rt.num_workers = num_workers;
+    rt.workers = calloc(num_workers, sizeof(struct _cfib_mt_worker));
+    if(rt.workers == NULL)
+        return -1;
+    atomic_init(&rt.live, 1);
+    atomic_init(&rt.stop, 0);
+    for(unsigned i = 0; i < num_workers; i++) {
+        rt.workers[i].rt = &rt;
+        rt.workers[i].index = i;
+        rt.workers[i].rand = 2463534242u + i;
+        _ws_init(&rt.workers[i].deque);
+    }
+    cfib_t* first = _mt_new(start_routine, args, attr);
+    if(first == NULL)
+        goto _errexit;
+    _ws_push(&rt.workers[0].deque, first);
+    unsigned started = 0;
+    for(; started < num_workers; started++) {
+        if(pthread_create(&rt.workers[started].thread, NULL, _worker_main, &rt.workers[started]) != 0) {
+            fprintf(stderr, "libcfib: WARNING: cfib_mt_run() failed to create worker thread!\n");
+            break;
+        }
+    }
+    if(started == 0) {
+        cfib_release(first);
+        goto _errexit;
+    }
+    // Workers which were not started are never stolen from, since their
+    // deques are empty. The run still completes with fewer workers.
+    for(unsigned i = 0; i < started; i++)
+        pthread_join(rt.workers[i].thread, NULL);
+    for(unsigned i = 0; i < num_workers; i++)
+        _ws_destroy(&rt.workers[i].deque);
+    free(rt.workers);
+    return 0;
+_errexit:
+    for(unsigned i = 0; i < num_workers; i++)
+        _ws_destroy(&rt.workers[i].deque);
+    free(rt.workers);
+    return -1;
+}
@@ -0,0 +1,85 @@
+#ifndef _CFIB_MT_H_
+#define _CFIB_MT_H_
+
+/** @file cfib_mt.h
+ *
+ * Optional multi-threaded (M:N) fiber runtime with work stealing.
+ *
+ * The runtime runs M fibers on N worker threads. Each worker owns a
+ * Chase-Lev work-stealing deque of runnable fibers. A worker takes fibers
+ * from it's own deque in FIFO order, and when it runs out of work, it steals
+ * from the deques of the other workers. Thus a fiber which yields on one
+ * worker may be resumed on another.
+ *
+ * CONSTRAINTS for code running in the fibers of this runtime:
+ *
+ * - After cfib_mt_yield() returns, the fiber may be running on a different
+ *   thread than before the call. Every pointer to a _Thread_local variable,
+ *   a pthread_self() value and errno obtained before the call are stale.
+ * - Compilers assume that a function runs on one thread from start to end,
+ *   and may keep the address of a thread-local variable in a register over
+ *   a function call. Do not access thread-local variables in the same
+ *   function both before and after cfib_mt_yield(); access them through a
+ *   separate (non-inlined) function instead.
+ * - Never hold a lock of a pthread mutex (or any other thread-owned lock)
+ *   over cfib_mt_yield(), the lock might get released by another thread.
+ * - cfib_get_previous() is meaningless in this runtime.
+ * - The per-thread scheduler of cfib_sched.h must not be used in the fibers
+ *   of this runtime.
+ *
+ * This module requires C11 atomics, and is left out of the library if the
+ * compiler does not support them.
+ */
+
+#include "cfib.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** Runs a fiber in a new M:N runtime and waits until all fibers finish.
+ *
+ * Starts 'num_workers' worker threads, each initialized with
+ * cfib_init_thread(), and runs 'start_routine(args)' in a new fiber on one
+ * of them. That fiber, and the fibers it spawns, may spawn more fibers with
+ * cfib_mt_spawn(). This function returns once all the fibers have returned
+ * and all worker threads have exited.
+ *
+ * @param[in] num_workers number of worker threads, 0 for one per online CPU.
+ * @param[in] start_routine entrypoint of the first fiber.
+ * @param[in] args argument passed to 'start_routine'.
+ * @param[in] attr attributes for the first fiber, if NULL, defaults are used
+ * @return 0 on success, -1 if the runtime could not be started.
+ */
+int cfib_mt_run(unsigned num_workers, cfib_func start_routine, void* args, const cfib_attr_t* attr);
+
+/** Creates a fiber and makes it runnable in the current M:N runtime.
+ *
+ * Must be called from a fiber running in the M:N runtime. Arguments are the
+ * same as in cfib_new(). The 'start_routine' may return, after which the
+ * fiber is unmapped and freed by the runtime.
+ *
+ * @return pointer to the new fiber, or NULL if memory allocation failed.
+ */
+cfib_t* cfib_mt_spawn(cfib_func start_routine, void* args, const cfib_attr_t* attr);
+
+/** Lets the other runnable fibers of the M:N runtime run.
+ *
+ * Swaps into the next runnable fiber of this worker, or into a fiber stolen
+ * from another worker. The current fiber is made runnable again, and may be
+ * resumed by any worker. If there are no other runnable fibers, returns
+ * immediately.
+ */
+void cfib_mt_yield();
+
+/** Returns the index of the worker running the current fiber.
+ *
+ * @return worker index in the range [0, num_workers).
+ */
+unsigned cfib_mt_worker_id();
+
+#ifdef __cplusplus
+} /* extern "C" { */
+#endif
+
+#endif /* _CFIB_MT_H_ */
@@ -0,0 +1,519 @@
+#include "cfib_sched.h"
+
+#include "cfib_timer.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+#include <stdint.h>
+#include <errno.h>
+
+#ifdef _WITH_C11_ATOMICS
+#include <stdatomic.h>
+#endif
+
+#ifdef _WITH_SYSAPI_POSIX
+#include <poll.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/eventfd.h>
+#endif
+#elif defined (_WITH_SYSAPI_WINDOWS)
+    #error "TODO: WINAPI support."
+#endif
+
+/* Values of the state member of cfib_t */
+#define _ST_RUNNING 0
+#define _ST_READY   1
+#define _ST_PARKED  2
+// Parked in cfib_park_remote(), only a remote wakeup makes it runnable
+#define _ST_REMOTE  3
+
+#ifdef _WITH_C11_ATOMICS
+/* Remote wakeup inbox
+ *
+ * Other threads push fibers to a lock-free stack (MPSC: many producers, the
+ * owning thread is the only consumer), linked through the remote_next
+ * member of the fibers. The owner takes the whole stack at once with an
+ * atomic exchange. A fiber is pushed only if it's link is NULL, so it's in
+ * the stack at most once.
+ *
+ * Before the owner sleeps, it sets 'sleeping' and checks the stack once
+ * more. A waker which clears 'sleeping' writes to 'efd', and the owner
+ * reads it back when it sees that 'sleeping' was cleared by someone else.
+ * Thus the descriptor is touched only when the owner actually sleeps.
+ */
+struct _cfib_inbox {
+    // Must be the first member, the callbacks cast it to _cfib_inbox
+    cfib_sched_source_t source;
+    _Atomic(cfib_t*) head;
+    atomic_int sleeping;
+    // Read end of the wakeup descriptor, the same as 'wfd' for an eventfd
+    int efd;
+    int wfd;
+    // Set by the owner when it sets 'sleeping'
+    int armed;
+};
+
+// Terminates the inbox stack, since a NULL link means "not in the inbox"
+#define _INBOX_END ((cfib_t*)1)
+// The link of a finished fiber, which is never pushed again
+#define _INBOX_DEAD ((cfib_t*)2)
+#endif
+
+struct _cfib_sched {
+    // Head and tail of the ready queue, linked via cfib_t._next
+    cfib_t* head;
+    cfib_t* tail;
+    // The fiber which is running cfib_sched_run()
+    cfib_t* loop;
+    // Registered event sources
+    cfib_sched_source_t* sources;
+    // Counts yields, to poll the event sources every now and then
+    unsigned ticks;
+    // Timers of sleeping fibers and of parks with a timeout
+    cfib_wheel_t wheel;
+    int wheel_ready;
+#ifdef _WITH_C11_ATOMICS
+    // Fibers woken up by other threads
+    struct _cfib_inbox inbox;
+#endif
+};
+
+/* How many yields between non-blocking polls of the event sources */
+#define _POLL_INTERVAL 64
+/* Max number of event sources waited on at once */
+#define _MAX_SOURCES 16
+
+static _Thread_local struct _cfib_sched _sched = {
+    .head = NULL,
+    .tail = NULL,
+    .loop = NULL,
+    .sources = NULL,
+    .ticks = 0,
+    .wheel_ready = 0,
+#ifdef _WITH_C11_ATOMICS
+    .inbox = {.efd = -1, .wfd = -1}
+#endif
+};
+
+static inline void _ready_push(cfib_t* fib)
+{
+    fib->_reserved.state = _ST_READY;
+    fib->_next = NULL;
+    if(_sched.tail != NULL)
+        _sched.tail->_next = fib;
+    else
+        _sched.head = fib;
+    _sched.tail = fib;
+}
+
+static inline cfib_t* _ready_pop()
+{
+    cfib_t* fib = _sched.head;
+    if(fib != NULL) {
+        _sched.head = fib->_next;
+        if(_sched.head == NULL)
+            _sched.tail = NULL;
+        fib->_next = NULL;
+        fib->_reserved.state = _ST_RUNNING;
+    }
+    return fib;
+}
+
+#ifdef _WITH_C11_ATOMICS
+static void _inbox_retire(cfib_t* self);
+#endif
+
+static void _spawn_entry(void* args)
+{
+    cfib_t* self = cfib_get_current();
+    self->_reserved.start_routine(args);
+#ifdef _WITH_C11_ATOMICS
+    // It's recycled when it returns, so no wakeup may still refer to it
+    _inbox_retire(self);
+#endif
+}
+
+cfib_t* cfib_spawn(cfib_func start_routine, void* args, const cfib_attr_t* attr)
+{
+    // A finished fiber is released by the library, and it's stack is reused
+    // by the next cfib_spawn()
+    cfib_attr_t _attr = attr != NULL ? *attr : (cfib_attr_t){.stack_size = CFIB_DEF_STACK_SIZE, .flags = 0, .tag = NULL};
+    _attr.flags |= CFIB_AUTO_RECYCLE;
+    cfib_t* fib = cfib_new(_spawn_entry, args, &_attr);
+    if(fib == NULL)
+        return NULL;
+    fib->_reserved.start_routine = start_routine;
+    // When it finishes, it swaps into the loop fiber. If the loop is not
+    // running yet, cfib_sched_run() sets this.
+    cfib_set_successor(fib, _sched.loop);
+    fib->_reserved.owner = &_sched;
+    _ready_push(fib);
+    return fib;
+}
+
+// @internal Polls the event sources which have waiting fibers. Returns 0 if
+// there were none, so there is nothing to wait for.
+static int _sched_poll(long timeout_ns)
+{
+    cfib_sched_source_t* waiting[_MAX_SOURCES];
+    nfds_t n = 0;
+    for(cfib_sched_source_t* src = _sched.sources; src != NULL; src = src->_next) {
+        if(src->waiting > 0 && n < _MAX_SOURCES)
+            waiting[n++] = src;
+    }
+    if(n == 0)
+        return 0;
+    if(n == 1 || timeout_ns == 0) {
+        for(nfds_t i = 0; i < n; i++)
+            waiting[i]->poll(waiting[i], n == 1 ? timeout_ns : 0);
+        return 1;
+    }
+    // Several sources. Poll each one without waiting first, since a source
+    // may have work to flush before it's descriptor can become readable.
+    int woken = 0;
+    for(nfds_t i = 0; i < n; i++)
+        woken += waiting[i]->poll(waiting[i], 0) > 0;
+    if(woken > 0)
+        return 1;
+    // Then wait until any of them has events
+    struct pollfd pfds[_MAX_SOURCES];
+    int timeout_ms = timeout_ns < 0 ? -1 : (int)((timeout_ns + 999999) / 1000000);
+    for(nfds_t i = 0; i < n; i++) {
+        pfds[i].fd = waiting[i]->fd;
+        pfds[i].events = POLLIN;
+        pfds[i].revents = 0;
+        if(waiting[i]->prepare != NULL && waiting[i]->prepare(waiting[i]))
+            timeout_ms = 0;
+    }
+    poll(pfds, n, timeout_ms);
+    for(nfds_t i = 0; i < n; i++) {
+        if(pfds[i].revents != 0 || waiting[i]->prepare != NULL)
+            waiting[i]->poll(waiting[i], 0);
+    }
+    return 1;
+}
+
+void cfib_sched_add_source(cfib_sched_source_t* source)
+{
+    source->_next = _sched.sources;
+    _sched.sources = source;
+}
+
+void cfib_sched_remove_source(cfib_sched_source_t* source)
+{
+    cfib_sched_source_t** link = &_sched.sources;
+    while(*link != NULL) {
+        if(*link == source) {
+            *link = source->_next;
+            source->_next = NULL;
+            return;
+        }
+        link = &(*link)->_next;
+    }
+}
+
+// @internal Waits for events while nothing is runnable, at most until the
+// next timer expires. Returns 0 if there is nothing to wait for.
+static int _sched_wait()
+{
+    long timeout_ns = -1;
+    if(_sched.wheel.count > 0) {
+        uint64_t now = cfib_clock_ns();
+        cfib_wheel_advance(&_sched.wheel, now);
+        if(_sched.head != NULL)
+            return 1;
+        uint64_t next = cfib_wheel_next(&_sched.wheel);
+        if(next != UINT64_MAX)
+            timeout_ns = next > now ? (long)(next - now) : 0;
+    }
+    if(!_sched_poll(timeout_ns)) {
+        if(timeout_ns < 0)
+            return 0;
+        // Only timers to wait for
+        struct timespec tp = {.tv_sec = timeout_ns / 1000000000, .tv_nsec = timeout_ns % 1000000000};
+        nanosleep(&tp, NULL);
+    }
+    if(_sched.wheel.count > 0)
+        cfib_wheel_advance(&_sched.wheel, cfib_clock_ns());
+    return 1;
+}
+
+void cfib_yield()
+{
+    assert("cfib_yield() called outside of cfib_sched_run() !!!" && _sched.loop != NULL && _sched.loop != cfib_get_current());
+    if(++_sched.ticks % _POLL_INTERVAL == 0) {
+        if(_sched.sources != NULL)
+            _sched_poll(0);
+        if(_sched.wheel.count > 0)
+            cfib_wheel_advance(&_sched.wheel, cfib_clock_ns());
+    }
+    if(_sched.head == NULL)
+        return;
+    cfib_t* self = cfib_get_current();
+    _ready_push(self);
+    cfib_swap(_ready_pop());
+}
+
+static inline void _park(unsigned state)
+{
+    cfib_t* self = cfib_get_current();
+    // A parked fiber may stay idle for long, give it's deep pages back
+    cfib_reclaim_auto(self);
+    self->_reserved.state = state;
+    cfib_t* next = _ready_pop();
+    cfib_swap(next != NULL ? next : _sched.loop);
+}
+
+void cfib_park()
+{
+    assert("cfib_park() called outside of cfib_sched_run() !!!" && _sched.loop != NULL && _sched.loop != cfib_get_current());
+    _park(_ST_PARKED);
+}
+
+// Timer of a timed park, on the stack of the parked fiber
+struct _sched_timeout {
+    cfib_timer_t timer;
+    cfib_t* fib;
+    int expired;
+};
+
+static void _timeout_expire(cfib_timer_t* timer)
+{
+    struct _sched_timeout* t = (struct _sched_timeout*)timer;
+    if(t->fib->_reserved.state == _ST_PARKED) {
+        t->expired = 1;
+        _ready_push(t->fib);
+    }
+}
+
+int cfib_park_until(uint64_t deadline_ns)
+{
+    assert("cfib_park_until() called outside of cfib_sched_run() !!!" && _sched.loop != NULL && _sched.loop != cfib_get_current());
+    if(deadline_ns == CFIB_NO_DEADLINE) {
+        _park(_ST_PARKED);
+        return 0;
+    }
+    if(!_sched.wheel_ready) {
+        cfib_wheel_init(&_sched.wheel, cfib_clock_ns());
+        _sched.wheel_ready = 1;
+    }
+    struct _sched_timeout t = {.fib = cfib_get_current(), .expired = 0};
+    t.timer.func = _timeout_expire;
+    cfib_wheel_add(&_sched.wheel, &t.timer, deadline_ns);
+    _park(_ST_PARKED);
+    cfib_wheel_cancel(&_sched.wheel, &t.timer);
+    return t.expired ? -1 : 0;
+}
+
+int cfib_park_timeout(long timeout_ns)
+{
+    if(timeout_ns < 0) {
+        cfib_park();
+        return 0;
+    }
+    return cfib_park_until(cfib_clock_ns() + (uint64_t)timeout_ns);
+}
+
+void cfib_sleep_until(uint64_t deadline_ns)
+{
+    // Unparked by someone else before the deadline, park again
+    while(cfib_park_until(deadline_ns) == 0);
+}
+
+void cfib_sleep_ns(long ns)
+{
+    cfib_sleep_until(cfib_clock_ns() + (uint64_t)(ns > 0 ? ns : 0));
+}
+
+void cfib_unpark(cfib_t* fib)
+{
+    if(fib->_reserved.state == _ST_PARKED)
+        _ready_push(fib);
+}
+
+void cfib_handoff(cfib_t* fib)
+{
+    if(fib->_reserved.state != _ST_PARKED)
+        return;
+    cfib_t* self = cfib_get_current();
+    if(_sched.loop == NULL || self == _sched.loop) {
+        _ready_push(fib);
+        return;
+    }
+    _ready_push(self);
+    fib->_reserved.state = _ST_RUNNING;
+    cfib_swap(fib);
+}
+
+#ifdef _WITH_C11_ATOMICS
+// @internal Makes runnable the fibers in the inbox, returns how many were
+// parked in cfib_park_remote().
+static int _inbox_drain(struct _cfib_inbox* inbox)
+{
+    if(inbox->armed) {
+        inbox->armed = 0;
+        // If a waker cleared the flag, it has written (or is just about to
+        // write) the descriptor, so this read does not block for long.
+        uint64_t val;
+        if(atomic_exchange(&inbox->sleeping, 0) == 0)
+            while(read(inbox->efd, &val, sizeof(val)) < 0 && errno == EINTR);
+    }
+    cfib_t* fib = atomic_exchange_explicit(&inbox->head, NULL, memory_order_acquire);
+    if(fib == NULL)
+        return 0;
+    // The stack is in LIFO order, reverse it to wake up in FIFO order
+    cfib_t* prev = _INBOX_END;
+    while(fib != _INBOX_END) {
+        _Atomic(cfib_t*)* link = (_Atomic(cfib_t*)*)&fib->_reserved.remote_next;
+        cfib_t* next = atomic_load_explicit(link, memory_order_relaxed);
+        atomic_store_explicit(link, prev, memory_order_relaxed);
+        prev = fib;
+        fib = next;
+    }
+    int woken = 0;
+    for(fib = prev; fib != _INBOX_END; ) {
+        _Atomic(cfib_t*)* link = (_Atomic(cfib_t*)*)&fib->_reserved.remote_next;
+        cfib_t* next = atomic_load_explicit(link, memory_order_relaxed);
+        // From now on wakers may push the fiber again
+        atomic_store_explicit(link, NULL, memory_order_release);
+        fib->_reserved.woken = 1;
+        if(fib->_reserved.state == _ST_REMOTE) {
+            inbox->source.waiting--;
+            _ready_push(fib);
+            woken++;
+        }
+        fib = next;
+    }
+    return woken;
+}
+
+// @internal Makes cfib_wake_remote() ignore the finishing fiber 'self'. If
+// it's in the inbox, or a waker is just pushing it there, the inbox is
+// drained until the fiber is out of it.
+static void _inbox_retire(cfib_t* self)
+{
+    _Atomic(cfib_t*)* link = (_Atomic(cfib_t*)*)&self->_reserved.remote_next;
+    cfib_t* expected = NULL;
+    while(!atomic_compare_exchange_strong(link, &expected, _INBOX_DEAD)) {
+        _inbox_drain(&_sched.inbox);
+        // Claimed, but not pushed yet, let the waker finish
+        if(atomic_load(link) != NULL)
+            cfib_yield();
+        expected = NULL;
+    }
+}
+
+static int _inbox_prepare(cfib_sched_source_t* source)
+{
+    struct _cfib_inbox* inbox = (struct _cfib_inbox*)source;
+    inbox->armed = 1;
+    atomic_store(&inbox->sleeping, 1);
+    return atomic_load(&inbox->head) != NULL;
+}
+
+static int _inbox_poll(cfib_sched_source_t* source, long timeout_ns)
+{
+    struct _cfib_inbox* inbox = (struct _cfib_inbox*)source;
+    if(timeout_ns != 0 && !_inbox_prepare(source)) {
+        struct pollfd pfd = {.fd = inbox->efd, .events = POLLIN, .revents = 0};
+        int timeout_ms = timeout_ns < 0 ? -1 : (int)((timeout_ns + 999999) / 1000000);
+        poll(&pfd, 1, timeout_ms);
+    }
+    return _inbox_drain(inbox);
+}
+
+// @internal Creates this thread's wakeup descriptor on first use.
+static int _inbox_init()
+{
+    struct _cfib_inbox* inbox = &_sched.inbox;
+    if(inbox->efd >= 0)
+        return 0;
+#ifdef __linux__
+    inbox->efd = inbox->wfd = eventfd(0, EFD_CLOEXEC);
+    if(inbox->efd < 0)
+        return -1;
+#else
+    int fds[2];
+    if(pipe(fds) < 0)
+        return -1;
+    inbox->efd = fds[0];
+    inbox->wfd = fds[1];
+#endif
+    inbox->source.fd = inbox->efd;
+    inbox->source.waiting = 0;
+    inbox->source.poll = _inbox_poll;
+    inbox->source.prepare = _inbox_prepare;
+    cfib_sched_add_source(&inbox->source);
+    return 0;
+}
+
+int cfib_park_remote()
+{
+    assert("cfib_park_remote() called outside of cfib_sched_run() !!!" && _sched.loop != NULL && _sched.loop != cfib_get_current());
+    cfib_t* self = cfib_get_current();
+    assert("cfib_park_remote() called on a fiber not spawned in this thread !!!" && self->_reserved.owner == &_sched);
+    if(_inbox_init() < 0)
+        return -1;
+    _inbox_drain(&_sched.inbox);
+    if(!self->_reserved.woken) {
+        _sched.inbox.source.waiting++;
+        _park(_ST_REMOTE);
+    }
+    self->_reserved.woken = 0;
+    return 0;
+}
+
+void cfib_wake_remote(cfib_t* fib)
+{
+    assert("cfib_wake_remote() called on a fiber not created with cfib_spawn() !!!" && fib->_reserved.owner != NULL);
+    struct _cfib_inbox* inbox = &((struct _cfib_sched*)fib->_reserved.owner)->inbox;
+    _Atomic(cfib_t*)* link = (_Atomic(cfib_t*)*)&fib->_reserved.remote_next;
+    cfib_t* expected = NULL;
+    // Claim the link, if it's already in the inbox the wakeups coalesce. A
+    // finished fiber has a dead link, and is not woken up.
+    if(!atomic_compare_exchange_strong(link, &expected, _INBOX_END))
+        return;
+    cfib_t* head = atomic_load_explicit(&inbox->head, memory_order_relaxed);
+    do {
+        atomic_store_explicit(link, head != NULL ? head : _INBOX_END, memory_order_relaxed);
+    } while(!atomic_compare_exchange_weak(&inbox->head, &head, fib));
+    // Sequentially consistent with _inbox_prepare(): either the owner sees
+    // the fiber before it sleeps, or we see that it's sleeping
+    if(atomic_load(&inbox->sleeping) && atomic_exchange(&inbox->sleeping, 0)) {
+        uint64_t val = 1;
+        while(write(inbox->wfd, &val, sizeof(val)) < 0 && errno == EINTR);
+    }
+}
+#else
+int cfib_park_remote()
+{
+    fprintf(stderr, "libcfib: WARNING: cfib_park_remote() requires C11 atomics!\n");
+    return -1;
+}
+
+void cfib_wake_remote(cfib_t* fib)
+{
+    (void)fib;
+    fprintf(stderr, "libcfib: WARNING: cfib_wake_remote() requires C11 atomics!\n");
+}
+#endif
+
+void cfib_sched_run()
+{
+    if(_sched.loop != NULL) {
+        fprintf(stderr, "libcfib: WARNING: cfib_sched_run() is already running in this thread!\n");
+        return;
+    }
+    _sched.loop = cfib_get_current();
+    for(cfib_t* fib = _sched.head; fib != NULL; fib = fib->_next)
+        cfib_set_successor(fib, _sched.loop);
+    cfib_t* next;
+    do {
+        while((next = _ready_pop()) != NULL)
+            cfib_swap(next);
+        // Nothing runnable, wait for events
+    } while(_sched_wait());
+    _sched.loop = NULL;
+}
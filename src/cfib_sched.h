@@ -0,0 +1,233 @@
+#ifndef _CFIB_SCHED_H_
+#define _CFIB_SCHED_H_
+
+/** @file cfib_sched.h
+ *
+ * Optional per-thread co-operative scheduler built on top of cfib_swap().
+ *
+ * Each thread has it's own scheduler, which consists of a ready queue of
+ * runnable fibers, and of the fiber which called cfib_sched_run() (the
+ * "loop" fiber). The ready queue is threaded through the cfib_t structures,
+ * so scheduling never allocates memory.
+ *
+ * When a fiber yields, it is put to the tail of the ready queue and execution
+ * swaps directly into the fiber at the head of the queue. Control returns to
+ * the loop fiber only when there is nothing else to run, or when a fiber
+ * finishes (the loop fiber is the successor of every spawned fiber).
+ *
+ * Example:
+ *
+ * cfib_init_thread();
+ * cfib_spawn(my_func1, my_args1, NULL);
+ * cfib_spawn(my_func2, my_args2, NULL);
+ * cfib_sched_run();
+ */
+
+#include "cfib.h"
+#include "cfib_timer.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** Creates a fiber and makes it runnable in this thread's scheduler.
+ *
+ * Arguments are the same as in cfib_new(). When 'start_routine' returns,
+ * execution swaps into the loop fiber, and the fiber is released as if it
+ * was created with CFIB_AUTO_RECYCLE, so the pointer to it becomes invalid.
+ *
+ * The fiber starts to run when the scheduler gets to it, ie. in
+ * cfib_sched_run() or when another scheduled fiber yields or parks.
+ *
+ * @return pointer to the new fiber, or NULL if memory allocation failed.
+ */
+cfib_t* cfib_spawn(cfib_func start_routine, void* args, const cfib_attr_t* attr);
+
+/** Lets the other runnable fibers run.
+ *
+ * Puts the current fiber to the tail of the ready queue and swaps into the
+ * fiber at the head of the queue. If no other fiber is runnable, returns
+ * immediately. Must be called from a fiber run by cfib_sched_run().
+ */
+void cfib_yield();
+
+/** Suspends the current fiber until cfib_unpark() is called on it.
+ *
+ * Swaps into the next runnable fiber, or back to the loop fiber if there is
+ * none. Before parking, the fiber should store itself somewhere, where
+ * whoever is to wake it up later can find it. Must be called from a fiber
+ * run by cfib_sched_run().
+ */
+void cfib_park();
+
+/** A deadline which never passes.
+ *
+ * The blocking functions of cfib_io.h, cfib_sync.h and cfib_uring.h have
+ * variants ending in _until(), which take a deadline. Passing this makes
+ * them wait without a timeout.
+ */
+#define CFIB_NO_DEADLINE UINT64_MAX
+
+/** Parks the current fiber like cfib_park(), but at most until a deadline.
+ *
+ * The fiber is made runnable by cfib_unpark() or when the deadline passes,
+ * whichever happens first. The timers of the parked fibers are kept in a
+ * per-thread timing wheel (see cfib_timer.h), so arming and cancelling a
+ * timeout is O(1). When nothing is runnable, the scheduler waits for events
+ * at most until the next timer expires.
+ *
+ * @param[in] deadline_ns the deadline, in nanoseconds of cfib_clock_ns(),
+ *                        or CFIB_NO_DEADLINE to park without one.
+ * @return 0 if unparked, -1 if the deadline passed.
+ */
+int cfib_park_until(uint64_t deadline_ns);
+
+/** Parks the current fiber like cfib_park(), but at most for 'timeout_ns' nanoseconds.
+ *
+ * A negative timeout means parking without a timeout.
+ *
+ * @return 0 if unparked, -1 if the timeout expired.
+ */
+int cfib_park_timeout(long timeout_ns);
+
+/** Suspends the current fiber until the time 'deadline_ns' of cfib_clock_ns().
+ *
+ * The other fibers of the thread keep running meanwhile. A cfib_unpark() on
+ * the sleeping fiber does not cut the sleep short.
+ */
+void cfib_sleep_until(uint64_t deadline_ns);
+
+/** Suspends the current fiber for 'ns' nanoseconds.
+ */
+void cfib_sleep_ns(long ns);
+
+/** Makes a parked fiber runnable again.
+ *
+ * Puts the fiber to the tail of the ready queue. The caller keeps running.
+ * Calling this on a fiber which is not parked has no effect.
+ *
+ * @param[in] fib the parked fiber.
+ */
+void cfib_unpark(cfib_t* fib);
+
+/** Makes a parked fiber runnable and switches to it right away.
+ *
+ * Like cfib_unpark(), but instead of putting 'fib' to the tail of the ready
+ * queue, the current fiber is put there and execution swaps directly into
+ * 'fib'. This is useful when the current fiber has just handed something
+ * over to 'fib', which is then likely to find it still in the CPU cache.
+ *
+ * If 'fib' is not parked, this has no effect. If called from the loop fiber,
+ * this works like cfib_unpark().
+ *
+ * @param[in] fib the parked fiber.
+ */
+void cfib_handoff(cfib_t* fib);
+
+/** Runs the scheduled fibers of this thread.
+ *
+ * The calling fiber becomes the loop fiber of this thread's scheduler. This
+ * function returns once there are no runnable fibers left, no event source
+ * (see cfib_sched_source_t) has fibers waiting on it, and no fiber sleeps or
+ * waits for a timeout. Fibers parked by other means do not count as
+ * runnable.
+ */
+void cfib_sched_run();
+
+/** An event source of the scheduler, such as the I/O reactor.
+ *
+ * Event sources let fibers park until some external event happens. When the
+ * ready queue runs empty, the loop fiber waits on the event sources which
+ * have fibers waiting on them, and the sources unpark the fibers whose
+ * events have happened. While there are runnable fibers, the sources are
+ * polled without waiting every now and then, so that a busy thread does not
+ * starve the fibers waiting for events.
+ *
+ * A source is added to a thread's scheduler with cfib_sched_add_source().
+ * The members not prefixed with underscore are set up by the source itself.
+ */
+typedef struct cfib_sched_source {
+    /** A file descriptor which is readable when the source has events.
+     *
+     * If more than one source has waiting fibers, the loop fiber uses this
+     * descriptor to wait on all of them at once.
+     */
+    int fd;
+    /** Number of fibers parked, waiting for an event of this source.
+     */
+    size_t waiting;
+    /** Unparks the fibers whose events have happened.
+     *
+     * If no events have happened yet, waits at most 'timeout_ns' nanoseconds
+     * for them. A negative timeout means waiting forever, and zero means not
+     * waiting at all.
+     *
+     * @return number of fibers unparked, or -1 on error.
+     */
+    int (*poll)(struct cfib_sched_source* source, long timeout_ns);
+    /** Optional, called by the loop fiber right before it blocks on 'fd'.
+     *
+     * Lets a source whose events are produced by other threads know that
+     * this thread is about to sleep, so that they wake it up via 'fd'. After
+     * the wait, 'poll' is called with zero timeout on every source which has
+     * this hook, whether it's descriptor became readable or not.
+     *
+     * @return non-zero if the source already has events, in which case the
+     *         loop fiber polls the sources without blocking.
+     */
+    int (*prepare)(struct cfib_sched_source* source);
+    struct cfib_sched_source* _next;
+} cfib_sched_source_t;
+
+/** Parks the current fiber until cfib_wake_remote() is called on it.
+ *
+ * The fiber must have been created with cfib_spawn() in this thread. If the
+ * fiber was woken up with cfib_wake_remote() after it last returned from
+ * this function, returns immediately, so a wakeup sent before the fiber
+ * gets to park is not lost. Meanwhile the fiber counts as waiting for an
+ * event, ie. cfib_sched_run() does not return.
+ *
+ * Remote wakeups require C11 atomics; without them this function always
+ * fails.
+ *
+ * @return 0 when woken up, -1 if the wakeup mechanism could not be set up.
+ */
+int cfib_park_remote();
+
+/** Wakes up a fiber from any thread.
+ *
+ * 'fib' is pushed to a lock-free inbox of the scheduler which it belongs
+ * to, and the owning thread makes it runnable in a batch with any other
+ * fibers in the inbox. The owning thread is signalled via an eventfd (a
+ * pipe where eventfd is not available) only if it is sleeping, waiting for
+ * events. Several wakeups sent before the fiber runs coalesce into one.
+ *
+ * A wakeup which arrives after the fiber finished is ignored. The fiber's
+ * cfib_t is reused by the next cfib_spawn() of the owning thread though, so
+ * the caller must make sure that 'fib' has not been reused, e.g. by waking
+ * it up only while the fiber is known to be running or parked.
+ *
+ * The thread which owns 'fib' must not exit before the wakeup is handled.
+ *
+ * @param[in] fib a fiber created with cfib_spawn(), which uses
+ *                cfib_park_remote() to wait.
+ */
+void cfib_wake_remote(cfib_t* fib);
+
+/** Adds an event source to this thread's scheduler.
+ *
+ * @param[in] source the event source, which must outlive it's registration.
+ */
+void cfib_sched_add_source(cfib_sched_source_t* source);
+
+/** Removes an event source from this thread's scheduler.
+ *
+ * @param[in] source a source added with cfib_sched_add_source().
+ */
+void cfib_sched_remove_source(cfib_sched_source_t* source);
+
+#ifdef __cplusplus
+} /* extern "C" { */
+#endif
+
+#endif /* _CFIB_SCHED_H_ */
@@ -0,0 +1,445 @@
+#include "cfib_sync.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+// Wait nodes on the stack are always unlinked before the waiting function
+// returns, which GCC can not see.
+#if defined(__GNUC__) && !defined(__clang__) && __GNUC__ >= 12
+#pragma GCC diagnostic ignored "-Wdangling-pointer"
+#endif
+
+/* Waiting
+ *
+ * A waiting fiber puts a _cfib_wait node on the wait list of the primitive,
+ * and parks until the node "fires". The node lives on the waiting fiber's
+ * stack. In cfib_chan_select() a fiber waits on several lists at once, with
+ * one node per list, and all the nodes share one _cfib_sel. The first waker
+ * to claim one of the nodes fires the whole select, and the other nodes are
+ * skipped by wakers until the fiber removes them after waking up.
+ */
+struct _cfib_sel {
+    cfib_t* fib;
+    // Index of the node which fired, -1 while waiting
+    int fired;
+    // Result of the operation, set by the waker
+    int result;
+};
+
+struct _cfib_wait {
+    struct _cfib_wait* prev;
+    struct _cfib_wait* next;
+    // The list this node is in, NULL if none
+    struct _cfib_waitq* q;
+    struct _cfib_sel* sel;
+    // Channel element to send or to receive into
+    void* elem;
+    int index;
+};
+
+static void _waitq_push(struct _cfib_waitq* q, struct _cfib_wait* w)
+{
+    w->q = q;
+    w->next = NULL;
+    w->prev = q->tail;
+    if(q->tail != NULL)
+        q->tail->next = w;
+    else
+        q->head = w;
+    q->tail = w;
+}
+
+static void _waitq_remove(struct _cfib_wait* w)
+{
+    struct _cfib_waitq* q = w->q;
+    if(q == NULL)
+        return;
+    if(w->prev != NULL)
+        w->prev->next = w->next;
+    else
+        q->head = w->next;
+    if(w->next != NULL)
+        w->next->prev = w->prev;
+    else
+        q->tail = w->prev;
+    w->q = NULL;
+}
+
+// @internal Removes and fires the longest waiting node which has not fired
+// yet, and returns it. Returns NULL if there is none.
+static struct _cfib_wait* _waitq_claim(struct _cfib_waitq* q)
+{
+    struct _cfib_wait* w;
+    while((w = q->head) != NULL) {
+        _waitq_remove(w);
+        if(w->sel->fired < 0) {
+            w->sel->fired = w->index;
+            return w;
+        }
+    }
+    return NULL;
+}
+
+// @internal Parks until a waker fires 'sel'. The waker may fire it before
+// we get to park, eg. while we are in the ready queue, so check first.
+// Returns -1 with errno set to ETIMEDOUT if the deadline passed first, in
+// which case the caller must remove it's nodes from the lists.
+static int _wait_park(struct _cfib_sel* sel, uint64_t deadline_ns)
+{
+    while(sel->fired < 0) {
+        // A waker may fire it between the expiry and our return
+        if(cfib_park_until(deadline_ns) < 0 && sel->fired < 0) {
+            errno = ETIMEDOUT;
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// @internal Waits on a single list, returns the result set by the waker, or
+// -1 if the deadline passed.
+static int _wait(struct _cfib_waitq* q, void* elem, uint64_t deadline_ns)
+{
+    struct _cfib_sel sel = {.fib = cfib_get_current(), .fired = -1, .result = 0};
+    struct _cfib_wait w = {.sel = &sel, .elem = elem, .index = 0};
+    _waitq_push(q, &w);
+    if(_wait_park(&sel, deadline_ns) < 0) {
+        _waitq_remove(&w);
+        return -1;
+    }
+    return sel.result;
+}
+
+/* Mutex */
+
+void cfib_mutex_init(cfib_mutex_t* mutex)
+{
+    *mutex = (cfib_mutex_t)CFIB_MUTEX_INIT;
+}
+
+void cfib_mutex_lock(cfib_mutex_t* mutex)
+{
+    cfib_mutex_lock_until(mutex, CFIB_NO_DEADLINE);
+}
+
+int cfib_mutex_lock_until(cfib_mutex_t* mutex, uint64_t deadline_ns)
+{
+    if(!mutex->locked) {
+        mutex->locked = 1;
+        return 0;
+    }
+    // The unlocker hands the lock over to us, it stays locked
+    return _wait(&mutex->waiters, NULL, deadline_ns);
+}
+
+int cfib_mutex_trylock(cfib_mutex_t* mutex)
+{
+    if(mutex->locked)
+        return -1;
+    mutex->locked = 1;
+    return 0;
+}
+
+void cfib_mutex_unlock(cfib_mutex_t* mutex)
+{
+    struct _cfib_wait* w = _waitq_claim(&mutex->waiters);
+    if(w == NULL)
+        mutex->locked = 0;
+    else
+        cfib_handoff(w->sel->fib);
+}
+
+/* Condition variable */
+
+void cfib_cond_init(cfib_cond_t* cond)
+{
+    *cond = (cfib_cond_t)CFIB_COND_INIT;
+}
+
+void cfib_cond_wait(cfib_cond_t* cond, cfib_mutex_t* mutex)
+{
+    cfib_cond_wait_until(cond, mutex, CFIB_NO_DEADLINE);
+}
+
+int cfib_cond_wait_until(cfib_cond_t* cond, cfib_mutex_t* mutex, uint64_t deadline_ns)
+{
+    struct _cfib_sel sel = {.fib = cfib_get_current(), .fired = -1, .result = 0};
+    struct _cfib_wait w = {.sel = &sel, .elem = NULL, .index = 0};
+    _waitq_push(&cond->waiters, &w);
+    cfib_mutex_unlock(mutex);
+    int res = _wait_park(&sel, deadline_ns);
+    if(res < 0)
+        _waitq_remove(&w);
+    // Like pthread_cond_timedwait(), the mutex is locked again even on
+    // timeout, without a deadline
+    cfib_mutex_lock(mutex);
+    if(res < 0)
+        errno = ETIMEDOUT;
+    return res;
+}
+
+void cfib_cond_signal(cfib_cond_t* cond)
+{
+    struct _cfib_wait* w = _waitq_claim(&cond->waiters);
+    if(w != NULL)
+        cfib_unpark(w->sel->fib);
+}
+
+void cfib_cond_broadcast(cfib_cond_t* cond)
+{
+    struct _cfib_wait* w;
+    while((w = _waitq_claim(&cond->waiters)) != NULL)
+        cfib_unpark(w->sel->fib);
+}
+
+/* Semaphore */
+
+void cfib_sem_init(cfib_sem_t* sem, long value)
+{
+    *sem = (cfib_sem_t)CFIB_SEM_INIT(value);
+}
+
+void cfib_sem_wait(cfib_sem_t* sem)
+{
+    cfib_sem_wait_until(sem, CFIB_NO_DEADLINE);
+}
+
+int cfib_sem_wait_until(cfib_sem_t* sem, uint64_t deadline_ns)
+{
+    if(sem->count > 0) {
+        sem->count--;
+        return 0;
+    }
+    // The poster hands it's unit over to us without touching the count
+    return _wait(&sem->waiters, NULL, deadline_ns);
+}
+
+int cfib_sem_trywait(cfib_sem_t* sem)
+{
+    if(sem->count <= 0)
+        return -1;
+    sem->count--;
+    return 0;
+}
+
+void cfib_sem_post(cfib_sem_t* sem)
+{
+    struct _cfib_wait* w = _waitq_claim(&sem->waiters);
+    if(w == NULL)
+        sem->count++;
+    else
+        cfib_handoff(w->sel->fib);
+}
+
+/* Channel */
+
+#define _CHAN_INITIAL_SLOTS 16
+
+struct cfib_chan {
+    size_t elem_size;
+    size_t capacity;
+    // Circular buffer of 'slots' elements, 'count' of them used from 'head'
+    unsigned char* buf;
+    size_t slots;
+    size_t head;
+    size_t count;
+    int closed;
+    struct _cfib_waitq recvq;
+    struct _cfib_waitq sendq;
+};
+
+cfib_chan_t* cfib_chan_new(size_t elem_size, size_t capacity)
+{
+    if(capacity == 0)
+        capacity = 1;
+    cfib_chan_t* chan = calloc(1, sizeof(cfib_chan_t));
+    if(chan == NULL)
+        return NULL;
+    chan->elem_size = elem_size;
+    chan->capacity = capacity;
+    chan->slots = capacity == CFIB_CHAN_UNBOUNDED ? _CHAN_INITIAL_SLOTS : capacity;
+    chan->buf = malloc(chan->slots * elem_size);
+    if(chan->buf == NULL) {
+        free(chan);
+        return NULL;
+    }
+    return chan;
+}
+
+void cfib_chan_free(cfib_chan_t* chan)
+{
+    if(chan == NULL)
+        return;
+    assert("cfib_chan_free() called on a channel with waiting fibers !!!" && chan->recvq.head == NULL && chan->sendq.head == NULL);
+    free(chan->buf);
+    free(chan);
+}
+
+static inline unsigned char* _chan_slot(cfib_chan_t* chan, size_t i)
+{
+    return chan->buf + ((chan->head + i) % chan->slots) * chan->elem_size;
+}
+
+// @internal Appends to the buffer, which must have room for it, or be
+// unbounded. Returns -1 if growing an unbounded buffer failed.
+static int _chan_buf_push(cfib_chan_t* chan, const void* elem)
+{
+    if(chan->count == chan->slots) {
+        size_t slots = chan->slots * 2;
+        unsigned char* buf = malloc(slots * chan->elem_size);
+        if(buf == NULL)
+            return -1;
+        for(size_t i = 0; i < chan->count; i++)
+            memcpy(buf + i * chan->elem_size, _chan_slot(chan, i), chan->elem_size);
+        free(chan->buf);
+        chan->buf = buf;
+        chan->slots = slots;
+        chan->head = 0;
+    }
+    memcpy(_chan_slot(chan, chan->count), elem, chan->elem_size);
+    chan->count++;
+    return 0;
+}
+
+static void _chan_buf_pop(cfib_chan_t* chan, void* elem)
+{
+    memcpy(elem, _chan_slot(chan, 0), chan->elem_size);
+    chan->head = (chan->head + 1) % chan->slots;
+    chan->count--;
+}
+
+// @internal Sends if it can be done without blocking. Returns 1 and sets
+// 'result' if the send completed, 0 if it would block.
+static int _chan_try_send(cfib_chan_t* chan, const void* elem, int* result)
+{
+    if(chan->closed) {
+        *result = -1;
+        return 1;
+    }
+    // A receiver waits only if the buffer is empty, so give it directly
+    struct _cfib_wait* w = _waitq_claim(&chan->recvq);
+    if(w != NULL) {
+        memcpy(w->elem, elem, chan->elem_size);
+        w->sel->result = 0;
+        *result = 0;
+        cfib_handoff(w->sel->fib);
+        return 1;
+    }
+    if(chan->count < chan->capacity) {
+        *result = _chan_buf_push(chan, elem);
+        return 1;
+    }
+    return 0;
+}
+
+// @internal Receives if it can be done without blocking. Returns 1 and sets
+// 'result' if the receive completed, 0 if it would block.
+static int _chan_try_recv(cfib_chan_t* chan, void* elem, int* result)
+{
+    if(chan->count > 0) {
+        _chan_buf_pop(chan, elem);
+        // A sender waits only if the buffer is full, and now it has room
+        struct _cfib_wait* w = _waitq_claim(&chan->sendq);
+        if(w != NULL) {
+            w->sel->result = _chan_buf_push(chan, w->elem);
+            cfib_unpark(w->sel->fib);
+        }
+        *result = 0;
+        return 1;
+    }
+    if(chan->closed) {
+        *result = -1;
+        return 1;
+    }
+    return 0;
+}
+
+void cfib_chan_close(cfib_chan_t* chan)
+{
+    chan->closed = 1;
+    struct _cfib_wait* w;
+    while((w = _waitq_claim(&chan->recvq)) != NULL) {
+        w->sel->result = -1;
+        cfib_unpark(w->sel->fib);
+    }
+    while((w = _waitq_claim(&chan->sendq)) != NULL) {
+        w->sel->result = -1;
+        cfib_unpark(w->sel->fib);
+    }
+}
+
+int cfib_chan_send(cfib_chan_t* chan, const void* elem)
+{
+    return cfib_chan_send_until(chan, elem, CFIB_NO_DEADLINE);
+}
+
+int cfib_chan_send_until(cfib_chan_t* chan, const void* elem, uint64_t deadline_ns)
+{
+    int result;
+    if(_chan_try_send(chan, elem, &result))
+        return result;
+    return _wait(&chan->sendq, (void*)elem, deadline_ns);
+}
+
+int cfib_chan_recv(cfib_chan_t* chan, void* elem)
+{
+    return cfib_chan_recv_until(chan, elem, CFIB_NO_DEADLINE);
+}
+
+int cfib_chan_recv_until(cfib_chan_t* chan, void* elem, uint64_t deadline_ns)
+{
+    int result;
+    if(_chan_try_recv(chan, elem, &result))
+        return result;
+    return _wait(&chan->recvq, elem, deadline_ns);
+}
+
+static _Thread_local unsigned _select_rotation = 0;
+
+// @internal Implements cfib_chan_select() and cfib_chan_select_until().
+static int _chan_select(cfib_select_case_t* cases, size_t n, int block, uint64_t deadline_ns)
+{
+    assert("Too many cases for cfib_chan_select() !!!" && n <= CFIB_SELECT_MAX);
+    if(n == 0)
+        return -1;
+    size_t start = _select_rotation++ % n;
+    for(size_t k = 0; k < n; k++) {
+        size_t i = (start + k) % n;
+        int done = cases[i].op == CFIB_SELECT_SEND
+            ? _chan_try_send(cases[i].chan, cases[i].elem, &cases[i].result)
+            : _chan_try_recv(cases[i].chan, cases[i].elem, &cases[i].result);
+        if(done)
+            return (int)i;
+    }
+    if(!block)
+        return -1;
+    struct _cfib_sel sel = {.fib = cfib_get_current(), .fired = -1, .result = 0};
+    struct _cfib_wait nodes[CFIB_SELECT_MAX];
+    for(size_t i = 0; i < n; i++) {
+        nodes[i].sel = &sel;
+        nodes[i].elem = cases[i].elem;
+        nodes[i].index = (int)i;
+        if(cases[i].op == CFIB_SELECT_SEND)
+            _waitq_push(&cases[i].chan->sendq, &nodes[i]);
+        else
+            _waitq_push(&cases[i].chan->recvq, &nodes[i]);
+    }
+    int res = _wait_park(&sel, deadline_ns);
+    for(size_t i = 0; i < n; i++)
+        _waitq_remove(&nodes[i]);
+    if(res < 0)
+        return -1;
+    cases[sel.fired].result = sel.result;
+    return sel.fired;
+}
+
+int cfib_chan_select(cfib_select_case_t* cases, size_t n, int block)
+{
+    return _chan_select(cases, n, block, CFIB_NO_DEADLINE);
+}
+
+int cfib_chan_select_until(cfib_select_case_t* cases, size_t n, uint64_t deadline_ns)
+{
+    return _chan_select(cases, n, 1, deadline_ns);
+}
@@ -0,0 +1,203 @@
+#ifndef _CFIB_SYNC_H_
+#define _CFIB_SYNC_H_
+
+/** @file cfib_sync.h
+ *
+ * Fiber-aware synchronization primitives for the per-thread scheduler (see
+ * cfib_sched.h).
+ *
+ * Blocking on these primitives parks only the calling fiber, never the
+ * thread. A waiting fiber is put on a wait list of the primitive, and the
+ * list node lives on the waiting fiber's own stack, so waiting never
+ * allocates memory. When a primitive is released to a waiter (mutex unlock,
+ * semaphore post, channel send to a waiting receiver), ownership or data is
+ * handed over directly, and execution switches straight into the woken
+ * fiber with cfib_handoff().
+ *
+ * The primitives synchronize fibers of one thread only. Blocking functions
+ * must be called from fibers run by cfib_sched_run().
+ *
+ * Each blocking function has a variant ending in _until(), which waits at
+ * most until a deadline, in nanoseconds of cfib_clock_ns(). If the deadline
+ * passes first, the fiber's node is unlinked from the wait list, so it is
+ * never handed anything after that, and the call returns -1 with errno set
+ * to ETIMEDOUT.
+ */
+
+#include "cfib_sched.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct _cfib_wait;
+
+struct _cfib_waitq {
+    struct _cfib_wait* head;
+    struct _cfib_wait* tail;
+};
+
+#define _CFIB_WAITQ_INIT {NULL, NULL}
+
+/** A mutual exclusion lock for fibers.
+ *
+ * Initialize with CFIB_MUTEX_INIT or cfib_mutex_init(). The lock is fair:
+ * when unlocked, it is handed over to the fiber which has waited longest.
+ */
+typedef struct {
+    int locked;
+    struct _cfib_waitq waiters;
+} cfib_mutex_t;
+
+#define CFIB_MUTEX_INIT {0, _CFIB_WAITQ_INIT}
+
+void cfib_mutex_init(cfib_mutex_t* mutex);
+void cfib_mutex_lock(cfib_mutex_t* mutex);
+/** @return 0 if the lock was taken, -1 if the deadline passed. */
+int cfib_mutex_lock_until(cfib_mutex_t* mutex, uint64_t deadline_ns);
+/** @return 0 if the lock was taken, -1 if it is held by another fiber. */
+int cfib_mutex_trylock(cfib_mutex_t* mutex);
+void cfib_mutex_unlock(cfib_mutex_t* mutex);
+
+/** A condition variable for fibers.
+ *
+ * Initialize with CFIB_COND_INIT or cfib_cond_init().
+ */
+typedef struct {
+    struct _cfib_waitq waiters;
+} cfib_cond_t;
+
+#define CFIB_COND_INIT {_CFIB_WAITQ_INIT}
+
+void cfib_cond_init(cfib_cond_t* cond);
+/** Unlocks 'mutex', waits for a signal and locks 'mutex' again. */
+void cfib_cond_wait(cfib_cond_t* cond, cfib_mutex_t* mutex);
+/** Like cfib_cond_wait(), but at most until a deadline.
+ *
+ * 'mutex' is locked again also when the deadline passes.
+ *
+ * @return 0 if signalled, -1 if the deadline passed.
+ */
+int cfib_cond_wait_until(cfib_cond_t* cond, cfib_mutex_t* mutex, uint64_t deadline_ns);
+/** Wakes the fiber which has waited longest, if any. */
+void cfib_cond_signal(cfib_cond_t* cond);
+/** Wakes all waiting fibers. */
+void cfib_cond_broadcast(cfib_cond_t* cond);
+
+/** A counting semaphore for fibers.
+ *
+ * Initialize with CFIB_SEM_INIT(value) or cfib_sem_init().
+ */
+typedef struct {
+    long count;
+    struct _cfib_waitq waiters;
+} cfib_sem_t;
+
+#define CFIB_SEM_INIT(value) {(value), _CFIB_WAITQ_INIT}
+
+void cfib_sem_init(cfib_sem_t* sem, long value);
+void cfib_sem_wait(cfib_sem_t* sem);
+/** @return 0 if the count was decremented, -1 if the deadline passed. */
+int cfib_sem_wait_until(cfib_sem_t* sem, uint64_t deadline_ns);
+/** @return 0 if the count was decremented, -1 if it was zero. */
+int cfib_sem_trywait(cfib_sem_t* sem);
+void cfib_sem_post(cfib_sem_t* sem);
+
+/** A channel passing fixed size elements between fibers.
+ *
+ * Elements are copied in and out of the channel by value. A bounded channel
+ * holds at most 'capacity' elements, after which senders block until
+ * receivers make room. An unbounded channel never blocks senders.
+ */
+typedef struct cfib_chan cfib_chan_t;
+
+/** Capacity of an unbounded channel. */
+#define CFIB_CHAN_UNBOUNDED ((size_t)-1)
+
+/** Creates a channel.
+ *
+ * @param[in] elem_size size of one element in bytes.
+ * @param[in] capacity max number of buffered elements (at least 1), or CFIB_CHAN_UNBOUNDED.
+ * @return the new channel, or NULL if memory allocation failed.
+ */
+cfib_chan_t* cfib_chan_new(size_t elem_size, size_t capacity);
+
+/** Frees a channel. No fiber may be waiting on it. */
+void cfib_chan_free(cfib_chan_t* chan);
+
+/** Closes a channel.
+ *
+ * Waiting senders fail, and receivers get the buffered elements, after
+ * which they fail. Sending to a closed channel fails.
+ */
+void cfib_chan_close(cfib_chan_t* chan);
+
+/** Sends an element, blocking while a bounded channel is full.
+ *
+ * @return 0 on success, -1 if the channel is closed.
+ */
+int cfib_chan_send(cfib_chan_t* chan, const void* elem);
+
+/** Sends like cfib_chan_send(), but at most until a deadline.
+ *
+ * @return 0 on success, -1 if the channel is closed, or -1 with errno set
+ *         to ETIMEDOUT if the deadline passed.
+ */
+int cfib_chan_send_until(cfib_chan_t* chan, const void* elem, uint64_t deadline_ns);
+
+/** Receives an element, blocking while the channel is empty.
+ *
+ * @return 0 on success, -1 if the channel is closed and empty.
+ */
+int cfib_chan_recv(cfib_chan_t* chan, void* elem);
+
+/** Receives like cfib_chan_recv(), but at most until a deadline.
+ *
+ * @return 0 on success, -1 if the channel is closed and empty, or -1 with
+ *         errno set to ETIMEDOUT if the deadline passed.
+ */
+int cfib_chan_recv_until(cfib_chan_t* chan, void* elem, uint64_t deadline_ns);
+
+#define CFIB_SELECT_SEND 0
+#define CFIB_SELECT_RECV 1
+
+/** Max number of cases in one cfib_chan_select(). */
+#define CFIB_SELECT_MAX 32
+
+/** One case of cfib_chan_select().
+ */
+typedef struct {
+    /** The channel. */
+    cfib_chan_t* chan;
+    /** CFIB_SELECT_SEND or CFIB_SELECT_RECV. */
+    int op;
+    /** The element to send, or the buffer to receive into. */
+    void* elem;
+    /** Set to 0 if the operation succeeded, -1 if the channel was closed. */
+    int result;
+} cfib_select_case_t;
+
+/** Waits until one of several channel operations can complete, and does it.
+ *
+ * Exactly one of the cases is completed. If several are ready, they are
+ * tried in a rotating order so that none of them starves.
+ *
+ * @param[in,out] cases array of 'n' cases, at most CFIB_SELECT_MAX.
+ * @param[in] n number of cases.
+ * @param[in] block if zero, returns -1 instead of waiting.
+ * @return the index of the completed case, or -1.
+ */
+int cfib_chan_select(cfib_select_case_t* cases, size_t n, int block);
+
+/** Waits like a blocking cfib_chan_select(), but at most until a deadline.
+ *
+ * @return the index of the completed case, or -1 with errno set to
+ *         ETIMEDOUT if the deadline passed.
+ */
+int cfib_chan_select_until(cfib_select_case_t* cases, size_t n, uint64_t deadline_ns);
+
+#ifdef __cplusplus
+} /* extern "C" { */
+#endif
+
+#endif /* _CFIB_SYNC_H_ */
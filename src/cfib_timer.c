@@ -0,0 +1,179 @@
+#include "cfib_timer.h"
+
+#include <time.h>
+
+#define _SLOT_BITS 6
+#define _SLOT_MASK (CFIB_WHEEL_SLOTS - 1)
+// The largest tick reachable from 'now' without crossing the top level
+#define _MAX_TICKS ((UINT64_C(1) << (_SLOT_BITS * CFIB_WHEEL_LEVELS)) - 1)
+
+uint64_t cfib_clock_ns()
+{
+    struct timespec tp;
+    clock_gettime(CLOCK_MONOTONIC, &tp);
+    return (uint64_t)tp.tv_sec * 1000000000 + (uint64_t)tp.tv_nsec;
+}
+
+void cfib_wheel_init(cfib_wheel_t* wheel, uint64_t now_ns)
+{
+    wheel->_now = now_ns >> CFIB_TIMER_TICK_SHIFT;
+    wheel->count = 0;
+    for(unsigned l = 0; l < CFIB_WHEEL_LEVELS; l++)
+        wheel->_occupied[l] = 0;
+    for(unsigned i = 0; i < CFIB_WHEEL_LEVELS * CFIB_WHEEL_SLOTS; i++)
+        wheel->_slots[i] = NULL;
+}
+
+// @internal Links the timer to the slot of it's deadline. The level is
+// chosen by the highest bit in which the deadline differs from the current
+// time, so the timer is always in a slot which time has not reached yet.
+static inline void _wheel_insert(cfib_wheel_t* wheel, cfib_timer_t* timer)
+{
+    uint64_t diff = timer->_expires ^ wheel->_now;
+    unsigned level = diff == 0 ? 0 : (unsigned)(63 - __builtin_clzll(diff)) / _SLOT_BITS;
+    unsigned slot = (unsigned)(timer->_expires >> (level * _SLOT_BITS)) & _SLOT_MASK;
+    unsigned i = level * CFIB_WHEEL_SLOTS + slot;
+    timer->_slot = i;
+    timer->_next = wheel->_slots[i];
+    if(timer->_next != NULL)
+        timer->_next->_pprev = &timer->_next;
+    timer->_pprev = &wheel->_slots[i];
+    wheel->_slots[i] = timer;
+    wheel->_occupied[level] |= UINT64_C(1) << slot;
+}
+
+static inline void _wheel_unlink(cfib_wheel_t* wheel, cfib_timer_t* timer)
+{
+    *timer->_pprev = timer->_next;
+    if(timer->_next != NULL)
+        timer->_next->_pprev = timer->_pprev;
+    timer->_pprev = NULL;
+    timer->_next = NULL;
+    if(wheel->_slots[timer->_slot] == NULL)
+        wheel->_occupied[timer->_slot / CFIB_WHEEL_SLOTS] &= ~(UINT64_C(1) << (timer->_slot & _SLOT_MASK));
+}
+
+// @internal Moves the timers of slot 'i' to a list of their own, so that
+// they can be processed while new timers are added to the slot.
+static inline void _wheel_detach(cfib_wheel_t* wheel, unsigned i, cfib_timer_t** list)
+{
+    *list = wheel->_slots[i];
+    if(*list != NULL)
+        (*list)->_pprev = list;
+    wheel->_slots[i] = NULL;
+    wheel->_occupied[i / CFIB_WHEEL_SLOTS] &= ~(UINT64_C(1) << (i & _SLOT_MASK));
+}
+
+void cfib_wheel_add(cfib_wheel_t* wheel, cfib_timer_t* timer, uint64_t deadline_ns)
+{
+    uint64_t expires;
+    // Rounding up would wrap around, and expire right away
+    if(deadline_ns > UINT64_MAX - (CFIB_TIMER_TICK_NS - 1))
+        expires = wheel->_now | _MAX_TICKS;
+    else
+        // Round up, so that the timer never expires early
+        expires = (deadline_ns + CFIB_TIMER_TICK_NS - 1) >> CFIB_TIMER_TICK_SHIFT;
+    if(expires < wheel->_now)
+        expires = wheel->_now;
+    if(expires > (wheel->_now | _MAX_TICKS))
+        expires = wheel->_now | _MAX_TICKS;
+    timer->_expires = expires;
+    _wheel_insert(wheel, timer);
+    wheel->count++;
+}
+
+void cfib_wheel_cancel(cfib_wheel_t* wheel, cfib_timer_t* timer)
+{
+    if(timer->_pprev == NULL)
+        return;
+    _wheel_unlink(wheel, timer);
+    wheel->count--;
+}
+
+// @internal Returns the next tick at which something happens in the wheel,
+// a level 0 slot expires or a higher level slot is cascaded.
+static uint64_t _wheel_next_tick(const cfib_wheel_t* wheel)
+{
+    uint64_t next = UINT64_MAX;
+    for(unsigned l = 0; l < CFIB_WHEEL_LEVELS; l++) {
+        if(wheel->_occupied[l] == 0)
+            continue;
+        unsigned shift = l * _SLOT_BITS;
+        uint64_t slot = (uint64_t)__builtin_ctzll(wheel->_occupied[l]);
+        uint64_t base = (wheel->_now >> (shift + _SLOT_BITS)) << (shift + _SLOT_BITS);
+        uint64_t tick = base | (slot << shift);
+        if(tick < next)
+            next = tick;
+    }
+    return next;
+}
+
+uint64_t cfib_wheel_next(const cfib_wheel_t* wheel)
+{
+    uint64_t tick = _wheel_next_tick(wheel);
+    return tick == UINT64_MAX ? UINT64_MAX : tick << CFIB_TIMER_TICK_SHIFT;
+}
+
+// @internal Cascades the higher level slots which begin at the current time.
+static void _wheel_cascade(cfib_wheel_t* wheel)
+{
+    for(unsigned l = CFIB_WHEEL_LEVELS - 1; l > 0; l--) {
+        unsigned shift = l * _SLOT_BITS;
+        if((wheel->_now & ((UINT64_C(1) << shift) - 1)) != 0)
+            continue;
+        unsigned slot = (unsigned)(wheel->_now >> shift) & _SLOT_MASK;
+        if(!(wheel->_occupied[l] & (UINT64_C(1) << slot)))
+            continue;
+        cfib_timer_t* list;
+        _wheel_detach(wheel, l * CFIB_WHEEL_SLOTS + slot, &list);
+        while(list != NULL) {
+            cfib_timer_t* timer = list;
+            list = timer->_next;
+            _wheel_insert(wheel, timer);
+        }
+    }
+}
+
+// @internal Expires the timers of the current level 0 slot.
+static size_t _wheel_fire(cfib_wheel_t* wheel)
+{
+    unsigned i = (unsigned)wheel->_now & _SLOT_MASK;
+    if(wheel->_slots[i] == NULL)
+        return 0;
+    // The functions may arm and cancel timers, even the ones in 'list'
+    cfib_timer_t* list;
+    _wheel_detach(wheel, i, &list);
+    size_t fired = 0;
+    while(list != NULL) {
+        cfib_timer_t* timer = list;
+        _wheel_unlink(wheel, timer);
+        wheel->count--;
+        timer->func(timer);
+        fired++;
+    }
+    return fired;
+}
+
+size_t cfib_wheel_advance(cfib_wheel_t* wheel, uint64_t now_ns)
+{
+    uint64_t target = now_ns >> CFIB_TIMER_TICK_SHIFT;
+    size_t fired = 0;
+    for(;;) {
+        fired += _wheel_fire(wheel);
+        if(wheel->_now >= target)
+            break;
+        uint64_t next = _wheel_next_tick(wheel);
+        if(next > target) {
+            // Nothing happens until then, skip over the empty ticks
+            wheel->_now = target;
+            break;
+        }
+        if(next <= wheel->_now) {
+            // Timers armed for the current tick by the expired ones
+            break;
+        }
+        wheel->_now = next;
+        _wheel_cascade(wheel);
+    }
+    return fired;
+}
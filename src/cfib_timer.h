@@ -0,0 +1,127 @@
+#ifndef _CFIB_TIMER_H_
+#define _CFIB_TIMER_H_
+
+/** @file cfib_timer.h
+ *
+ * Hierarchical timing wheel.
+ *
+ * The per-thread scheduler (see cfib_sched.h) keeps it's sleeping and
+ * timed-out fibers in a wheel of this module, but a wheel can be used on
+ * it's own as well.
+ *
+ * Time is counted in ticks of CFIB_TIMER_TICK_NS nanoseconds. The wheel has
+ * CFIB_WHEEL_LEVELS levels of 64 slots. Level 0 holds the timers which
+ * expire within the current 64 ticks, one slot per tick, level 1 those
+ * which expire within the current 64 * 64 ticks, 64 ticks per slot, and so
+ * on. When time reaches a slot of a higher level, it's timers are moved
+ * ("cascaded") down to the lower levels. Each level has a bitmap of it's
+ * non-empty slots, so the next expiry is found without scanning the slots.
+ *
+ * Arming and cancelling a timer are O(1), and every timer is cascaded at
+ * most CFIB_WHEEL_LEVELS - 1 times during it's lifetime. Timers never
+ * expire early, but they may expire up to one tick late.
+ *
+ * A wheel, and the timers armed in it, must be accessed by one thread only.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** Length of one tick of the wheel, in nanoseconds (2^10). */
+#define CFIB_TIMER_TICK_SHIFT 10
+#define CFIB_TIMER_TICK_NS (1L << CFIB_TIMER_TICK_SHIFT)
+
+/** Number of levels in a wheel.
+ *
+ * 8 levels of 64 slots cover 2^48 ticks, ie. more than 9 years. Timers
+ * further in the future are clamped to that.
+ */
+#define CFIB_WHEEL_LEVELS 8
+#define CFIB_WHEEL_SLOTS 64
+
+/** A timer, which calls a function when it expires.
+ *
+ * Set 'func' (and usually embed the timer in a struct of your own, to pass
+ * data to the function) before arming the timer with cfib_wheel_add().
+ */
+typedef struct cfib_timer {
+    /** Called from cfib_wheel_advance() when the timer expires.
+     *
+     * The timer is no longer armed when this is called, so it may be
+     * armed again or freed.
+     */
+    void (*func)(struct cfib_timer* timer);
+    /** The absolute deadline in ticks. */
+    uint64_t _expires;
+    /** Links in a slot of the wheel, _pprev is NULL when not armed. */
+    struct cfib_timer* _next;
+    struct cfib_timer** _pprev;
+    /** Index of the slot, level * CFIB_WHEEL_SLOTS + slot. */
+    unsigned _slot;
+} cfib_timer_t;
+
+/** A hierarchical timing wheel. Initialize with cfib_wheel_init().
+ */
+typedef struct cfib_wheel {
+    /** The current time in ticks. */
+    uint64_t _now;
+    /** Number of armed timers. */
+    size_t count;
+    /** Bitmap of non-empty slots on each level. */
+    uint64_t _occupied[CFIB_WHEEL_LEVELS];
+    cfib_timer_t* _slots[CFIB_WHEEL_LEVELS * CFIB_WHEEL_SLOTS];
+} cfib_wheel_t;
+
+/** Returns the time of CLOCK_MONOTONIC in nanoseconds.
+ */
+uint64_t cfib_clock_ns();
+
+/** Initializes an empty wheel.
+ *
+ * @param[in] now_ns the current time, usually cfib_clock_ns().
+ */
+void cfib_wheel_init(cfib_wheel_t* wheel, uint64_t now_ns);
+
+/** Arms a timer to expire at 'deadline_ns'.
+ *
+ * A deadline in the past makes the timer expire on the next call to
+ * cfib_wheel_advance(). The timer must not be armed already.
+ */
+void cfib_wheel_add(cfib_wheel_t* wheel, cfib_timer_t* timer, uint64_t deadline_ns);
+
+/** Disarms a timer. Does nothing if the timer is not armed.
+ */
+void cfib_wheel_cancel(cfib_wheel_t* wheel, cfib_timer_t* timer);
+
+/** Tells if a timer is armed.
+ */
+static inline int cfib_timer_armed(const cfib_timer_t* timer)
+{
+    return timer->_pprev != NULL;
+}
+
+/** Advances the wheel to 'now_ns', and calls the functions of the expired timers.
+ *
+ * @return number of expired timers.
+ */
+size_t cfib_wheel_advance(cfib_wheel_t* wheel, uint64_t now_ns);
+
+/** Returns the time when the wheel next needs to be advanced.
+ *
+ * This is never later than the earliest deadline of the armed timers, but
+ * it may be earlier, since the wheel also needs to be advanced to cascade
+ * it's timers to the lower levels.
+ *
+ * @return the time in nanoseconds, or UINT64_MAX if no timers are armed.
+ */
+uint64_t cfib_wheel_next(const cfib_wheel_t* wheel);
+
+#ifdef __cplusplus
+} /* extern "C" { */
+#endif
+
+#endif /* _CFIB_TIMER_H_ */
@@ -0,0 +1,432 @@
+// accept4() is a GNU extension
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include "cfib_uring.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+
+#ifdef _WITH_C11_ATOMICS
+#include <stdatomic.h>
+#else
+#error "Compiler does not support C11 _Atomic, cannot compile the io_uring backend!"
+#endif
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+/* Number of submission queue entries in each thread's ring */
+#define _RING_ENTRIES 256
+
+struct _cfib_uring {
+    // Must be the first member, the poll callback casts it to _cfib_uring
+    cfib_sched_source_t source;
+    // -1 before first use, -2 if io_uring is not available
+    int ring_fd;
+    // Submission queue
+    atomic_uint* sq_head;
+    atomic_uint* sq_tail;
+    unsigned sq_mask;
+    unsigned sq_entries;
+    unsigned* sq_array;
+    struct io_uring_sqe* sqes;
+    // Number of queued SQEs not yet submitted to the kernel
+    unsigned to_submit;
+    // Completion queue
+    atomic_uint* cq_head;
+    atomic_uint* cq_tail;
+    unsigned cq_mask;
+    struct io_uring_cqe* cqes;
+    // Mappings of the rings
+    void* sq_ring;
+    size_t sq_ring_size;
+    void* cq_ring;
+    size_t cq_ring_size;
+};
+
+static _Thread_local struct _cfib_uring _ring = {
+    .ring_fd = -1
+};
+
+// State of one operation, lives on the stack of the waiting fiber
+struct _uring_op {
+    cfib_t* fib;
+    int res;
+    int done;
+};
+
+// @internal Submits queued SQEs and/or waits for completions.
+static int _uring_enter(struct _cfib_uring* r, unsigned min_complete, unsigned flags)
+{
+    int res = (int)syscall(__NR_io_uring_enter, r->ring_fd, r->to_submit, min_complete, flags, NULL, 0);
+    if(res >= 0)
+        r->to_submit -= (unsigned)res;
+    return res;
+}
+
+// @internal Unparks the fibers of all completed operations.
+static int _uring_reap(struct _cfib_uring* r)
+{
+    unsigned head = atomic_load_explicit(r->cq_head, memory_order_relaxed);
+    unsigned tail = atomic_load_explicit(r->cq_tail, memory_order_acquire);
+    int woken = 0;
+    for(; head != tail; head++) {
+        struct io_uring_cqe* cqe = &r->cqes[head & r->cq_mask];
+        struct _uring_op* op = (struct _uring_op*)(uintptr_t)cqe->user_data;
+        op->res = cqe->res;
+        op->done = 1;
+        r->source.waiting--;
+        cfib_unpark(op->fib);
+        woken++;
+    }
+    atomic_store_explicit(r->cq_head, head, memory_order_release);
+    return woken;
+}
+
+static int _uring_poll(cfib_sched_source_t* source, long timeout_ns)
+{
+    struct _cfib_uring* r = (struct _cfib_uring*)source;
+    // Submit everything queued since the last poll, and wait for at least
+    // one completion if asked to wait forever, all with one system call.
+    unsigned min_complete = timeout_ns < 0 ? 1 : 0;
+    if(r->to_submit > 0 || min_complete > 0) {
+        if(_uring_enter(r, min_complete, min_complete ? IORING_ENTER_GETEVENTS : 0) < 0 && errno != EINTR && errno != EBUSY)
+            return -1;
+    }
+    int woken = _uring_reap(r);
+    if(woken == 0 && timeout_ns > 0) {
+        struct pollfd pfd = {.fd = r->ring_fd, .events = POLLIN, .revents = 0};
+        if(poll(&pfd, 1, (int)((timeout_ns + 999999) / 1000000)) > 0)
+            woken = _uring_reap(r);
+    }
+    return woken;
+}
+
+// @internal Sets up this thread's ring on first use. Returns -1 if
+// io_uring is not available.
+static int _uring_init()
+{
+    struct _cfib_uring* r = &_ring;
+    if(r->ring_fd >= 0)
+        return 0;
+    if(r->ring_fd == -2)
+        return -1;
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    int fd = (int)syscall(__NR_io_uring_setup, _RING_ENTRIES, &p);
+    if(fd < 0)
+        goto _errexit;
+    r->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    r->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if(p.features & IORING_FEAT_SINGLE_MMAP) {
+        if(r->cq_ring_size > r->sq_ring_size)
+            r->sq_ring_size = r->cq_ring_size;
+        r->cq_ring_size = 0;
+    }
+    r->sq_ring = mmap(0, r->sq_ring_size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    if(r->sq_ring == MAP_FAILED)
+        goto _errexit_close;
+    if(r->cq_ring_size == 0) {
+        r->cq_ring = r->sq_ring;
+    } else {
+        r->cq_ring = mmap(0, r->cq_ring_size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+        if(r->cq_ring == MAP_FAILED)
+            goto _errexit_unmap_sq;
+    }
+    r->sqes = mmap(0, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, fd, IORING_OFF_SQES);
+    if(r->sqes == MAP_FAILED)
+        goto _errexit_unmap_cq;
+    unsigned char* sq = (unsigned char*)r->sq_ring;
+    unsigned char* cq = (unsigned char*)r->cq_ring;
+    r->sq_head = (atomic_uint*)(sq + p.sq_off.head);
+    r->sq_tail = (atomic_uint*)(sq + p.sq_off.tail);
+    r->sq_mask = *(unsigned*)(sq + p.sq_off.ring_mask);
+    r->sq_entries = p.sq_entries;
+    r->sq_array = (unsigned*)(sq + p.sq_off.array);
+    r->cq_head = (atomic_uint*)(cq + p.cq_off.head);
+    r->cq_tail = (atomic_uint*)(cq + p.cq_off.tail);
+    r->cq_mask = *(unsigned*)(cq + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe*)(cq + p.cq_off.cqes);
+    r->to_submit = 0;
+    r->ring_fd = fd;
+    r->source.fd = fd;
+    r->source.waiting = 0;
+    r->source.poll = _uring_poll;
+    cfib_sched_add_source(&r->source);
+    return 0;
+_errexit_unmap_cq:
+    if(r->cq_ring_size != 0)
+        munmap(r->cq_ring, r->cq_ring_size);
+_errexit_unmap_sq:
+    munmap(r->sq_ring, r->sq_ring_size);
+_errexit_close:
+    close(fd);
+_errexit:
+    fprintf(stderr, "libcfib: WARNING: io_uring is not available, falling back to blocking I/O!\n");
+    r->ring_fd = -2;
+    return -1;
+}
+
+// @internal Returns a cleared SQE for 'fd', or NULL if io_uring is not
+// available.
+static struct io_uring_sqe* _uring_sqe(int fd)
+{
+    struct _cfib_uring* r = &_ring;
+    if(_uring_init() < 0)
+        return NULL;
+    unsigned tail = atomic_load_explicit(r->sq_tail, memory_order_relaxed);
+    if(tail - atomic_load_explicit(r->sq_head, memory_order_acquire) >= r->sq_entries) {
+        // Submission queue is full, submit right away to make room
+        while(_uring_enter(r, 0, 0) < 0 && (errno == EINTR || errno == EBUSY))
+            _uring_reap(r);
+    }
+    unsigned index = tail & r->sq_mask;
+    struct io_uring_sqe* sqe = &r->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    if(fd <= -2) {
+        sqe->fd = -2 - fd;
+        sqe->flags = IOSQE_FIXED_FILE;
+    } else {
+        sqe->fd = fd;
+    }
+    r->sq_array[index] = index;
+    return sqe;
+}
+
+// @internal Clamps a length to the 32 bits of an SQE. The transfer is short
+// then, like any transfer can be.
+static inline unsigned _uring_len(size_t len)
+{
+    return len > UINT_MAX ? UINT_MAX : (unsigned)len;
+}
+
+// @internal Queues the SQE returned by _uring_sqe() for 'op'.
+static void _uring_queue(struct io_uring_sqe* sqe, struct _uring_op* op)
+{
+    struct _cfib_uring* r = &_ring;
+    sqe->user_data = (uintptr_t)op;
+    atomic_store_explicit(r->sq_tail, atomic_load_explicit(r->sq_tail, memory_order_relaxed) + 1, memory_order_release);
+    r->to_submit++;
+    r->source.waiting++;
+}
+
+// @internal Queues the SQE returned by _uring_sqe() and parks until it
+// completes, or until the deadline passes. Returns the result of the
+// operation.
+static long _uring_wait(struct io_uring_sqe* sqe, uint64_t deadline_ns)
+{
+    struct _uring_op op = {.fib = cfib_get_current(), .res = 0, .done = 0};
+    _uring_queue(sqe, &op);
+    int expired = 0;
+    while(!op.done) {
+        if(cfib_park_until(deadline_ns) < 0 && !op.done) {
+            expired = 1;
+            break;
+        }
+    }
+    if(expired) {
+        // The kernel still owns 'op' and the buffers, so cancel the
+        // operation and wait for both completions. It may complete anyway,
+        // if it was already past the point of no return.
+        struct _uring_op cancel = {.fib = op.fib, .res = 0, .done = 0};
+        struct io_uring_sqe* csqe = _uring_sqe(-1);
+        csqe->opcode = IORING_OP_ASYNC_CANCEL;
+        csqe->addr = (uintptr_t)&op;
+        _uring_queue(csqe, &cancel);
+        while(!op.done || !cancel.done)
+            cfib_park();
+        if(op.res == -ECANCELED || op.res == -EINTR)
+            op.res = -ETIMEDOUT;
+    }
+    if(op.res < 0) {
+        errno = -op.res;
+        return -1;
+    }
+    return op.res;
+}
+
+ssize_t cfib_uring_read(int fd, void* buf, size_t count, off_t offset)
+{
+    return cfib_uring_read_until(fd, buf, count, offset, CFIB_NO_DEADLINE);
+}
+
+ssize_t cfib_uring_read_until(int fd, void* buf, size_t count, off_t offset, uint64_t deadline_ns)
+{
+    struct io_uring_sqe* sqe = _uring_sqe(fd);
+    if(sqe == NULL)
+        return pread(fd, buf, count, offset);
+    sqe->opcode = IORING_OP_READ;
+    sqe->addr = (uintptr_t)buf;
+    sqe->len = _uring_len(count);
+    sqe->off = (uint64_t)offset;
+    return _uring_wait(sqe, deadline_ns);
+}
+
+ssize_t cfib_uring_write(int fd, const void* buf, size_t count, off_t offset)
+{
+    return cfib_uring_write_until(fd, buf, count, offset, CFIB_NO_DEADLINE);
+}
+
+ssize_t cfib_uring_write_until(int fd, const void* buf, size_t count, off_t offset, uint64_t deadline_ns)
+{
+    struct io_uring_sqe* sqe = _uring_sqe(fd);
+    if(sqe == NULL)
+        return pwrite(fd, buf, count, offset);
+    sqe->opcode = IORING_OP_WRITE;
+    sqe->addr = (uintptr_t)buf;
+    sqe->len = _uring_len(count);
+    sqe->off = (uint64_t)offset;
+    return _uring_wait(sqe, deadline_ns);
+}
+
+ssize_t cfib_uring_recv(int fd, void* buf, size_t len, int flags)
+{
+    return cfib_uring_recv_until(fd, buf, len, flags, CFIB_NO_DEADLINE);
+}
+
+ssize_t cfib_uring_recv_until(int fd, void* buf, size_t len, int flags, uint64_t deadline_ns)
+{
+    struct io_uring_sqe* sqe = _uring_sqe(fd);
+    if(sqe == NULL)
+        return recv(fd, buf, len, flags);
+    sqe->opcode = IORING_OP_RECV;
+    sqe->addr = (uintptr_t)buf;
+    sqe->len = _uring_len(len);
+    sqe->msg_flags = (unsigned)flags;
+    return _uring_wait(sqe, deadline_ns);
+}
+
+ssize_t cfib_uring_send(int fd, const void* buf, size_t len, int flags)
+{
+    return cfib_uring_send_until(fd, buf, len, flags, CFIB_NO_DEADLINE);
+}
+
+ssize_t cfib_uring_send_until(int fd, const void* buf, size_t len, int flags, uint64_t deadline_ns)
+{
+    struct io_uring_sqe* sqe = _uring_sqe(fd);
+    if(sqe == NULL)
+        return send(fd, buf, len, flags);
+    sqe->opcode = IORING_OP_SEND;
+    sqe->addr = (uintptr_t)buf;
+    sqe->len = _uring_len(len);
+    sqe->msg_flags = (unsigned)flags;
+    return _uring_wait(sqe, deadline_ns);
+}
+
+int cfib_uring_accept(int fd, struct sockaddr* addr, socklen_t* addrlen, int flags)
+{
+    return cfib_uring_accept_until(fd, addr, addrlen, flags, CFIB_NO_DEADLINE);
+}
+
+int cfib_uring_accept_until(int fd, struct sockaddr* addr, socklen_t* addrlen, int flags, uint64_t deadline_ns)
+{
+    struct io_uring_sqe* sqe = _uring_sqe(fd);
+    if(sqe == NULL)
+        return accept4(fd, addr, addrlen, flags);
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->addr = (uintptr_t)addr;
+    sqe->addr2 = (uintptr_t)addrlen;
+    sqe->accept_flags = (unsigned)flags;
+    return (int)_uring_wait(sqe, deadline_ns);
+}
+
+int cfib_uring_openat(int dirfd, const char* pathname, int flags, mode_t mode)
+{
+    return cfib_uring_openat_until(dirfd, pathname, flags, mode, CFIB_NO_DEADLINE);
+}
+
+int cfib_uring_openat_until(int dirfd, const char* pathname, int flags, mode_t mode, uint64_t deadline_ns)
+{
+    struct io_uring_sqe* sqe = _uring_sqe(-1);
+    if(sqe == NULL)
+        return openat(dirfd, pathname, flags, mode);
+    // Not a registered file: AT_FDCWD would look like one
+    sqe->fd = dirfd;
+    sqe->opcode = IORING_OP_OPENAT;
+    sqe->addr = (uintptr_t)pathname;
+    sqe->len = mode;
+    sqe->open_flags = (unsigned)flags;
+    return (int)_uring_wait(sqe, deadline_ns);
+}
+
+int cfib_uring_fsync(int fd, int datasync)
+{
+    return cfib_uring_fsync_until(fd, datasync, CFIB_NO_DEADLINE);
+}
+
+int cfib_uring_fsync_until(int fd, int datasync, uint64_t deadline_ns)
+{
+    struct io_uring_sqe* sqe = _uring_sqe(fd);
+    if(sqe == NULL)
+        return datasync ? fdatasync(fd) : fsync(fd);
+    sqe->opcode = IORING_OP_FSYNC;
+    sqe->fsync_flags = datasync ? IORING_FSYNC_DATASYNC : 0;
+    return (int)_uring_wait(sqe, deadline_ns);
+}
+
+int cfib_uring_register_buffers(const struct iovec* iovecs, unsigned nr_iovecs)
+{
+    if(_uring_init() < 0) {
+        errno = ENOSYS;
+        return -1;
+    }
+    return (int)syscall(__NR_io_uring_register, _ring.ring_fd, IORING_REGISTER_BUFFERS, iovecs, nr_iovecs);
+}
+
+int cfib_uring_register_files(const int* fds, unsigned nr_fds)
+{
+    if(_uring_init() < 0) {
+        errno = ENOSYS;
+        return -1;
+    }
+    return (int)syscall(__NR_io_uring_register, _ring.ring_fd, IORING_REGISTER_FILES, fds, nr_fds);
+}
+
+ssize_t cfib_uring_read_fixed(int fd, void* buf, size_t count, off_t offset, int buf_index)
+{
+    return cfib_uring_read_fixed_until(fd, buf, count, offset, buf_index, CFIB_NO_DEADLINE);
+}
+
+ssize_t cfib_uring_read_fixed_until(int fd, void* buf, size_t count, off_t offset, int buf_index, uint64_t deadline_ns)
+{
+    struct io_uring_sqe* sqe = _uring_sqe(fd);
+    if(sqe == NULL) {
+        errno = ENOSYS;
+        return -1;
+    }
+    sqe->opcode = IORING_OP_READ_FIXED;
+    sqe->addr = (uintptr_t)buf;
+    sqe->len = _uring_len(count);
+    sqe->off = (uint64_t)offset;
+    sqe->buf_index = (uint16_t)buf_index;
+    return _uring_wait(sqe, deadline_ns);
+}
+
+ssize_t cfib_uring_write_fixed(int fd, const void* buf, size_t count, off_t offset, int buf_index)
+{
+    return cfib_uring_write_fixed_until(fd, buf, count, offset, buf_index, CFIB_NO_DEADLINE);
+}
+
+ssize_t cfib_uring_write_fixed_until(int fd, const void* buf, size_t count, off_t offset, int buf_index, uint64_t deadline_ns)
+{
+    struct io_uring_sqe* sqe = _uring_sqe(fd);
+    if(sqe == NULL) {
+        errno = ENOSYS;
+        return -1;
+    }
+    sqe->opcode = IORING_OP_WRITE_FIXED;
+    sqe->addr = (uintptr_t)buf;
+    sqe->len = _uring_len(count);
+    sqe->off = (uint64_t)offset;
+    sqe->buf_index = (uint16_t)buf_index;
+    return _uring_wait(sqe, deadline_ns);
+}
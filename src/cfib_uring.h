@@ -0,0 +1,116 @@
+#ifndef _CFIB_URING_H_
+#define _CFIB_URING_H_
+
+/** @file cfib_uring.h
+ *
+ * Fiber I/O via Linux io_uring, on top of the per-thread scheduler (see
+ * cfib_sched.h).
+ *
+ * Unlike the readiness based reactor of cfib_io.h, this module does not poll
+ * for readiness at all. Each call queues a submission queue entry (SQE) to
+ * the thread's ring and parks the calling fiber. The ring is an event source
+ * of the scheduler: every time the scheduler polls it, all queued SQEs are
+ * submitted and all completions are reaped with a single io_uring_enter()
+ * call, and the fibers owning the completions are unparked. Because the
+ * kernel performs the operations, this works for regular files as well.
+ *
+ * The ring is created for each thread on first use. If the kernel does not
+ * support io_uring, the functions fall back to ordinary blocking system
+ * calls, which block the whole thread.
+ *
+ * All functions return what their POSIX counterparts return, and on error
+ * -1 with errno set. They must be called from fibers run by
+ * cfib_sched_run(). A length of 4 GiB or more is clamped to UINT_MAX bytes,
+ * so the transfer is short.
+ *
+ * Each function has a variant ending in _until(), which waits at most until
+ * a deadline, in nanoseconds of cfib_clock_ns(). If the deadline passes
+ * first, the operation is cancelled with IORING_OP_ASYNC_CANCEL, and the
+ * call returns -1 with errno set to ETIMEDOUT once the kernel has let go of
+ * the buffers. An operation which completes despite the cancel returns it's
+ * result as usual. The blocking fallback ignores deadlines.
+ */
+
+#include "cfib_sched.h"
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** Refers to a file registered with cfib_uring_register_files().
+ *
+ * Any function of this module taking a file descriptor (except the 'dirfd'
+ * of cfib_uring_openat()) accepts the value of this macro in place of the
+ * descriptor, to use the registered file with the given index. This saves
+ * the kernel from looking up the file on every operation.
+ */
+#define CFIB_URING_FIXED_FILE(index) (-2 - (int)(index))
+
+/** Reads at 'offset' like pread(2), blocking only the calling fiber. */
+ssize_t cfib_uring_read(int fd, void* buf, size_t count, off_t offset);
+ssize_t cfib_uring_read_until(int fd, void* buf, size_t count, off_t offset, uint64_t deadline_ns);
+
+/** Writes at 'offset' like pwrite(2), blocking only the calling fiber. */
+ssize_t cfib_uring_write(int fd, const void* buf, size_t count, off_t offset);
+ssize_t cfib_uring_write_until(int fd, const void* buf, size_t count, off_t offset, uint64_t deadline_ns);
+
+/** Receives like recv(2), blocking only the calling fiber. */
+ssize_t cfib_uring_recv(int fd, void* buf, size_t len, int flags);
+ssize_t cfib_uring_recv_until(int fd, void* buf, size_t len, int flags, uint64_t deadline_ns);
+
+/** Sends like send(2), blocking only the calling fiber. */
+ssize_t cfib_uring_send(int fd, const void* buf, size_t len, int flags);
+ssize_t cfib_uring_send_until(int fd, const void* buf, size_t len, int flags, uint64_t deadline_ns);
+
+/** Accepts like accept4(2), blocking only the calling fiber. */
+int cfib_uring_accept(int fd, struct sockaddr* addr, socklen_t* addrlen, int flags);
+int cfib_uring_accept_until(int fd, struct sockaddr* addr, socklen_t* addrlen, int flags, uint64_t deadline_ns);
+
+/** Opens a file like openat(2), blocking only the calling fiber. */
+int cfib_uring_openat(int dirfd, const char* pathname, int flags, mode_t mode);
+int cfib_uring_openat_until(int dirfd, const char* pathname, int flags, mode_t mode, uint64_t deadline_ns);
+
+/** Flushes a file like fsync(2), blocking only the calling fiber.
+ *
+ * @param[in] datasync if non-zero, works like fdatasync(2) instead.
+ */
+int cfib_uring_fsync(int fd, int datasync);
+int cfib_uring_fsync_until(int fd, int datasync, uint64_t deadline_ns);
+
+/** Registers buffers with this thread's ring.
+ *
+ * The kernel maps registered buffers once, instead of on every operation.
+ * Use them with cfib_uring_read_fixed() and cfib_uring_write_fixed().
+ * Only one set of buffers can be registered at a time.
+ *
+ * @return 0 on success, -1 on error.
+ */
+int cfib_uring_register_buffers(const struct iovec* iovecs, unsigned nr_iovecs);
+
+/** Registers file descriptors with this thread's ring.
+ *
+ * Registered files are referred to with CFIB_URING_FIXED_FILE(index), where
+ * 'index' is the position of the descriptor in 'fds'. Only one set of files
+ * can be registered at a time.
+ *
+ * @return 0 on success, -1 on error.
+ */
+int cfib_uring_register_files(const int* fds, unsigned nr_fds);
+
+/** Reads into (a part of) registered buffer 'buf_index'. */
+ssize_t cfib_uring_read_fixed(int fd, void* buf, size_t count, off_t offset, int buf_index);
+ssize_t cfib_uring_read_fixed_until(int fd, void* buf, size_t count, off_t offset, int buf_index, uint64_t deadline_ns);
+
+/** Writes from (a part of) registered buffer 'buf_index'. */
+ssize_t cfib_uring_write_fixed(int fd, const void* buf, size_t count, off_t offset, int buf_index);
+ssize_t cfib_uring_write_fixed_until(int fd, const void* buf, size_t count, off_t offset, int buf_index, uint64_t deadline_ns);
+
+#ifdef __cplusplus
+} /* extern "C" { */
+#endif
+
+#endif /* _CFIB_URING_H_ */
@@ -1,13 +1,52 @@
+// pthread_setaffinity_np() is a GNU extension
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
 #include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
+#include <errno.h>
 #include <limits.h>
 #include <time.h>
 #include <sys/mman.h>
+#include <ucontext.h>
+#ifdef __x86_64__
+#include <x86intrin.h>
+#endif
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <signal.h>
+#include <unistd.h>
+#endif
 
 #include "cfib.h"
+#include "cfib_sched.h"
+#include "cfib_sync.h"
+#include "cfib_gen.h"
+#ifdef _WITH_EPOLL
+#include "cfib_io.h"
+#include <fcntl.h>
+#include <sys/socket.h>
+#endif
+#ifdef _WITH_IO_URING
+#include "cfib_uring.h"
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+#ifdef _WITH_C11_ATOMICS
+#include "cfib_mt.h"
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#endif
 
 CFIB_TAG_CTOR(StackHogs)
+CFIB_TAG_CTOR(Workers)
 
 #define NUM_SAMPLES 100000
 
@@ -31,6 +70,8 @@ void func_stack_hog(uintptr_t n) {
         hog[0] = (char)0;
         //fprintf(stderr, "stack_hog[%lu]: %lX\n", n, &hog);
         func_stack_hog(n - 1);
+        // Keep the frame alive across the call, even when optimized
+        __asm__ volatile("" : : "r"(hog) : "memory");
     }
     return;
 }
@@ -51,6 +92,10 @@ long _get_median(long* b, size_t s) {
         return *m;
 }
 
+long _timespec_diff_ns(struct timespec* tp0, struct timespec* tp1) {
+    return (tp1->tv_sec - tp0->tv_sec) * 1000000000L + (tp1->tv_nsec - tp0->tv_nsec);
+}
+
 /*void bench_ptrcall(long *intervals, int n) {
     struct timespec tp0, tp1;
     void (*func)(void*);
@@ -71,16 +116,16 @@ void bench_swap(int n) {
     struct timespec tp0, tp1;
     cfib_t* test_context = cfib_new((cfib_func)func_pingpong, (void*)fib_main, NULL);
     long *intervals = mmap(0, sizeof(long) * n, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANON, -1, 0);
-    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &tp0);
-    long tt = tp0.tv_nsec;
+    struct timespec tt0;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &tt0);
     for(int i = 0; i < n; i++) {
         clock_gettime(CLOCK_MONOTONIC, &tp0);
         cfib_swap(test_context);
         clock_gettime(CLOCK_MONOTONIC, &tp1);
-        intervals[i] = tp1.tv_nsec - tp0.tv_nsec;
+        intervals[i] = _timespec_diff_ns(&tp0, &tp1);
     }
     clock_gettime(CLOCK_THREAD_CPUTIME_ID, &tp0);
-    tt = tp0.tv_nsec - tt;
+    long tt = _timespec_diff_ns(&tt0, &tp0);
     qsort(intervals, n, sizeof(long), _long_cmp);
     printf("Time across cfib_swap() call, sampled %d times:\n", n);
     printf("median\t%ld ns\n", _get_median(intervals, n) - clock_overhead);
@@ -94,16 +139,16 @@ void bench_swap__noassert__(int n) {
     struct timespec tp0, tp1;
     cfib_t* test_context = cfib_new((cfib_func)func_pingpong__noassert__, (void*)fib_main, NULL);
     long *intervals = mmap(0, sizeof(long) * n, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANON, -1, 0);
-    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &tp0);
-    long tt = tp0.tv_nsec;
+    struct timespec tt0;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &tt0);
     for(int i = 0; i < n; i++) {
         clock_gettime(CLOCK_MONOTONIC, &tp0);
         cfib_swap__noassert__(test_context);
         clock_gettime(CLOCK_MONOTONIC, &tp1);
-        intervals[i] = tp1.tv_nsec - tp0.tv_nsec;
+        intervals[i] = _timespec_diff_ns(&tp0, &tp1);
     }
     clock_gettime(CLOCK_THREAD_CPUTIME_ID, &tp0);
-    tt = tp0.tv_nsec - tt;
+    long tt = _timespec_diff_ns(&tt0, &tp0);
     qsort(intervals, n, sizeof(long), _long_cmp);
     printf("Time across cfib_swap__noassert__() call, sampled %d times:\n", n);
     printf("median\t%ld ns\n", _get_median(intervals, n) - clock_overhead);
@@ -113,10 +158,1859 @@ void bench_swap__noassert__(int n) {
     munmap(intervals, sizeof(long) * n);
 }
 
+void _new_unmap_loop(int n) {
+    for(int i = 0; i < n; i++) {
+        cfib_t* test_context = cfib_new((cfib_func)func_pingpong, (void*)fib_main, NULL);
+        cfib_unmap(test_context);
+        free(test_context);
+    }
+}
+
+void bench_new_unmap(int n) {
+    struct timespec tp0, tp1;
+    clock_gettime(CLOCK_MONOTONIC, &tp0);
+    _new_unmap_loop(n);
+    clock_gettime(CLOCK_MONOTONIC, &tp1);
+    long tt = _timespec_diff_ns(&tp0, &tp1);
+    printf("cfib_new() + cfib_unmap() without stack pool, %d times:\n", n);
+    printf("   avg\t%ld ns\n", tt / n);
+    printf(" total\t%ld ns\n", tt);
+    cfib_pool_set_high_water(CFIB_DEF_STACK_SIZE * 16);
+    clock_gettime(CLOCK_MONOTONIC, &tp0);
+    _new_unmap_loop(n);
+    clock_gettime(CLOCK_MONOTONIC, &tp1);
+    tt = _timespec_diff_ns(&tp0, &tp1);
+    cfib_pool_set_high_water(0);
+    printf("cfib_new() + cfib_unmap() with stack pool, %d times:\n", n);
+    printf("   avg\t%ld ns\n", tt / n);
+    printf(" total\t%ld ns\n", tt);
+}
+
+void bench_new_batch(int n) {
+    struct timespec tp0, tp1;
+    cfib_t** fibs = malloc(sizeof(cfib_t*) * n);
+    cfib_func* funcs = malloc(sizeof(cfib_func) * n);
+    for(int i = 0; i < n; i++)
+        funcs[i] = (cfib_func)func_pingpong;
+    clock_gettime(CLOCK_MONOTONIC, &tp0);
+    for(int i = 0; i < n; i++)
+        fibs[i] = cfib_new(funcs[i], (void*)fib_main, NULL);
+    for(int i = 0; i < n; i++) {
+        cfib_unmap(fibs[i]);
+        free(fibs[i]);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &tp1);
+    long tt = _timespec_diff_ns(&tp0, &tp1);
+    printf("%d x cfib_new() + cfib_unmap():\n", n);
+    printf(" total\t%ld ns\n", tt);
+    clock_gettime(CLOCK_MONOTONIC, &tp0);
+    cfib_t* batch = cfib_new_batch(n, funcs, NULL, NULL);
+    cfib_unmap_batch(batch, n);
+    clock_gettime(CLOCK_MONOTONIC, &tp1);
+    tt = _timespec_diff_ns(&tp0, &tp1);
+    printf("cfib_new_batch(%d) + cfib_unmap_batch():\n", n);
+    printf(" total\t%ld ns\n", tt);
+    free(funcs);
+    free(fibs);
+}
+
+void func_yielder(void *arg) {
+    for(long i = (long)arg; i > 0; i--)
+        cfib_yield();
+}
+
+void bench_yield(int n) {
+    struct timespec tp0, tp1;
+    const int num_fibers = 4;
+    for(int i = 0; i < num_fibers; i++)
+        cfib_spawn((cfib_func)func_yielder, (void*)(long)n, NULL);
+    clock_gettime(CLOCK_MONOTONIC, &tp0);
+    cfib_sched_run();
+    clock_gettime(CLOCK_MONOTONIC, &tp1);
+    long tt = _timespec_diff_ns(&tp0, &tp1);
+    printf("cfib_yield() among %d fibers, %d times each:\n", num_fibers, n);
+    printf("   avg\t%ld ns\n", tt / ((long)n * num_fibers));
+    printf(" total\t%ld ns\n", tt);
+}
+
+#ifdef _WITH_C11_ATOMICS
+#define FANOUT_FIBERS 1000
+#define FANOUT_ROUNDS 100
+
+volatile uint64_t fanout_sink = 0;
+
+void func_fanout_leaf(void *arg) {
+    for(int r = 0; r < FANOUT_ROUNDS; r++) {
+        uint64_t x = (uintptr_t)arg + r;
+        for(int i = 0; i < 2000; i++)
+            x = x * 6364136223846793005ULL + 1442695040888963407ULL;
+        fanout_sink += x;
+        cfib_mt_yield();
+    }
+}
+
+void func_fanout_root(void *arg) {
+    for(uintptr_t i = 0; i < FANOUT_FIBERS; i++)
+        cfib_mt_spawn((cfib_func)func_fanout_leaf, (void*)i, NULL);
+}
+
+void bench_mt_scaling() {
+    struct timespec tp0, tp1;
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    printf("Fan-out of %d fibers x %d yields on the M:N runtime:\n", FANOUT_FIBERS, FANOUT_ROUNDS);
+    printf("workers\ttotal ns\tspeedup\n");
+    long t1 = 0;
+    for(long n = 1; n <= ncpu; n++) {
+        clock_gettime(CLOCK_MONOTONIC, &tp0);
+        cfib_mt_run((unsigned)n, (cfib_func)func_fanout_root, NULL, NULL);
+        clock_gettime(CLOCK_MONOTONIC, &tp1);
+        long tt = _timespec_diff_ns(&tp0, &tp1);
+        if(n == 1)
+            t1 = tt;
+        printf("%ld\t%ld\t%.2f\n", n, tt, (double)t1 / tt);
+    }
+}
+#endif
+
+#ifdef _WITH_EPOLL
+struct io_pingpong {
+    int fd;
+    int n;
+};
+
+void func_io_ping(struct io_pingpong *p) {
+    char c = 0;
+    for(int i = 0; i < p->n; i++) {
+        cfib_write(p->fd, &c, 1);
+        cfib_read(p->fd, &c, 1);
+    }
+}
+
+void func_io_pong(struct io_pingpong *p) {
+    char c = 0;
+    for(int i = 0; i < p->n; i++) {
+        cfib_read(p->fd, &c, 1);
+        cfib_write(p->fd, &c, 1);
+    }
+}
+
+void bench_io_pingpong(int n) {
+    struct timespec tp0, tp1;
+    int sv[2];
+    socketpair(AF_UNIX, SOCK_STREAM, 0, sv);
+    fcntl(sv[0], F_SETFL, O_NONBLOCK);
+    fcntl(sv[1], F_SETFL, O_NONBLOCK);
+    struct io_pingpong ping = {sv[0], n}, pong = {sv[1], n};
+    cfib_spawn((cfib_func)func_io_ping, &ping, NULL);
+    cfib_spawn((cfib_func)func_io_pong, &pong, NULL);
+    clock_gettime(CLOCK_MONOTONIC, &tp0);
+    cfib_sched_run();
+    clock_gettime(CLOCK_MONOTONIC, &tp1);
+    long tt = _timespec_diff_ns(&tp0, &tp1);
+    cfib_close(sv[0]);
+    cfib_close(sv[1]);
+    printf("Round trip over a socketpair between two fibers, %d times:\n", n);
+    printf("   avg\t%ld ns\n", tt / n);
+    printf(" total\t%ld ns\n", tt);
+}
+#endif
+
+#ifdef _WITH_IO_URING
+#define URING_FILE_SIZE (16 << 20)
+#define URING_BLOCK_SIZE 4096
+#define URING_FIBERS 16
+
+struct uring_reader {
+    int fd;
+    int index;
+    int fixed;
+    char *buf;
+};
+
+void func_uring_reader(struct uring_reader *r) {
+    for(off_t off = (off_t)r->index * URING_BLOCK_SIZE; off < URING_FILE_SIZE; off += URING_FIBERS * URING_BLOCK_SIZE) {
+        if(r->fixed)
+            cfib_uring_read_fixed(CFIB_URING_FIXED_FILE(0), r->buf, URING_BLOCK_SIZE, off, r->index);
+        else
+            cfib_uring_read(r->fd, r->buf, URING_BLOCK_SIZE, off);
+    }
+}
+
+long _uring_run_readers(int fd, int fixed, char *bufs) {
+    struct timespec tp0, tp1;
+    struct uring_reader readers[URING_FIBERS];
+    for(int i = 0; i < URING_FIBERS; i++) {
+        readers[i] = (struct uring_reader){fd, i, fixed, bufs + i * URING_BLOCK_SIZE};
+        cfib_spawn((cfib_func)func_uring_reader, &readers[i], NULL);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &tp0);
+    cfib_sched_run();
+    clock_gettime(CLOCK_MONOTONIC, &tp1);
+    return _timespec_diff_ns(&tp0, &tp1);
+}
+
+void bench_uring_read() {
+    struct timespec tp0, tp1;
+    char path[] = "/dev/shm/test_cfib_XXXXXX";
+    int fd = mkstemp(path);
+    if(fd < 0) {
+        perror("mkstemp");
+        return;
+    }
+    unlink(path);
+    char *bufs = malloc(URING_FIBERS * URING_BLOCK_SIZE);
+    memset(bufs, 0x5A, URING_FIBERS * URING_BLOCK_SIZE);
+    for(off_t off = 0; off < URING_FILE_SIZE; off += URING_BLOCK_SIZE)
+        pwrite(fd, bufs, URING_BLOCK_SIZE, off);
+    long blocks = URING_FILE_SIZE / URING_BLOCK_SIZE;
+    printf("Reading %d MiB from tmpfs in %d byte blocks:\n", URING_FILE_SIZE >> 20, URING_BLOCK_SIZE);
+    clock_gettime(CLOCK_MONOTONIC, &tp0);
+    for(off_t off = 0; off < URING_FILE_SIZE; off += URING_BLOCK_SIZE)
+        pread(fd, bufs, URING_BLOCK_SIZE, off);
+    clock_gettime(CLOCK_MONOTONIC, &tp1);
+    long tt = _timespec_diff_ns(&tp0, &tp1);
+    printf("blocking pread()\t%ld ns/block\n", tt / blocks);
+    tt = _uring_run_readers(fd, 0, bufs);
+    printf("%d fibers, cfib_uring_read()\t%ld ns/block\n", URING_FIBERS, tt / blocks);
+    struct iovec iov[URING_FIBERS];
+    for(int i = 0; i < URING_FIBERS; i++)
+        iov[i] = (struct iovec){bufs + i * URING_BLOCK_SIZE, URING_BLOCK_SIZE};
+    if(cfib_uring_register_buffers(iov, URING_FIBERS) == 0 && cfib_uring_register_files(&fd, 1) == 0) {
+        tt = _uring_run_readers(fd, 1, bufs);
+        printf("%d fibers, cfib_uring_read_fixed()\t%ld ns/block\n", URING_FIBERS, tt / blocks);
+    }
+    close(fd);
+    free(bufs);
+}
+#endif
+
+#define SYNC_FIBERS 8
+
+cfib_mutex_t bench_mutex = CFIB_MUTEX_INIT;
+long bench_counter = 0;
+
+void func_mutex_contender(void *arg) {
+    for(long i = (long)arg; i > 0; i--) {
+        cfib_mutex_lock(&bench_mutex);
+        bench_counter++;
+        cfib_yield();
+        cfib_mutex_unlock(&bench_mutex);
+    }
+}
+
+cfib_sem_t bench_sem_ping = CFIB_SEM_INIT(0);
+cfib_sem_t bench_sem_pong = CFIB_SEM_INIT(0);
+
+void func_sem_ping(void *arg) {
+    for(long i = (long)arg; i > 0; i--) {
+        cfib_sem_post(&bench_sem_ping);
+        cfib_sem_wait(&bench_sem_pong);
+    }
+}
+
+void func_sem_pong(void *arg) {
+    for(long i = (long)arg; i > 0; i--) {
+        cfib_sem_wait(&bench_sem_ping);
+        cfib_sem_post(&bench_sem_pong);
+    }
+}
+
+cfib_chan_t *bench_chans[2];
+
+void func_chan_producer(void *arg) {
+    long n = (long)arg;
+    for(long i = 0; i < n; i++)
+        cfib_chan_send(bench_chans[i & 1], &i);
+    cfib_chan_close(bench_chans[0]);
+    cfib_chan_close(bench_chans[1]);
+}
+
+void func_chan_consumer(void *arg) {
+    long v;
+    while(cfib_chan_recv(bench_chans[0], &v) == 0);
+}
+
+void func_chan_selector(void *arg) {
+    long v0, v1;
+    cfib_select_case_t cases[2] = {
+        {bench_chans[0], CFIB_SELECT_RECV, &v0, 0},
+        {bench_chans[1], CFIB_SELECT_RECV, &v1, 0}
+    };
+    int open = 2;
+    while(open > 0) {
+        int i = cfib_chan_select(cases, 2, 1);
+        if(cases[i].result < 0) {
+            cases[i] = cases[open - 1];
+            open--;
+        }
+    }
+}
+
+long _sched_run_timed() {
+    struct timespec tp0, tp1;
+    clock_gettime(CLOCK_MONOTONIC, &tp0);
+    cfib_sched_run();
+    clock_gettime(CLOCK_MONOTONIC, &tp1);
+    return _timespec_diff_ns(&tp0, &tp1);
+}
+
+void bench_sync(int n) {
+    long tt;
+    for(int i = 0; i < SYNC_FIBERS; i++)
+        cfib_spawn((cfib_func)func_mutex_contender, (void*)(long)n, NULL);
+    tt = _sched_run_timed();
+    printf("cfib_mutex_t, %d fibers contending, %d times each:\n", SYNC_FIBERS, n);
+    printf("   avg\t%ld ns per lock + yield + unlock\n", tt / ((long)n * SYNC_FIBERS));
+    cfib_spawn((cfib_func)func_sem_ping, (void*)(long)n, NULL);
+    cfib_spawn((cfib_func)func_sem_pong, (void*)(long)n, NULL);
+    tt = _sched_run_timed();
+    printf("cfib_sem_t, ping-pong between 2 fibers, %d times:\n", n);
+    printf("   avg\t%ld ns per round trip\n", tt / n);
+    size_t capacities[] = {1, 64, CFIB_CHAN_UNBOUNDED};
+    for(int c = 0; c < 3; c++) {
+        bench_chans[0] = cfib_chan_new(sizeof(long), capacities[c]);
+        bench_chans[1] = bench_chans[0];
+        cfib_spawn((cfib_func)func_chan_producer, (void*)(long)n, NULL);
+        cfib_spawn((cfib_func)func_chan_consumer, NULL, NULL);
+        tt = _sched_run_timed();
+        cfib_chan_free(bench_chans[0]);
+        if(capacities[c] == CFIB_CHAN_UNBOUNDED)
+            printf("cfib_chan_t, unbounded, %d elements:\n", n);
+        else
+            printf("cfib_chan_t, capacity %zu, %d elements:\n", capacities[c], n);
+        printf("   avg\t%ld ns per element\n", tt / n);
+    }
+    bench_chans[0] = cfib_chan_new(sizeof(long), 64);
+    bench_chans[1] = cfib_chan_new(sizeof(long), 64);
+    cfib_spawn((cfib_func)func_chan_producer, (void*)(long)n, NULL);
+    cfib_spawn((cfib_func)func_chan_selector, NULL, NULL);
+    tt = _sched_run_timed();
+    cfib_chan_free(bench_chans[0]);
+    cfib_chan_free(bench_chans[1]);
+    printf("cfib_chan_select() over 2 channels of capacity 64, %d elements:\n", n);
+    printf("   avg\t%ld ns per element\n", tt / n);
+}
+
+#ifdef _WITH_C11_ATOMICS
+struct remote_pingpong {
+    _Atomic(cfib_t*) fibs[2];
+    int n;
+};
+
+struct remote_side {
+    struct remote_pingpong* pp;
+    int id;
+};
+
+void func_remote_pingpong(struct remote_side* side) {
+    struct remote_pingpong* pp = side->pp;
+    atomic_store(&pp->fibs[side->id], cfib_get_current());
+    cfib_t* peer;
+    while((peer = atomic_load(&pp->fibs[!side->id])) == NULL)
+        sched_yield();
+    for(int i = 0; i < pp->n; i++) {
+        if(side->id == 0) {
+            cfib_wake_remote(peer);
+            cfib_park_remote();
+        } else {
+            cfib_park_remote();
+            cfib_wake_remote(peer);
+        }
+    }
+}
+
+void* thread_remote_pingpong(void* arg) {
+    struct remote_side* side = arg;
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(side->id % ncpu, &set);
+    pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    cfib_init_thread();
+    cfib_spawn((cfib_func)func_remote_pingpong, side, NULL);
+    cfib_sched_run();
+    return NULL;
+}
+
+#define LATE_WAKEUPS 1000
+
+static int late_woken = 0;
+static int late_finished = 0;
+
+void func_late_wakeup(void* args) {
+    (void)args;
+    cfib_park_remote();
+    late_woken++;
+    cfib_yield();
+    late_finished++;
+}
+
+void func_late_waker(void* args) {
+    (void)args;
+    for(int i = 0; i < LATE_WAKEUPS; i++) {
+        cfib_t* fib = cfib_spawn(func_late_wakeup, NULL, NULL);
+        cfib_yield();
+        cfib_wake_remote(fib);
+        while(late_woken <= i)
+            cfib_yield();
+        // Every other fiber is still in the inbox when it finishes
+        if(i % 2 == 0)
+            cfib_wake_remote(fib);
+        while(late_finished <= i)
+            cfib_yield();
+        // Finished, the next cfib_spawn() reuses it
+        cfib_wake_remote(fib);
+    }
+}
+
+// Wakes up the fibers again after they were woken up, and after they
+// finished, which must not leave recycled fibers in the inbox
+void bench_late_wakeups() {
+    cfib_spawn(func_late_waker, NULL, NULL);
+    cfib_sched_run();
+    printf("Late cfib_wake_remote() on %d finishing fibers: %s\n", LATE_WAKEUPS, late_finished == LATE_WAKEUPS ? "OK" : "FAILED");
+}
+
+void bench_remote_pingpong(int n) {
+    struct timespec tp0, tp1;
+    struct remote_pingpong pp = {.n = n};
+    atomic_init(&pp.fibs[0], NULL);
+    atomic_init(&pp.fibs[1], NULL);
+    struct remote_side sides[2] = {{&pp, 0}, {&pp, 1}};
+    pthread_t threads[2];
+    clock_gettime(CLOCK_MONOTONIC, &tp0);
+    for(int i = 0; i < 2; i++)
+        pthread_create(&threads[i], NULL, thread_remote_pingpong, &sides[i]);
+    for(int i = 0; i < 2; i++)
+        pthread_join(threads[i], NULL);
+    clock_gettime(CLOCK_MONOTONIC, &tp1);
+    long tt = _timespec_diff_ns(&tp0, &tp1);
+    printf("cfib_wake_remote() ping-pong between fibers of 2 pinned threads, %d times:\n", n);
+    printf("   avg\t%ld ns per round trip\n", tt / n);
+    printf(" total\t%ld ns\n", tt);
+    bench_late_wakeups();
+}
+#endif
+
+#define TIMER_SPAN_NS 10000000000L
+#define SLEEP_FIBERS 1000
+
+// Binary min-heap of timers with back-indices for cancelling, as a baseline
+// for the timing wheel
+struct heap_timer {
+    uint64_t deadline;
+    size_t index;
+};
+
+struct timer_heap {
+    struct heap_timer** items;
+    size_t count;
+};
+
+static inline void _heap_set(struct timer_heap* h, size_t i, struct heap_timer* t) {
+    h->items[i] = t;
+    t->index = i;
+}
+
+void _heap_sift_up(struct timer_heap* h, size_t i) {
+    struct heap_timer* t = h->items[i];
+    while(i > 0 && h->items[(i - 1) / 2]->deadline > t->deadline) {
+        _heap_set(h, i, h->items[(i - 1) / 2]);
+        i = (i - 1) / 2;
+    }
+    _heap_set(h, i, t);
+}
+
+void _heap_sift_down(struct timer_heap* h, size_t i) {
+    struct heap_timer* t = h->items[i];
+    for(;;) {
+        size_t c = 2 * i + 1;
+        if(c >= h->count)
+            break;
+        if(c + 1 < h->count && h->items[c + 1]->deadline < h->items[c]->deadline)
+            c++;
+        if(h->items[c]->deadline >= t->deadline)
+            break;
+        _heap_set(h, i, h->items[c]);
+        i = c;
+    }
+    _heap_set(h, i, t);
+}
+
+void heap_add(struct timer_heap* h, struct heap_timer* t) {
+    h->items[h->count++] = t;
+    _heap_sift_up(h, h->count - 1);
+}
+
+void heap_cancel(struct timer_heap* h, struct heap_timer* t) {
+    size_t i = t->index;
+    struct heap_timer* last = h->items[--h->count];
+    if(last == t)
+        return;
+    _heap_set(h, i, last);
+    _heap_sift_up(h, i);
+    _heap_sift_down(h, last->index);
+}
+
+size_t heap_advance(struct timer_heap* h, uint64_t now) {
+    size_t fired = 0;
+    while(h->count > 0 && h->items[0]->deadline <= now) {
+        heap_cancel(h, h->items[0]);
+        fired++;
+    }
+    return fired;
+}
+
+size_t wheel_fired = 0;
+
+void func_wheel_timer(cfib_timer_t* timer) {
+    wheel_fired++;
+}
+
+void func_sleeper(long* lateness) {
+    uint64_t deadline = cfib_clock_ns() + (uint64_t)(rand() % 10000000);
+    cfib_sleep_until(deadline);
+    *lateness = (long)(cfib_clock_ns() - deadline);
+}
+
+cfib_sem_t timed_sem = CFIB_SEM_INIT(0);
+cfib_mutex_t timed_mutex = CFIB_MUTEX_INIT;
+cfib_mutex_t timed_cond_mutex = CFIB_MUTEX_INIT;
+cfib_cond_t timed_cond = CFIB_COND_INIT;
+cfib_chan_t *timed_chan;
+int timed_out = 0;
+
+struct timed_waiter {
+    int kind;
+    int fd;
+    long lateness;
+};
+
+void func_timed_waiter(struct timed_waiter *w) {
+    uint64_t deadline = cfib_clock_ns() + (uint64_t)(rand() % 10000000);
+    long v;
+#if defined(_WITH_EPOLL) || defined(_WITH_IO_URING)
+    char c;
+#endif
+    int res = 0;
+    cfib_select_case_t cases[1] = {{timed_chan, CFIB_SELECT_RECV, &v, 0}};
+    switch(w->kind) {
+    case 0: res = cfib_sem_wait_until(&timed_sem, deadline); break;
+    case 1: res = cfib_mutex_lock_until(&timed_mutex, deadline); break;
+    case 2:
+        cfib_mutex_lock(&timed_cond_mutex);
+        res = cfib_cond_wait_until(&timed_cond, &timed_cond_mutex, deadline);
+        cfib_mutex_unlock(&timed_cond_mutex);
+        break;
+    case 3: res = cfib_chan_recv_until(timed_chan, &v, deadline); break;
+    case 4: res = cfib_chan_select_until(cases, 1, deadline); break;
+#ifdef _WITH_EPOLL
+    case 5: res = (int)cfib_read_until(w->fd, &c, 1, deadline); break;
+#endif
+#ifdef _WITH_IO_URING
+    case 6: res = (int)cfib_uring_recv_until(w->fd, &c, 1, 0, deadline); break;
+#endif
+    }
+    w->lateness = (long)(cfib_clock_ns() - deadline);
+    if(res == -1 && errno == ETIMEDOUT)
+        timed_out++;
+}
+
+void bench_timed_waits() {
+    struct timed_waiter waiters[SLEEP_FIBERS];
+    long lateness[SLEEP_FIBERS];
+    int sv[2] = {-1, -1};
+    int kinds = 5;
+#if defined(_WITH_EPOLL) || defined(_WITH_IO_URING)
+    socketpair(AF_UNIX, SOCK_STREAM, 0, sv);
+    fcntl(sv[0], F_SETFL, O_NONBLOCK);
+    fcntl(sv[1], F_SETFL, O_NONBLOCK);
+#endif
+    timed_chan = cfib_chan_new(sizeof(long), 1);
+    cfib_mutex_trylock(&timed_mutex);
+    for(int i = 0; i < SLEEP_FIBERS; i++) {
+        waiters[i] = (struct timed_waiter){i % kinds, -1, 0};
+        cfib_spawn((cfib_func)func_timed_waiter, &waiters[i], NULL);
+    }
+    // One reader per descriptor at a time
+#ifdef _WITH_EPOLL
+    waiters[0] = (struct timed_waiter){5, sv[0], 0};
+#endif
+#ifdef _WITH_IO_URING
+    waiters[1] = (struct timed_waiter){6, sv[1], 0};
+#endif
+    cfib_sched_run();
+    for(int i = 0; i < SLEEP_FIBERS; i++)
+        lateness[i] = waiters[i].lateness;
+    qsort(lateness, SLEEP_FIBERS, sizeof(long), _long_cmp);
+    // Timed out waiters must be gone from the wait lists: with no waiters
+    // left, posting counts up and unlocking unlocks
+    cfib_sem_post(&timed_sem);
+    cfib_mutex_unlock(&timed_mutex);
+    int unlinked = cfib_sem_trywait(&timed_sem) == 0 && cfib_mutex_trylock(&timed_mutex) == 0;
+    printf("Timed out waits on semaphore, mutex, condition, channel, select, fd and io_uring in %d fibers, up to 10 ms:\n", SLEEP_FIBERS);
+    printf("timed out\t%d (%s)\n", timed_out, timed_out == SLEEP_FIBERS && unlinked ? "all, wait lists empty" : "FAILED");
+    printf("   median\t%ld ns late\n", _get_median(lateness, SLEEP_FIBERS));
+    printf("      max\t%ld ns late\n", lateness[SLEEP_FIBERS - 1]);
+    cfib_mutex_unlock(&timed_mutex);
+    cfib_chan_free(timed_chan);
+    if(sv[0] >= 0) {
+#ifdef _WITH_EPOLL
+        cfib_close(sv[0]);
+#else
+        close(sv[0]);
+#endif
+        close(sv[1]);
+    }
+}
+
+void bench_timers(int n) {
+    struct timespec tp0, tp1;
+    long tt;
+    uint64_t* deadlines = malloc(n * sizeof(uint64_t));
+    cfib_timer_t* timers = calloc(n, sizeof(cfib_timer_t));
+    struct heap_timer* htimers = calloc(n, sizeof(struct heap_timer));
+    struct timer_heap heap = {.items = malloc(n * sizeof(struct heap_timer*)), .count = 0};
+    uint64_t now = cfib_clock_ns();
+    srand(1);
+    for(int i = 0; i < n; i++) {
+        deadlines[i] = now + ((uint64_t)rand() * 4099) % TIMER_SPAN_NS;
+        timers[i].func = func_wheel_timer;
+        htimers[i].deadline = deadlines[i];
+    }
+    cfib_wheel_t* wheel = malloc(sizeof(cfib_wheel_t));
+    cfib_wheel_init(wheel, now);
+    printf("Arming %d timers and cancelling them:\n", n);
+    clock_gettime(CLOCK_MONOTONIC, &tp0);
+    for(int i = 0; i < n; i++)
+        cfib_wheel_add(wheel, &timers[i], deadlines[i]);
+    for(int i = 0; i < n; i++)
+        cfib_wheel_cancel(wheel, &timers[i]);
+    clock_gettime(CLOCK_MONOTONIC, &tp1);
+    tt = _timespec_diff_ns(&tp0, &tp1);
+    printf("timing wheel\t%ld ns per timer\n", tt / n);
+    clock_gettime(CLOCK_MONOTONIC, &tp0);
+    for(int i = 0; i < n; i++)
+        heap_add(&heap, &htimers[i]);
+    for(int i = 0; i < n; i++)
+        heap_cancel(&heap, &htimers[i]);
+    clock_gettime(CLOCK_MONOTONIC, &tp1);
+    tt = _timespec_diff_ns(&tp0, &tp1);
+    printf(" binary heap\t%ld ns per timer\n", tt / n);
+    printf("Arming %d timers and letting them expire, advancing in 1 ms steps:\n", n);
+    clock_gettime(CLOCK_MONOTONIC, &tp0);
+    for(int i = 0; i < n; i++)
+        cfib_wheel_add(wheel, &timers[i], deadlines[i]);
+    for(uint64_t t = now; t <= now + TIMER_SPAN_NS; t += 1000000)
+        cfib_wheel_advance(wheel, t);
+    clock_gettime(CLOCK_MONOTONIC, &tp1);
+    tt = _timespec_diff_ns(&tp0, &tp1);
+    printf("timing wheel\t%ld ns per timer (%zu expired)\n", tt / n, wheel_fired);
+    size_t heap_fired = 0;
+    clock_gettime(CLOCK_MONOTONIC, &tp0);
+    for(int i = 0; i < n; i++)
+        heap_add(&heap, &htimers[i]);
+    for(uint64_t t = now; t <= now + TIMER_SPAN_NS; t += 1000000)
+        heap_fired += heap_advance(&heap, t);
+    clock_gettime(CLOCK_MONOTONIC, &tp1);
+    tt = _timespec_diff_ns(&tp0, &tp1);
+    printf(" binary heap\t%ld ns per timer (%zu expired)\n", tt / n, heap_fired);
+    free(wheel);
+    free(heap.items);
+    free(htimers);
+    free(timers);
+    free(deadlines);
+    long lateness[SLEEP_FIBERS];
+    for(int i = 0; i < SLEEP_FIBERS; i++)
+        cfib_spawn((cfib_func)func_sleeper, &lateness[i], NULL);
+    cfib_sched_run();
+    qsort(lateness, SLEEP_FIBERS, sizeof(long), _long_cmp);
+    printf("Lateness of cfib_sleep_until() in %d fibers sleeping up to 10 ms:\n", SLEEP_FIBERS);
+    printf("median\t%ld ns\n", _get_median(lateness, SLEEP_FIBERS));
+    printf("   max\t%ld ns\n", lateness[SLEEP_FIBERS - 1]);
+    bench_timed_waits();
+}
+
+#define COMPLETION_ROUND 1000
+
+volatile uint64_t task_sink = 0;
+
+void func_short_task(void *arg) {
+    task_sink += (uintptr_t)arg;
+}
+
+void bench_completion(int n) {
+    struct timespec tp0, tp1;
+    long tt;
+    clock_gettime(CLOCK_MONOTONIC, &tp0);
+    for(int i = 0; i < n; i++) {
+        cfib_t* fib = cfib_new(func_short_task, (void*)(uintptr_t)i, NULL);
+        cfib_join(fib);
+        cfib_unmap(fib);
+        free(fib);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &tp1);
+    tt = _timespec_diff_ns(&tp0, &tp1);
+    printf("Short tasks, cfib_new() + cfib_join() + cfib_unmap(), %d times:\n", n);
+    printf("   avg\t%ld ns per task\n", tt / n);
+    cfib_attr_t attr = {.stack_size = CFIB_DEF_STACK_SIZE, .flags = CFIB_AUTO_RECYCLE, .tag = NULL};
+    clock_gettime(CLOCK_MONOTONIC, &tp0);
+    for(int i = 0; i < n; i++)
+        cfib_swap(cfib_new(func_short_task, (void*)(uintptr_t)i, &attr));
+    clock_gettime(CLOCK_MONOTONIC, &tp1);
+    tt = _timespec_diff_ns(&tp0, &tp1);
+    printf("Short tasks, CFIB_AUTO_RECYCLE, %d times:\n", n);
+    printf("   avg\t%ld ns per task\n", tt / n);
+    // In rounds, to stay below the limit of memory mappings per process
+    cfib_pool_set_high_water((size_t)COMPLETION_ROUND * CFIB_DEF_STACK_SIZE);
+    clock_gettime(CLOCK_MONOTONIC, &tp0);
+    for(int i = 0; i < n; i += COMPLETION_ROUND) {
+        for(int j = i; j < n && j < i + COMPLETION_ROUND; j++)
+            cfib_spawn(func_short_task, (void*)(uintptr_t)j, NULL);
+        cfib_sched_run();
+    }
+    clock_gettime(CLOCK_MONOTONIC, &tp1);
+    cfib_pool_set_high_water(0);
+    tt = _timespec_diff_ns(&tp0, &tp1);
+    printf("Short tasks, cfib_spawn() + cfib_sched_run() with stack pool, %d times:\n", n);
+    printf("   avg\t%ld ns per task\n", tt / n);
+}
+
+#define RECLAIM_FIBERS 1000
+#define RECLAIM_STACK_SIZE (256 << 10)
+#define RECLAIM_DEPTH 48
+
+long rss_kb = 0;
+
+long _get_rss_kb() {
+    long size = 0, pages = 0;
+    FILE* f = fopen("/proc/self/statm", "r");
+    if(f == NULL)
+        return -1;
+    if(fscanf(f, "%ld %ld", &size, &pages) != 2)
+        pages = -1;
+    fclose(f);
+    return pages < 0 ? -1 : pages * (sysconf(_SC_PAGE_SIZE) / 1024);
+}
+
+volatile char deep_sink = 0;
+
+void __attribute__((noinline)) _go_deep(int n) {
+    char buf[4096];
+    memset(buf, n, sizeof(buf));
+    // Keep the compiler from eliding the stores
+    __asm__ volatile("" : : "r"(buf) : "memory");
+    if(n > 1)
+        _go_deep(n - 1);
+    deep_sink += buf[n];
+}
+
+void func_deep_then_idle(void *arg) {
+    // One deep request, then idle until the RSS is measured
+    _go_deep(RECLAIM_DEPTH);
+    while(rss_kb == 0)
+        cfib_sleep_ns(1000000);
+}
+
+void func_rss_monitor(void *arg) {
+    cfib_sleep_ns(10000000);
+    rss_kb = _get_rss_kb();
+}
+
+void bench_reclaim() {
+    cfib_attr_t attr = {.stack_size = RECLAIM_STACK_SIZE, .flags = 0, .tag = NULL};
+    long base_kb = _get_rss_kb();
+    printf("RSS of %d idle fibers, which once used %d KiB of their stacks:\n", RECLAIM_FIBERS, RECLAIM_DEPTH * 4);
+    const char* names[] = {"policy off", "MADV_DONTNEED", "MADV_FREE"};
+    for(int policy = 0; policy < 3; policy++) {
+        cfib_reclaim_set_policy(policy > 0 ? 16 << 10 : 0, policy == 2 ? CFIB_RECLAIM_LAZY : 0);
+        size_t reclaimed = cfib_reclaimed_bytes();
+        rss_kb = 0;
+        struct timespec tp0, tp1;
+        for(int i = 0; i < RECLAIM_FIBERS; i++)
+            cfib_spawn(func_deep_then_idle, NULL, &attr);
+        cfib_spawn(func_rss_monitor, NULL, NULL);
+        clock_gettime(CLOCK_MONOTONIC, &tp0);
+        cfib_sched_run();
+        clock_gettime(CLOCK_MONOTONIC, &tp1);
+        printf("%13s\t%ld KiB resident, %zu KiB reclaimed, %ld ns\n", names[policy],
+                rss_kb - base_kb, (cfib_reclaimed_bytes() - reclaimed) >> 10, _timespec_diff_ns(&tp0, &tp1));
+    }
+    cfib_reclaim_set_policy(0, 0);
+}
+
+#ifdef _WITH_C11_ATOMICS
+#define PROF_THREADS 4
+#define PROF_FIBERS 250
+#define PROF_DEPTH 64
+
+void* thread_stack_hogs(void* arg) {
+    cfib_init_thread();
+    cfib_attr_t attr = (cfib_attr_t){.stack_size = 1<<20, .tag = StackHogs};
+    for(int i = 0; i < PROF_FIBERS; i++) {
+        cfib_t* fib = cfib_new((cfib_func)func_stack_hog, (void*)PROF_DEPTH, &attr);
+        cfib_join(fib);
+        cfib_unmap(fib);
+        free(fib);
+    }
+    return NULL;
+}
+
+void bench_prof_faults() {
+    struct timespec tp0, tp1;
+    pthread_t threads[PROF_THREADS];
+    clock_gettime(CLOCK_MONOTONIC, &tp0);
+    for(int i = 0; i < PROF_THREADS; i++)
+        pthread_create(&threads[i], NULL, thread_stack_hogs, NULL);
+    for(int i = 0; i < PROF_THREADS; i++)
+        pthread_join(threads[i], NULL);
+    clock_gettime(CLOCK_MONOTONIC, &tp1);
+    long tt = _timespec_diff_ns(&tp0, &tp1);
+    long pages = (long)PROF_THREADS * PROF_FIBERS * PROF_DEPTH;
+    printf("%d threads x %d fibers growing their stacks by %d pages:\n", PROF_THREADS, PROF_FIBERS, PROF_DEPTH);
+    printf(" total\t%ld ns\n", tt);
+    printf("   avg\t%ld ns per page\n", tt / pages);
+    if(cfib_prof_dump("test_cfib_prof.csv") == 0)
+        printf("Profiler report written to test_cfib_prof.csv\n");
+}
+#endif
+
+#define PAINT_STACK_SIZE (1<<20)
+
+void bench_stack_paint(int n) {
+    struct timespec tp0, tp1;
+    cfib_attr_t attr = (cfib_attr_t){.stack_size = PAINT_STACK_SIZE, .tag = StackHogs};
+    printf("High water marks of painted 1 MiB stacks:\n");
+    printf("depth\tmeasured\tscan ns\n");
+    attr.flags = CFIB_STACK_PAINT;
+    for(uintptr_t depth = 4; depth <= 128; depth *= 2) {
+        cfib_t* fib = cfib_new((cfib_func)func_stack_hog, (void*)depth, &attr);
+        cfib_join(fib);
+        clock_gettime(CLOCK_MONOTONIC, &tp0);
+        size_t hw = cfib_stack_high_water(fib);
+        clock_gettime(CLOCK_MONOTONIC, &tp1);
+        printf("%lu KiB\t%zu KiB\t%ld\n", (unsigned long)depth * 4, hw >> 10, _timespec_diff_ns(&tp0, &tp1) - clock_overhead);
+        cfib_unmap(fib);
+        free(fib);
+    }
+    printf("\ncfib_new() + cfib_unmap() with stack pool, %d times:\n", n);
+    cfib_pool_set_high_water(PAINT_STACK_SIZE * 4);
+    for(int paint = 0; paint < 2; paint++) {
+        attr.flags = paint ? CFIB_STACK_PAINT : 0;
+        clock_gettime(CLOCK_MONOTONIC, &tp0);
+        for(int i = 0; i < n; i++) {
+            cfib_t* fib = cfib_new((cfib_func)func_stack_hog, (void*)2, &attr);
+            cfib_join(fib);
+            cfib_unmap(fib);
+            free(fib);
+        }
+        clock_gettime(CLOCK_MONOTONIC, &tp1);
+        printf("%s\t%ld ns per fiber\n", paint ? "  painted" : "unpainted", _timespec_diff_ns(&tp0, &tp1) / n);
+    }
+    cfib_pool_set_high_water(0);
+    printf("\n");
+    cfib_prof_dump(NULL);
+}
+
+// Each stack and it's guard page are separate mappings, stay well below the
+// default vm.max_map_count
+#define REGISTRY_FIBERS 25000
+
+void bench_find_by_addr(int n) {
+    struct timespec tp0, tp1;
+    cfib_func* funcs = malloc(REGISTRY_FIBERS * sizeof(cfib_func));
+    for(int i = 0; i < REGISTRY_FIBERS; i++)
+        funcs[i] = func_pingpong;
+    cfib_attr_t attr = (cfib_attr_t){.stack_size = 16 << 10, .tag = StackHogs};
+    cfib_t* fibs = cfib_new_batch(REGISTRY_FIBERS, funcs, NULL, &attr);
+    const void** addrs = malloc(n * sizeof(void*));
+    cfib_t** expected = malloc(n * sizeof(cfib_t*));
+    srand(42);
+    for(int i = 0; i < n; i++) {
+        expected[i] = &fibs[rand() % REGISTRY_FIBERS];
+        size_t size = (size_t)(expected[i]->stack_floor - expected[i]->stack_ceiling);
+        addrs[i] = expected[i]->stack_ceiling + rand() % size;
+    }
+    int wrong = 0;
+    clock_gettime(CLOCK_MONOTONIC, &tp0);
+    for(int i = 0; i < n; i++)
+        wrong += cfib_find_by_addr(addrs[i]) != expected[i];
+    clock_gettime(CLOCK_MONOTONIC, &tp1);
+    int found_main = cfib_find_by_addr(&n) != NULL;
+    // The profiled build has no guard pages
+    cfib_t* guard_owner = cfib_find_by_addr(fibs[1].stack_ceiling - 1);
+    printf("cfib_find_by_addr() with %d live fibers, %d lookups:\n", REGISTRY_FIBERS, n);
+    printf(" total\t%ld ns\n", _timespec_diff_ns(&tp0, &tp1));
+    printf("   avg\t%ld ns per lookup\n", _timespec_diff_ns(&tp0, &tp1) / n);
+    printf(" wrong\t%d, thread stack %s\n", wrong, found_main ? "found (WRONG)" : "not found");
+    printf(" guard\t%s\n", guard_owner == &fibs[1] ? "found" : guard_owner == NULL ? "not found" : "found (WRONG)");
+    printf("   tag\t%s\n", cfib_get_tag_name(expected[0]));
+    cfib_unmap_batch(fibs, REGISTRY_FIBERS);
+    printf(" after unmap: %s\n", cfib_find_by_addr(addrs[1]) != NULL ? "found (WRONG)" : "not found");
+    free(expected);
+    free(addrs);
+    free(funcs);
+}
+
+#define PROFILE_FIBERS 1000
+#define PROFILE_DEPTH 8
+
+void bench_stack_profile() {
+    struct timespec tp0, tp1;
+    cfib_attr_t attr = (cfib_attr_t){.stack_size = 1<<20, .flags = CFIB_STACK_PAINT, .tag = Workers};
+    // Measure, with painted stacks or in the profiled build
+    for(int i = 0; i < 10; i++) {
+        cfib_t* fib = cfib_new((cfib_func)func_stack_hog, (void*)PROFILE_DEPTH, &attr);
+        cfib_join(fib);
+        cfib_unmap(fib);
+        free(fib);
+    }
+    if(cfib_stack_profile_save("test_cfib_stacks.prof", 25) != 0 || cfib_stack_profile_load("test_cfib_stacks.prof") < 0) {
+        printf("Stack profiles not supported\n");
+        return;
+    }
+    char line[256];
+    FILE* prof = fopen("test_cfib_stacks.prof", "r");
+    printf("Stack profile written to test_cfib_stacks.prof:\n");
+    while(fgets(line, sizeof(line), prof) != NULL)
+        printf("  %s", line);
+    fclose(prof);
+    attr.flags = 0;
+    cfib_t** fibs = malloc(PROFILE_FIBERS * sizeof(cfib_t*));
+    size_t mapped = 0;
+    clock_gettime(CLOCK_MONOTONIC, &tp0);
+    for(int i = 0; i < PROFILE_FIBERS; i++) {
+        fibs[i] = cfib_new((cfib_func)func_stack_hog, (void*)PROFILE_DEPTH, &attr);
+        mapped += (size_t)(fibs[i]->stack_floor - fibs[i]->stack_ceiling);
+    }
+    for(int i = 0; i < PROFILE_FIBERS; i++)
+        cfib_join(fibs[i]);
+    clock_gettime(CLOCK_MONOTONIC, &tp1);
+    printf("\n%d fibers asking for 1 MiB stacks:\n", PROFILE_FIBERS);
+    printf("stack\t%zu KiB\n", (mapped / PROFILE_FIBERS) >> 10);
+    printf("total\t%zu KiB mapped, %ld ns\n", mapped >> 10, _timespec_diff_ns(&tp0, &tp1));
+    for(int i = 0; i < PROFILE_FIBERS; i++) {
+        cfib_unmap(fibs[i]);
+        free(fibs[i]);
+    }
+    free(fibs);
+}
+
+// The worker does a little work on every turn, so that the running times of
+// both sides show up in the switch statistics
+void func_busy_pingpong(void *arg) {
+    volatile unsigned long sink = 0;
+    while(1) {
+        for(int i = 0; i < 100; i++)
+            sink += i;
+        cfib_swap((cfib_t*)arg);
+    }
+}
+
+void bench_swap_stats(int n) {
+    struct timespec tp0, tp1;
+    cfib_stats_t st_main, st_worker;
+    cfib_t* worker = cfib_new((cfib_func)func_busy_pingpong, (void*)fib_main, NULL);
+    cfib_t* pingpong = cfib_new((cfib_func)func_pingpong, (void*)fib_main, NULL);
+    clock_gettime(CLOCK_MONOTONIC, &tp0);
+    for(int i = 0; i < n; i++)
+        cfib_swap(pingpong);
+    clock_gettime(CLOCK_MONOTONIC, &tp1);
+    long dt = _timespec_diff_ns(&tp0, &tp1);
+    printf("Round trips across cfib_swap(), %d times:\n", n);
+    printf("  mean\t%.1f ns per swap\n", (double)dt / (2.0 * n));
+    for(int i = 0; i < n; i++)
+        cfib_swap(worker);
+    if(cfib_stats(fib_main, &st_main) != 0 || cfib_stats(worker, &st_worker) != 0) {
+        printf("No switch statistics, the library is not the instrumented build.\n");
+        printf("Compare the above and benchmarks 1 and 2 with test_cfib_instrumented.\n");
+        return;
+    }
+    printf("Switch statistics after %d more round trips into a busy worker:\n", n);
+    printf("%-8s %12s %16s %14s\n", "fiber", "swaps", "run ticks", "ticks/swap");
+    printf("%-8s %12llu %16llu %14.1f\n", "main", st_main.num_swaps, st_main.run_ticks,
+        (double)st_main.run_ticks / st_main.num_swaps);
+    printf("%-8s %12llu %16llu %14.1f\n", "worker", st_worker.num_swaps, st_worker.run_ticks,
+        (double)st_worker.run_ticks / st_worker.num_swaps);
+}
+
+/* Benchmark suite.
+ *
+ * Timing each swap with clock_gettime() measures mostly the clock, so the
+ * suite times batches of round trips with the TSC and reports the median
+ * batch. The results are also written as CSV or JSON, so that they can be
+ * compared across releases.
+ */
+
+#define SUITE_BATCHES 200
+#define SUITE_BATCH 500
+#define SUITE_MAX_RESULTS 64
+
+struct suite_result {
+    const char* name;
+    long param;
+    double value;
+    const char* unit;
+};
+
+struct suite_result suite_results[SUITE_MAX_RESULTS];
+int suite_num_results = 0;
+double suite_ticks_per_ns = 1.0;
+
+void _suite_add(const char* name, long param, double value, const char* unit) {
+    if(suite_num_results < SUITE_MAX_RESULTS)
+        suite_results[suite_num_results++] = (struct suite_result){name, param, value, unit};
+    printf("%-16s %8ld %14.2f %s\n", name, param, value, unit);
+}
+
+// The TSC is read in order with the code around it: lfence before rdtsc
+// keeps earlier instructions from leaking into the batch, rdtscp waits for
+// the batch to finish.
+static inline uint64_t _suite_ticks_begin() {
+#ifdef __x86_64__
+    _mm_lfence();
+    return __rdtsc();
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+#endif
+}
+
+static inline uint64_t _suite_ticks_end() {
+#ifdef __x86_64__
+    unsigned aux;
+    uint64_t t = __rdtscp(&aux);
+    _mm_lfence();
+    return t;
+#else
+    return _suite_ticks_begin();
+#endif
+}
+
+void _suite_calibrate() {
+    struct timespec tp0, tp1;
+    clock_gettime(CLOCK_MONOTONIC, &tp0);
+    uint64_t t0 = _suite_ticks_begin();
+    do {
+        clock_gettime(CLOCK_MONOTONIC, &tp1);
+    } while(_timespec_diff_ns(&tp0, &tp1) < 50000000L);
+    uint64_t t1 = _suite_ticks_end();
+    suite_ticks_per_ns = (double)(t1 - t0) / _timespec_diff_ns(&tp0, &tp1);
+    _suite_add("tsc", 0, suite_ticks_per_ns, "ticks/ns");
+}
+
+// Median ticks of a swap, over batches of round trips from the calling
+// fiber into the fibers, taken in turn
+double _suite_swap_ticks(cfib_t** fibs, int num_fibs) {
+    long* batches = malloc(SUITE_BATCHES * sizeof(long));
+    int next = 0;
+    for(int b = 0; b < SUITE_BATCHES; b++) {
+        uint64_t t0 = _suite_ticks_begin();
+        for(int i = 0; i < SUITE_BATCH; i++) {
+            cfib_swap__noassert__(fibs[next]);
+            if(++next == num_fibs)
+                next = 0;
+        }
+        batches[b] = (long)(_suite_ticks_end() - t0);
+    }
+    qsort(batches, SUITE_BATCHES, sizeof(long), _long_cmp);
+    double ret = (double)_get_median(batches, SUITE_BATCHES) / (2.0 * SUITE_BATCH);
+    free(batches);
+    return ret;
+}
+
+void _suite_swap_latency() {
+    cfib_t* fib = cfib_new((cfib_func)func_pingpong__noassert__, (void*)fib_main, NULL);
+    double ticks = _suite_swap_ticks(&fib, 1);
+    _suite_add("swap", 1, ticks, "ticks");
+    _suite_add("swap", 1, ticks / suite_ticks_per_ns, "ns");
+    cfib_unmap(fib);
+    free(fib);
+}
+
+void _suite_live_fibers() {
+    static const int counts[] = {1, 16, 256, 4096, 16384};
+    cfib_attr_t attr = {.stack_size = 16384};
+    for(size_t c = 0; c < sizeof(counts) / sizeof(counts[0]); c++) {
+        int n = counts[c];
+        cfib_t** fibs = malloc(n * sizeof(cfib_t*));
+        for(int i = 0; i < n; i++)
+            fibs[i] = cfib_new((cfib_func)func_pingpong__noassert__, (void*)fib_main, &attr);
+        // Fault the stacks in before timing
+        for(int i = 0; i < n; i++)
+            cfib_swap__noassert__(fibs[i]);
+        _suite_add("swap_live", n, _suite_swap_ticks(fibs, n) / suite_ticks_per_ns, "ns");
+        for(int i = 0; i < n; i++) {
+            cfib_unmap(fibs[i]);
+            free(fibs[i]);
+        }
+        free(fibs);
+    }
+}
+
+void _suite_create_destroy(int n) {
+    struct timespec tp0, tp1;
+    for(int pooled = 0; pooled < 2; pooled++) {
+        cfib_pool_set_high_water(pooled ? CFIB_DEF_STACK_SIZE * 16 : 0);
+        clock_gettime(CLOCK_MONOTONIC, &tp0);
+        for(int i = 0; i < n; i++) {
+            cfib_t* fib = cfib_new((cfib_func)test_return, NULL, NULL);
+            cfib_swap(fib);
+            cfib_unmap(fib);
+            free(fib);
+        }
+        clock_gettime(CLOCK_MONOTONIC, &tp1);
+        _suite_add(pooled ? "create_pooled" : "create", n, n * 1e9 / _timespec_diff_ns(&tp0, &tp1), "fibers/s");
+    }
+    cfib_pool_set_high_water(0);
+}
+
+#ifdef _WITH_C11_ATOMICS
+struct suite_thread {
+    pthread_barrier_t* barrier;
+    int n;
+};
+
+void* _suite_thread(void* arg) {
+    struct suite_thread* st = (struct suite_thread*)arg;
+    cfib_t* self = cfib_init_thread();
+    cfib_t* fib = cfib_new((cfib_func)func_pingpong__noassert__, (void*)self, NULL);
+    pthread_barrier_wait(st->barrier);
+    for(int i = 0; i < st->n; i++)
+        cfib_swap__noassert__(fib);
+    cfib_unmap(fib);
+    free(fib);
+    return NULL;
+}
+
+void _suite_threads(int n) {
+    long num_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    for(long t = 1; t <= 2 * num_cpus && t <= 64; t *= 2) {
+        struct timespec tp0, tp1;
+        pthread_t threads[64];
+        pthread_barrier_t barrier;
+        pthread_barrier_init(&barrier, NULL, (unsigned)t + 1);
+        struct suite_thread st = {&barrier, n};
+        for(long i = 0; i < t; i++)
+            pthread_create(&threads[i], NULL, _suite_thread, &st);
+        pthread_barrier_wait(&barrier);
+        clock_gettime(CLOCK_MONOTONIC, &tp0);
+        for(long i = 0; i < t; i++)
+            pthread_join(threads[i], NULL);
+        clock_gettime(CLOCK_MONOTONIC, &tp1);
+        pthread_barrier_destroy(&barrier);
+        _suite_add("swap_threads", t, 2.0 * n * t * 1e3 / _timespec_diff_ns(&tp0, &tp1), "Mswaps/s");
+    }
+}
+#endif
+
+ucontext_t suite_uctx_main, suite_uctx_fib;
+
+void _suite_uctx_pingpong() {
+    while(1)
+        swapcontext(&suite_uctx_fib, &suite_uctx_main);
+}
+
+void _suite_ucontext() {
+    size_t stack_size = CFIB_DEF_STACK_SIZE;
+    void* stack = mmap(0, stack_size, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANON, -1, 0);
+    getcontext(&suite_uctx_fib);
+    suite_uctx_fib.uc_stack.ss_sp = stack;
+    suite_uctx_fib.uc_stack.ss_size = stack_size;
+    suite_uctx_fib.uc_link = NULL;
+    makecontext(&suite_uctx_fib, _suite_uctx_pingpong, 0);
+    long* batches = malloc(SUITE_BATCHES * sizeof(long));
+    for(int b = 0; b < SUITE_BATCHES; b++) {
+        uint64_t t0 = _suite_ticks_begin();
+        for(int i = 0; i < SUITE_BATCH; i++)
+            swapcontext(&suite_uctx_main, &suite_uctx_fib);
+        batches[b] = (long)(_suite_ticks_end() - t0);
+    }
+    qsort(batches, SUITE_BATCHES, sizeof(long), _long_cmp);
+    double ticks = (double)_get_median(batches, SUITE_BATCHES) / (2.0 * SUITE_BATCH);
+    _suite_add("swapcontext", 1, ticks / suite_ticks_per_ns, "ns");
+    free(batches);
+    munmap(stack, stack_size);
+}
+
+// Writes the results as CSV if path ends with ".csv", as JSON otherwise
+int _suite_write(const char* path) {
+    FILE* f = fopen(path, "w");
+    if(f == NULL) {
+        perror(path);
+        return -1;
+    }
+    size_t len = strlen(path);
+    if(len >= 4 && strcmp(path + len - 4, ".csv") == 0) {
+        fprintf(f, "benchmark,param,value,unit\n");
+        for(int i = 0; i < suite_num_results; i++)
+            fprintf(f, "%s,%ld,%.3f,%s\n", suite_results[i].name, suite_results[i].param, suite_results[i].value, suite_results[i].unit);
+    } else {
+        fprintf(f, "{\n  \"benchmarks\": [\n");
+        for(int i = 0; i < suite_num_results; i++)
+            fprintf(f, "    {\"benchmark\": \"%s\", \"param\": %ld, \"value\": %.3f, \"unit\": \"%s\"}%s\n", suite_results[i].name, suite_results[i].param, suite_results[i].value, suite_results[i].unit, i + 1 < suite_num_results ? "," : "");
+        fprintf(f, "  ]\n}\n");
+    }
+    fclose(f);
+    return 0;
+}
+
+void bench_suite(const char* path) {
+    printf("%-16s %8s %14s %s\n", "benchmark", "param", "value", "unit");
+    _suite_calibrate();
+    _suite_swap_latency();
+    _suite_ucontext();
+    _suite_live_fibers();
+    _suite_create_destroy(NUM_SAMPLES / 10);
+#ifdef _WITH_C11_ATOMICS
+    _suite_threads(NUM_SAMPLES * 10);
+#endif
+    if(path != NULL && _suite_write(path) == 0)
+        printf("Results written to %s\n", path);
+}
+
+// Echoes every value it gets back to the sender, plus one
+void func_transfer_echo(void* args, void* data) {
+    cfib_transfer_t t = {data, (cfib_t*)args};
+    while(1)
+        t = cfib_transfer(t.from, (void*)((uintptr_t)t.data + 1));
+}
+
+volatile uintptr_t echo_slot;
+
+void func_slot_echo(void* arg) {
+    while(1) {
+        echo_slot++;
+        cfib_swap((cfib_t*)arg);
+    }
+}
+
+void* _release_fiber(void* data, cfib_t* from) {
+    cfib_unmap(from);
+    free(from);
+    return data;
+}
+
+// Releases it's own stack on top of the fiber which started it
+void func_self_release(void* args, void* data) {
+    cfib_transfer_ontop((cfib_t*)args, data, _release_fiber);
+}
+
+void bench_transfer(int n) {
+    struct timespec tp0, tp1;
+    _suite_calibrate();
+    cfib_t* echo = cfib_new((cfib_func)func_transfer_echo, (void*)fib_main, NULL);
+    cfib_t* slot = cfib_new((cfib_func)func_slot_echo, (void*)fib_main, NULL);
+    uintptr_t errors = 0;
+    uint64_t t0 = _suite_ticks_begin();
+    for(int i = 0; i < n; i++) {
+        cfib_transfer_t t = cfib_transfer(echo, (void*)(uintptr_t)i);
+        errors += (uintptr_t)t.data != (uintptr_t)i + 1 || t.from != echo;
+    }
+    uint64_t t1 = _suite_ticks_end();
+    printf("cfib_transfer() round trips, %d times, %lu wrong values:\n", n, (unsigned long)errors);
+    printf("   avg\t%.1f ns per swap\n", (t1 - t0) / suite_ticks_per_ns / (2.0 * n));
+    errors = 0;
+    t0 = _suite_ticks_begin();
+    for(int i = 0; i < n; i++) {
+        echo_slot = i;
+        cfib_swap(slot);
+        errors += echo_slot != (uintptr_t)i + 1;
+    }
+    t1 = _suite_ticks_end();
+    printf("cfib_swap() round trips with a shared slot, %d times, %lu wrong values:\n", n, (unsigned long)errors);
+    printf("   avg\t%.1f ns per swap\n", (t1 - t0) / suite_ticks_per_ns / (2.0 * n));
+    cfib_unmap(echo);
+    free(echo);
+    cfib_unmap(slot);
+    free(slot);
+
+    cfib_pool_set_high_water(CFIB_DEF_STACK_SIZE * 16);
+    clock_gettime(CLOCK_MONOTONIC, &tp0);
+    for(int i = 0; i < n / 10; i++) {
+        cfib_t* fib = cfib_new((cfib_func)func_self_release, (void*)fib_main, NULL);
+        cfib_transfer(fib, NULL);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &tp1);
+    printf("Fibers releasing their own stack via cfib_transfer_ontop(), %d times:\n", n / 10);
+    printf("   avg\t%ld ns\n", _timespec_diff_ns(&tp0, &tp1) / (n / 10));
+    clock_gettime(CLOCK_MONOTONIC, &tp0);
+    for(int i = 0; i < n / 10; i++) {
+        cfib_t* fib = cfib_new((cfib_func)test_return, NULL, NULL);
+        cfib_swap(fib);
+        cfib_unmap(fib);
+        free(fib);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &tp1);
+    cfib_pool_set_high_water(0);
+    printf("Fibers returning and released by the caller, %d times:\n", n / 10);
+    printf("   avg\t%ld ns\n", _timespec_diff_ns(&tp0, &tp1) / (n / 10));
+}
+
+// The fiber and the main fiber it swaps back to, for swaps which do not
+// look up the current fiber
+cfib_t* tls_free_pair[2];
+
+void func_pingpong_from(void* arg) {
+    while(1)
+        cfib_swap_from(tls_free_pair[0], tls_free_pair[1]);
+}
+
+void func_transfer_from(void* args, void* data) {
+    cfib_transfer_t t = {data, (cfib_t*)args};
+    while(1)
+        t = cfib_transfer_from(tls_free_pair[0], t.from, t.data);
+}
+
+void bench_swap_tls(int n) {
+    _suite_calibrate();
+    cfib_t* fib = cfib_new((cfib_func)func_pingpong__noassert__, (void*)fib_main, NULL);
+    printf("Mean of the median batch of %d round trips, in ns per swap:\n", SUITE_BATCH);
+    printf("   cfib_swap__noassert__()\t%.1f\n", _suite_swap_ticks(&fib, 1) / suite_ticks_per_ns);
+    cfib_unmap(fib);
+    free(fib);
+
+    fib = cfib_new((cfib_func)func_pingpong_from, NULL, NULL);
+    tls_free_pair[0] = fib;
+    tls_free_pair[1] = fib_main;
+    long* batches = malloc(SUITE_BATCHES * sizeof(long));
+    for(int b = 0; b < SUITE_BATCHES; b++) {
+        uint64_t t0 = _suite_ticks_begin();
+        for(int i = 0; i < SUITE_BATCH; i++)
+            cfib_swap_from(fib_main, fib);
+        batches[b] = (long)(_suite_ticks_end() - t0);
+    }
+    qsort(batches, SUITE_BATCHES, sizeof(long), _long_cmp);
+    printf("   cfib_swap_from()\t\t%.1f\n", _get_median(batches, SUITE_BATCHES) / suite_ticks_per_ns / (2.0 * SUITE_BATCH));
+    cfib_unmap(fib);
+    free(fib);
+
+    fib = cfib_new((cfib_func)func_transfer_from, (void*)fib_main, NULL);
+    tls_free_pair[0] = fib;
+    for(int b = 0; b < SUITE_BATCHES; b++) {
+        uint64_t t0 = _suite_ticks_begin();
+        for(int i = 0; i < SUITE_BATCH; i++)
+            cfib_transfer_from(fib_main, fib, (void*)(uintptr_t)i);
+        batches[b] = (long)(_suite_ticks_end() - t0);
+    }
+    qsort(batches, SUITE_BATCHES, sizeof(long), _long_cmp);
+    printf("   cfib_transfer_from()\t\t%.1f\n", _get_median(batches, SUITE_BATCHES) / suite_ticks_per_ns / (2.0 * SUITE_BATCH));
+    cfib_unmap(fib);
+    free(fib);
+    free(batches);
+
+    // The scheduler swaps inside the library, where the TLS model matters
+    bench_yield(n);
+}
+
+struct spawn_args {
+    uint64_t a, b, c, d;
+};
+
+volatile uint64_t spawn_sink;
+
+void func_spawn_malloced(void* arg) {
+    struct spawn_args* args = (struct spawn_args*)arg;
+    spawn_sink += args->a + args->b + args->c + args->d;
+    free(args);
+}
+
+void func_spawn_reserved(void* arg) {
+    struct spawn_args* args = (struct spawn_args*)arg;
+    spawn_sink += args->a + args->b + args->c + args->d;
+}
+
+void bench_new_reserve(int n) {
+    struct timespec tp0, tp1;
+    cfib_pool_set_high_water(CFIB_DEF_STACK_SIZE * 16);
+    clock_gettime(CLOCK_MONOTONIC, &tp0);
+    for(int i = 0; i < n; i++) {
+        struct spawn_args* args = malloc(sizeof(struct spawn_args));
+        *args = (struct spawn_args){i, 1, 2, 3};
+        cfib_t* fib = cfib_new(func_spawn_malloced, args, NULL);
+        cfib_swap(fib);
+        cfib_unmap(fib);
+        free(fib);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &tp1);
+    printf("cfib_new() with malloc()ed arguments, run and unmapped, %d times:\n", n);
+    printf("   avg\t%ld ns\n", _timespec_diff_ns(&tp0, &tp1) / n);
+    clock_gettime(CLOCK_MONOTONIC, &tp0);
+    for(int i = 0; i < n; i++) {
+        void* reserved;
+        cfib_t* fib = cfib_new_reserve(func_spawn_reserved, sizeof(struct spawn_args), &reserved, NULL);
+        *(struct spawn_args*)reserved = (struct spawn_args){i, 1, 2, 3};
+        cfib_swap(fib);
+        cfib_unmap(fib);
+        free(fib);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &tp1);
+    cfib_pool_set_high_water(0);
+    printf("cfib_new_reserve() with arguments on the stack, run and unmapped, %d times:\n", n);
+    printf("   avg\t%ld ns\n", _timespec_diff_ns(&tp0, &tp1) / n);
+}
+
+#define PIPE_ITEMS 1000000
+
+struct pipe_rec {
+    uint32_t seq;
+    uint32_t sum;
+    unsigned char data[56];
+};
+
+// The stages of the pipeline, each pulling from the previous one and
+// forwarding the buffer of the source
+void stage_source(cfib_gen_t* input, void* args) {
+    struct pipe_rec rec;
+    for(uint32_t i = 0; i < (uintptr_t)args; i++) {
+        rec.seq = i;
+        memset(rec.data, (int)i, sizeof(rec.data));
+        cfib_gen_yield(&rec);
+    }
+}
+
+static inline void _pipe_decode(struct pipe_rec* rec) {
+    for(size_t i = 0; i < sizeof(rec->data); i++)
+        rec->data[i] ^= 0x5a;
+}
+
+static inline void _pipe_checksum(struct pipe_rec* rec) {
+    uint32_t sum = 0;
+    for(size_t i = 0; i < sizeof(rec->data); i++)
+        sum = sum * 31 + rec->data[i];
+    rec->sum = sum;
+}
+
+void stage_decode(cfib_gen_t* input, void* args) {
+    struct pipe_rec* rec;
+    while((rec = cfib_gen_next(input)) != NULL) {
+        _pipe_decode(rec);
+        cfib_gen_yield(rec);
+    }
+}
+
+void stage_checksum(cfib_gen_t* input, void* args) {
+    struct pipe_rec* rec;
+    while((rec = cfib_gen_next(input)) != NULL) {
+        _pipe_checksum(rec);
+        cfib_gen_yield(rec);
+    }
+}
+
+void stage_filter(cfib_gen_t* input, void* args) {
+    struct pipe_rec* rec;
+    while((rec = cfib_gen_next(input)) != NULL) {
+        if(rec->seq % 4 != 0)
+            cfib_gen_yield(rec);
+    }
+}
+
+// The same stages as callbacks, each calling the next one
+struct pipe_cb {
+    void (*fn)(struct pipe_rec*, struct pipe_cb*);
+    struct pipe_cb* next;
+    uint64_t total;
+};
+
+void cb_decode(struct pipe_rec* rec, struct pipe_cb* self) {
+    _pipe_decode(rec);
+    self->next->fn(rec, self->next);
+}
+
+void cb_checksum(struct pipe_rec* rec, struct pipe_cb* self) {
+    _pipe_checksum(rec);
+    self->next->fn(rec, self->next);
+}
+
+void cb_filter(struct pipe_rec* rec, struct pipe_cb* self) {
+    if(rec->seq % 4 != 0)
+        self->next->fn(rec, self->next);
+}
+
+void cb_sink(struct pipe_rec* rec, struct pipe_cb* self) {
+    self->total += rec->sum;
+}
+
+void cb_source(uint32_t n, struct pipe_cb* next) {
+    struct pipe_rec rec;
+    for(uint32_t i = 0; i < n; i++) {
+        rec.seq = i;
+        memset(rec.data, (int)i, sizeof(rec.data));
+        next->fn(&rec, next);
+    }
+}
+
+void bench_pipeline() {
+    struct timespec tp0, tp1;
+    const cfib_gen_func stages[4] = {stage_source, stage_decode, stage_checksum, stage_filter};
+    void* const args[4] = {(void*)(uintptr_t)PIPE_ITEMS, NULL, NULL, NULL};
+    clock_gettime(CLOCK_MONOTONIC, &tp0);
+    cfib_gen_t* pipe = cfib_pipeline_new(4, stages, args, NULL, NULL);
+    struct pipe_rec* rec;
+    uint64_t total = 0, items = 0;
+    while((rec = cfib_gen_next(pipe)) != NULL) {
+        total += rec->sum;
+        items++;
+    }
+    cfib_pipeline_free(pipe, 4);
+    clock_gettime(CLOCK_MONOTONIC, &tp1);
+    long tt = _timespec_diff_ns(&tp0, &tp1);
+    printf("4-stage generator pipeline, %d items in, %lu out, checksum %lu:\n", PIPE_ITEMS, (unsigned long)items, (unsigned long)total);
+    printf("   avg\t%.1f ns per item\n", (double)tt / PIPE_ITEMS);
+    printf(" total\t%ld ns\n", tt);
+
+    struct pipe_cb sink = {cb_sink, NULL, 0};
+    struct pipe_cb filter = {cb_filter, &sink, 0};
+    struct pipe_cb checksum = {cb_checksum, &filter, 0};
+    struct pipe_cb decode = {cb_decode, &checksum, 0};
+    clock_gettime(CLOCK_MONOTONIC, &tp0);
+    cb_source(PIPE_ITEMS, &decode);
+    clock_gettime(CLOCK_MONOTONIC, &tp1);
+    tt = _timespec_diff_ns(&tp0, &tp1);
+    printf("4-stage callback pipeline, %d items in, checksum %lu:\n", PIPE_ITEMS, (unsigned long)sink.total);
+    printf("   avg\t%.1f ns per item\n", (double)tt / PIPE_ITEMS);
+    printf(" total\t%ld ns\n", tt);
+}
+
+#define FLS_FIBERS 1000
+#define FLS_BUCKETS 4096
+
+int fls_destroyed = 0;
+cfib_key_t fls_key;
+
+void _fls_destructor(void* value) {
+    fls_destroyed++;
+    free(value);
+}
+
+void func_fls_user(void* arg) {
+    cfib_setspecific(fls_key, calloc(1, 64));
+    cfib_swap(fib_main);
+}
+
+// The alternative to fiber-local storage: a hash map keyed on the fiber
+struct fls_entry {
+    cfib_t* fib;
+    void* value;
+};
+
+struct fls_entry fls_map[FLS_BUCKETS];
+
+static inline size_t _fls_hash(cfib_t* fib) {
+    return (size_t)(((uintptr_t)fib * 0x9E3779B97F4A7C15ULL) >> 52) & (FLS_BUCKETS - 1);
+}
+
+void* _fls_map_get(cfib_t* fib) {
+    for(size_t i = _fls_hash(fib); fls_map[i].fib != NULL; i = (i + 1) & (FLS_BUCKETS - 1))
+        if(fls_map[i].fib == fib)
+            return fls_map[i].value;
+    return NULL;
+}
+
+void _fls_map_set(cfib_t* fib, void* value) {
+    size_t i = _fls_hash(fib);
+    while(fls_map[i].fib != NULL && fls_map[i].fib != fib)
+        i = (i + 1) & (FLS_BUCKETS - 1);
+    fls_map[i] = (struct fls_entry){fib, value};
+}
+
+volatile uintptr_t fls_sink;
+
+void func_fls_lookup(void* arg) {
+    int n = (int)(uintptr_t)arg;
+    struct timespec tp0, tp1;
+    cfib_setspecific(fls_key, NULL);
+    clock_gettime(CLOCK_MONOTONIC, &tp0);
+    for(int i = 0; i < n; i++)
+        fls_sink += (uintptr_t)cfib_getspecific(fls_key);
+    clock_gettime(CLOCK_MONOTONIC, &tp1);
+    printf("cfib_getspecific(), %d times:\n", n);
+    printf("   avg\t%.2f ns\n", (double)_timespec_diff_ns(&tp0, &tp1) / n);
+    clock_gettime(CLOCK_MONOTONIC, &tp0);
+    for(int i = 0; i < n; i++)
+        fls_sink += (uintptr_t)_fls_map_get(cfib_get_current());
+    clock_gettime(CLOCK_MONOTONIC, &tp1);
+    printf("Hash map lookup keyed on cfib_get_current(), %d times:\n", n);
+    printf("   avg\t%.2f ns\n", (double)_timespec_diff_ns(&tp0, &tp1) / n);
+}
+
+void bench_fls(int n) {
+    cfib_key_create(&fls_key, _fls_destructor);
+    cfib_t* fibs[FLS_FIBERS];
+    for(int i = 0; i < FLS_FIBERS; i++) {
+        fibs[i] = cfib_new(func_fls_user, NULL, NULL);
+        cfib_swap(fibs[i]);
+    }
+    // Half of them finish, and half are unmapped before they finish
+    for(int i = 0; i < FLS_FIBERS; i += 2)
+        cfib_swap(fibs[i]);
+    int at_completion = fls_destroyed;
+    for(int i = 0; i < FLS_FIBERS; i++) {
+        cfib_unmap(fibs[i]);
+        free(fibs[i]);
+    }
+    printf("Fiber-local values of %d fibers destroyed: %d at completion, %d in cfib_unmap()\n\n", FLS_FIBERS, at_completion, fls_destroyed - at_completion);
+
+    // Fill the map with other fibers, so that lookups have company
+    for(uintptr_t i = 1; i < FLS_FIBERS; i++)
+        _fls_map_set((cfib_t*)(i * 4096), (void*)i);
+    cfib_t* fib = cfib_new(func_fls_lookup, (void*)(uintptr_t)n, NULL);
+    _fls_map_set(fib, (void*)1);
+    cfib_join(fib);
+    cfib_unmap(fib);
+    free(fib);
+    cfib_key_delete(fls_key);
+}
+
+#define PLACEMENT_FIBERS 4096
+
+long _get_anon_huge_kb() {
+    char line[128];
+    long kb = -1;
+    FILE* f = fopen("/proc/self/smaps_rollup", "r");
+    if(f == NULL)
+        return -1;
+    while(fgets(line, sizeof(line), f) != NULL) {
+        if(sscanf(line, "AnonHugePages: %ld kB", &kb) == 1)
+            break;
+    }
+    fclose(f);
+    return kb;
+}
+
+// Median swap latency with 'n' live fibers on stacks placed as 'flags' asks
+void _placement_swap_live(int n, unsigned stack_size, unsigned flags, const char* name) {
+    cfib_attr_t attr = {.stack_size = stack_size, .flags = flags};
+    cfib_t** fibs = malloc(n * sizeof(cfib_t*));
+    long huge_kb = _get_anon_huge_kb();
+    for(int i = 0; i < n; i++)
+        fibs[i] = cfib_new((cfib_func)func_pingpong__noassert__, (void*)fib_main, &attr);
+    // Fault the stacks in before timing
+    for(int i = 0; i < n; i++)
+        cfib_swap__noassert__(fibs[i]);
+    huge_kb = _get_anon_huge_kb() - huge_kb;
+    printf("   %-36s %8.1f ns %10ld kB in huge pages\n", name, _suite_swap_ticks(fibs, n) / suite_ticks_per_ns, huge_kb);
+    for(int i = 0; i < n; i++) {
+        cfib_unmap(fibs[i]);
+        free(fibs[i]);
+    }
+    free(fibs);
+}
+
+// Same as above, but the stacks are carved out of one cfib_new_batch()
+void _placement_swap_batch(int n, unsigned stack_size, unsigned flags, const char* name) {
+    cfib_attr_t attr = {.stack_size = stack_size, .flags = flags};
+    cfib_func* funcs = malloc(n * sizeof(cfib_func));
+    void** args = malloc(n * sizeof(void*));
+    cfib_t** fibs = malloc(n * sizeof(cfib_t*));
+    for(int i = 0; i < n; i++) {
+        funcs[i] = (cfib_func)func_pingpong__noassert__;
+        args[i] = (void*)fib_main;
+    }
+    long huge_kb = _get_anon_huge_kb();
+    cfib_t* batch = cfib_new_batch(n, funcs, args, &attr);
+    for(int i = 0; i < n; i++) {
+        fibs[i] = &batch[i];
+        cfib_swap__noassert__(fibs[i]);
+    }
+    huge_kb = _get_anon_huge_kb() - huge_kb;
+    printf("   %-36s %8.1f ns %10ld kB in huge pages\n", name, _suite_swap_ticks(fibs, n) / suite_ticks_per_ns, huge_kb);
+    cfib_unmap_batch(batch, n);
+    free(fibs);
+    free(args);
+    free(funcs);
+}
+
+void bench_stack_placement() {
+    static const struct {
+        const char* name;
+        unsigned flags;
+    } modes[] = {
+        {"default", 0},
+        {"CFIB_HUGEPAGE", CFIB_HUGEPAGE},
+        {"CFIB_NUMA_LOCAL", CFIB_NUMA_LOCAL},
+        {"CFIB_HUGEPAGE|CFIB_NUMA_LOCAL", CFIB_HUGEPAGE|CFIB_NUMA_LOCAL}
+    };
+    const int num_modes = sizeof(modes) / sizeof(modes[0]);
+    _suite_calibrate();
+    printf("\nSwap latency (median) with %d live fibers, 16 kB stacks by cfib_new_batch():\n", PLACEMENT_FIBERS);
+    for(int m = 0; m < num_modes; m++)
+        _placement_swap_batch(PLACEMENT_FIBERS, 16384, modes[m].flags, modes[m].name);
+    printf("Swap latency (median) with %d live fibers, 16 kB stacks by cfib_new():\n", PLACEMENT_FIBERS);
+    for(int m = 0; m < num_modes; m++)
+        _placement_swap_live(PLACEMENT_FIBERS, 16384, modes[m].flags, modes[m].name);
+    printf("Swap latency (median) with %d live fibers, 2 MB stacks by cfib_new():\n", PLACEMENT_FIBERS / 64);
+    for(int m = 0; m < num_modes; m++)
+        _placement_swap_live(PLACEMENT_FIBERS / 64, 1 << 21, modes[m].flags, modes[m].name);
+}
+
+#define ONSTACK_FIBERS 100000
+#define ONSTACK_ROUNDS 10
+
+// Opens a counter of user space events of this thread, or returns -1 where
+// there is none, e.g. in a virtual machine
+int _perf_open(unsigned type, unsigned long long config) {
+#ifdef __linux__
+    struct perf_event_attr pe;
+    memset(&pe, 0, sizeof(pe));
+    pe.size = sizeof(pe);
+    pe.type = type;
+    pe.config = config;
+    pe.exclude_kernel = 1;
+    pe.exclude_hv = 1;
+    return (int)syscall(SYS_perf_event_open, &pe, 0, -1, -1, 0);
+#else
+    return -1;
+#endif
+}
+
+long long _perf_read(int fd) {
+    long long value;
+    if(fd < 0 || read(fd, &value, sizeof(value)) != sizeof(value))
+        return -1;
+    return value;
+}
+
+void _perf_print(const char* name, long long before, long long after, long swaps) {
+    if(before < 0 || after < 0)
+        printf("  %s n/a", name);
+    else
+        printf("  %s %.2f", name, (double)(after - before) / swaps);
+}
+
+// Swaps round-robin into 'n' fibers created with 'flags', in the order of
+// creation, or in a shuffled order, as a run queue would be after a while
+void _onstack_round_robin(int n, unsigned flags, int shuffled, const char* name) {
+    struct timespec tp0, tp1;
+    cfib_attr_t attr = {.stack_size = 8192, .flags = flags};
+    cfib_t** fibs = malloc(n * sizeof(cfib_t*));
+    clock_gettime(CLOCK_MONOTONIC, &tp0);
+    for(int i = 0; i < n; i++)
+        fibs[i] = cfib_new((cfib_func)func_pingpong__noassert__, (void*)fib_main, &attr);
+    clock_gettime(CLOCK_MONOTONIC, &tp1);
+    long create_ns = _timespec_diff_ns(&tp0, &tp1);
+    // Fault the stacks in before counting
+    for(int i = 0; i < n; i++)
+        cfib_swap__noassert__(fibs[i]);
+    cfib_t** order = malloc(n * sizeof(cfib_t*));
+    memcpy(order, fibs, n * sizeof(cfib_t*));
+    srand(42);
+    for(int i = n - 1; shuffled && i > 0; i--) {
+        int j = rand() % (i + 1);
+        cfib_t* tmp = order[i];
+        order[i] = order[j];
+        order[j] = tmp;
+    }
+    int misses_fd = _perf_open(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES);
+    int tlb_fd = _perf_open(PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16));
+    long long misses = _perf_read(misses_fd), tlb = _perf_read(tlb_fd);
+    clock_gettime(CLOCK_MONOTONIC, &tp0);
+    for(int r = 0; r < ONSTACK_ROUNDS; r++) {
+        for(int i = 0; i < n; i++)
+            cfib_swap__noassert__(order[i]);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &tp1);
+    long swaps = 2L * ONSTACK_ROUNDS * n;
+    printf("   %-14s create %6.1f ns  swap %6.1f ns  per swap:", name, (double)create_ns / n, (double)_timespec_diff_ns(&tp0, &tp1) / swaps);
+    _perf_print("cache misses", misses, _perf_read(misses_fd), swaps);
+    _perf_print("dTLB misses", tlb, _perf_read(tlb_fd), swaps);
+    printf("\n");
+    if(misses_fd >= 0)
+        close(misses_fd);
+    if(tlb_fd >= 0)
+        close(tlb_fd);
+    for(int i = 0; i < n; i++)
+        cfib_release(fibs[i]);
+    free(order);
+    free(fibs);
+}
+
+void bench_onstack(int n) {
+    // Each stack takes two mappings, the stack and it's guard page
+    FILE* f = fopen("/proc/sys/vm/max_map_count", "r");
+    long max_maps;
+    if(f != NULL) {
+        if(fscanf(f, "%ld", &max_maps) == 1 && n > (max_maps - 1000) / 2) {
+            n = (int)((max_maps - 1000) / 2);
+            printf("vm.max_map_count is %ld, using %d fibers\n", max_maps, n);
+        }
+        fclose(f);
+    }
+    for(int shuffled = 0; shuffled < 2; shuffled++) {
+        printf("Swapping round-robin into %d fibers with 8 kB stacks, %d rounds, %s:\n", n, ONSTACK_ROUNDS, shuffled ? "shuffled" : "in order of creation");
+        _onstack_round_robin(n, 0, shuffled, "calloc()");
+        _onstack_round_robin(n, CFIB_ONSTACK, shuffled, "CFIB_ONSTACK");
+    }
+}
+
+#define GROW_FIBERS 1000
+#define GROW_STACK_SIZE (1 << 20)
+
+long _get_committed_kb() {
+    char line[128];
+    long kb = -1;
+    FILE* f = fopen("/proc/meminfo", "r");
+    if(f == NULL)
+        return -1;
+    while(fgets(line, sizeof(line), f) != NULL) {
+        if(sscanf(line, "Committed_AS: %ld kB", &kb) == 1)
+            break;
+    }
+    fclose(f);
+    return kb;
+}
+
+void func_go_deep(void* arg) {
+    _go_deep((int)(intptr_t)arg);
+}
+
+void bench_grow() {
+    static const int depths[] = {1, 64};
+    printf("%d finished fibers with %d KiB stacks, RSS and commit charge (system wide) while mapped:\n", GROW_FIBERS, GROW_STACK_SIZE >> 10);
+    for(size_t d = 0; d < sizeof(depths) / sizeof(depths[0]); d++) {
+        for(int grow = 0; grow < 2; grow++) {
+            struct timespec tp0, tp1;
+            cfib_attr_t attr = {.stack_size = GROW_STACK_SIZE, .flags = grow ? CFIB_STACK_GROW : 0};
+            cfib_t** fibs = malloc(GROW_FIBERS * sizeof(cfib_t*));
+            long rss_kb = _get_rss_kb(), committed_kb = _get_committed_kb();
+            clock_gettime(CLOCK_MONOTONIC, &tp0);
+            for(int i = 0; i < GROW_FIBERS; i++) {
+                fibs[i] = cfib_new(func_go_deep, (void*)(intptr_t)depths[d], &attr);
+                cfib_join(fibs[i]);
+            }
+            clock_gettime(CLOCK_MONOTONIC, &tp1);
+            rss_kb = _get_rss_kb() - rss_kb;
+            committed_kb = _get_committed_kb() - committed_kb;
+            printf("   %3d KiB deep %-16s %8ld KiB resident %8ld KiB committed %8.1f us/fiber\n", depths[d] * 4,
+                    grow ? "CFIB_STACK_GROW" : "fixed", rss_kb, committed_kb, _timespec_diff_ns(&tp0, &tp1) / 1000.0 / GROW_FIBERS);
+            for(int i = 0; i < GROW_FIBERS; i++)
+                cfib_release(fibs[i]);
+            free(fibs);
+        }
+    }
+#ifdef __linux__
+    // The overflow takes the process down, so it happens in a child
+    fflush(stdout);
+    pid_t pid = fork();
+    if(pid == 0) {
+        cfib_attr_t attr = {.stack_size = 64 << 10, .flags = CFIB_STACK_GROW};
+        cfib_t* fib = cfib_new(func_go_deep, (void*)(intptr_t)1000, &attr);
+        cfib_join(fib);
+        _exit(0);
+    }
+    int status = 0;
+    waitpid(pid, &status, 0);
+    printf("Fiber going 4000 KiB deep on a 64 KiB growable stack: %s %d\n",
+            WIFSIGNALED(status) ? "killed by signal" : "exited with", WIFSIGNALED(status) ? WTERMSIG(status) : WEXITSTATUS(status));
+#endif
+}
+
 void test_stack_hog() {
     cfib_attr_t attr = (cfib_attr_t){.stack_size = 1<<20, .tag = StackHogs};
     cfib_t* test_context = cfib_new((cfib_func)func_stack_hog, (void*)16, &attr);
     cfib_swap(test_context);
+    cfib_prof_dump(NULL);
 }
 
 void adjust_clock_overhead(int n) {
@@ -125,7 +2019,7 @@ void adjust_clock_overhead(int n) {
     for(int i = 0; i < n; i++) {
         clock_gettime(CLOCK_MONOTONIC, &tp0);
         clock_gettime(CLOCK_MONOTONIC, &tp1);
-        intervals[i] = tp1.tv_nsec - tp0.tv_nsec;
+        intervals[i] = _timespec_diff_ns(&tp0, &tp1);
     }
     qsort(intervals, n, sizeof(long), _long_cmp);
     clock_overhead = _get_median(intervals, n);
@@ -133,11 +2027,37 @@ void adjust_clock_overhead(int n) {
 }
 
 void print_usage(char *name) {
-    fprintf(stderr, "Usage: %s <#>\n\n", name);
+    fprintf(stderr, "Usage: %s <#> [args]\n\n", name);
     fprintf(stderr, "#\tTest/benchmark\n");
     fprintf(stderr, "1\tBenchmark: Time across cfib_swap()\n");
     fprintf(stderr, "2\tBenchmark: Time across cfib_swap__noassert__()\n");
-    fprintf(stderr, "3\tTest: stack hog (NOT IMPLEMENTED)\n");
+    fprintf(stderr, "3\tTest: stack hog, with a profiler report in the profiled build\n");
+    fprintf(stderr, "4\tBenchmark: cfib_new() + cfib_unmap() with and without stack pool\n");
+    fprintf(stderr, "5\tBenchmark: cfib_new_batch() versus cfib_new()\n");
+    fprintf(stderr, "6\tBenchmark: cfib_yield() throughput\n");
+    fprintf(stderr, "7\tBenchmark: M:N runtime scaling on a fan-out workload\n");
+    fprintf(stderr, "8\tBenchmark: fiber I/O round trip over a socketpair\n");
+    fprintf(stderr, "9\tBenchmark: io_uring file reads versus blocking pread()\n");
+    fprintf(stderr, "10\tBenchmark: contention on fiber mutex, semaphore and channels\n");
+    fprintf(stderr, "11\tBenchmark: cross-thread fiber wakeup ping-pong\n");
+    fprintf(stderr, "12\tBenchmark: timing wheel versus binary heap, cfib_sleep_until() and timed wait lateness\n");
+    fprintf(stderr, "13\tBenchmark: short fibers running to completion\n");
+    fprintf(stderr, "14\tBenchmark: RSS of idle fibers with and without stack reclaim\n");
+    fprintf(stderr, "15\tBenchmark: stack profiler page fault path on several threads\n");
+    fprintf(stderr, "16\tBenchmark: stack painting, high water marks and their cost\n");
+    fprintf(stderr, "17\tBenchmark: resolving addresses to fibers with many live fibers\n");
+    fprintf(stderr, "18\tBenchmark: stack sizes from a stack profile\n");
+    fprintf(stderr, "19\tBenchmark: swap cost and per-fiber switch statistics of the instrumented build\n");
+    fprintf(stderr, "20 [out]\tBenchmark suite: TSC timed swaps, ucontext, live fibers, create/destroy, threads;\n");
+    fprintf(stderr, "\tresults are written to out, as CSV if it ends with .csv and as JSON otherwise\n");
+    fprintf(stderr, "21\tBenchmark: passing values with cfib_transfer(), fibers releasing their own stack\n");
+    fprintf(stderr, "22\tBenchmark: swaps with and without thread-local data, cfib_yield(); compare the library builds\n");
+    fprintf(stderr, "23\tBenchmark: fiber arguments reserved on the fiber stack versus malloc()\n");
+    fprintf(stderr, "24\tBenchmark: 4-stage generator pipeline versus callbacks\n");
+    fprintf(stderr, "25\tBenchmark: fiber-local storage versus a hash map, and it's destructors\n");
+    fprintf(stderr, "26\tBenchmark: swaps with many live fibers on huge page and NUMA local stacks\n");
+    fprintf(stderr, "27\tBenchmark: fibers at the top of their own stack versus allocated apart, 100k fibers\n");
+    fprintf(stderr, "28\tBenchmark: memory footprint and cost of growable stacks, overflow of one\n");
 }
 
 int main(int argc, char** argv) {
@@ -157,6 +2077,91 @@ int main(int argc, char** argv) {
         case 3:
             test_stack_hog();
             break;
+        case 4:
+            bench_new_unmap(NUM_SAMPLES);
+            break;
+        case 5:
+            bench_new_batch(NUM_SAMPLES / 10);
+            break;
+        case 6:
+            bench_yield(NUM_SAMPLES * 10);
+            break;
+#ifdef _WITH_C11_ATOMICS
+        case 7:
+            bench_mt_scaling();
+            break;
+#endif
+#ifdef _WITH_EPOLL
+        case 8:
+            bench_io_pingpong(NUM_SAMPLES);
+            break;
+#endif
+#ifdef _WITH_IO_URING
+        case 9:
+            bench_uring_read();
+            break;
+#endif
+        case 10:
+            bench_sync(NUM_SAMPLES);
+            break;
+#ifdef _WITH_C11_ATOMICS
+        case 11:
+            bench_remote_pingpong(NUM_SAMPLES);
+            break;
+#endif
+        case 12:
+            bench_timers(NUM_SAMPLES * 10);
+            break;
+        case 13:
+            bench_completion(NUM_SAMPLES);
+            break;
+        case 14:
+            bench_reclaim();
+            break;
+#ifdef _WITH_C11_ATOMICS
+        case 15:
+            bench_prof_faults();
+            break;
+#endif
+        case 16:
+            bench_stack_paint(NUM_SAMPLES / 10);
+            break;
+        case 17:
+            bench_find_by_addr(NUM_SAMPLES * 10);
+            break;
+        case 18:
+            bench_stack_profile();
+            break;
+        case 19:
+            bench_swap_stats(NUM_SAMPLES);
+            break;
+        case 20:
+            bench_suite(argc > 2 ? argv[2] : NULL);
+            break;
+        case 21:
+            bench_transfer(NUM_SAMPLES);
+            break;
+        case 22:
+            bench_swap_tls(NUM_SAMPLES);
+            break;
+        case 23:
+            bench_new_reserve(NUM_SAMPLES);
+            break;
+        case 24:
+            bench_pipeline();
+            break;
+        case 25:
+            bench_fls(NUM_SAMPLES * 10);
+            break;
+        case 26:
+            bench_stack_placement();
+            break;
+        case 27:
+            bench_onstack(ONSTACK_FIBERS);
+            break;
+        case 28:
+            bench_grow();
+            break;
         default:
             goto errexit;
     }
@@ -0,0 +1,169 @@
+// Tests of the C++ layer, cfib.hpp. Every check is an assert(), so this
+// must not be built with NDEBUG.
+#undef NDEBUG
+
+#include "cfib.hpp"
+
+#include <cassert>
+#include <cstdio>
+#include <stdexcept>
+#include <string>
+
+// Counts the constructions and destructions of the callables
+struct tracker {
+    static int constructed;
+    static int destroyed;
+    int* ran;
+
+    explicit tracker(int* ran) : ran(ran) {
+        constructed++;
+    }
+    tracker(const tracker& other) : ran(other.ran) {
+        constructed++;
+    }
+    tracker(tracker&& other) : ran(other.ran) {
+        constructed++;
+    }
+    ~tracker() {
+        destroyed++;
+    }
+    void operator()() {
+        (*ran)++;
+        cfib::this_fiber::yield();
+        (*ran)++;
+    }
+
+    static int live() {
+        return constructed - destroyed;
+    }
+};
+
+int tracker::constructed = 0;
+int tracker::destroyed = 0;
+
+// Records where the callable lives
+struct locator {
+    const void** self;
+    void operator()() {
+        *self = this;
+    }
+};
+
+void test_placement() {
+    const void* self = nullptr;
+    cfib::fiber f(locator{&self});
+    cfib_t* fib = f.native_handle();
+    f.resume();
+    assert(f.finished());
+    // The callable was constructed at the top of the fiber's own stack
+    assert(self != nullptr);
+    assert((const unsigned char*)self >= fib->stack_ceiling && (const unsigned char*)self < fib->stack_floor);
+    assert((uintptr_t)self % 16 == 0);
+    printf("placement-new of the callable on the fiber stack: OK\n");
+}
+
+void test_destroy_once() {
+    int ran = 0;
+    {
+        cfib::fiber f{tracker(&ran)};
+        // The temporary is gone, the copy on the fiber stack is not
+        assert(tracker::live() == 1);
+        f.resume();
+        assert(ran == 1 && !f.finished());
+        f.resume();
+        assert(ran == 2 && f.finished());
+        // Destroyed in the fiber when it returned, not again by reset()
+        assert(tracker::live() == 0);
+        int destroyed = tracker::destroyed;
+        f.reset();
+        assert(tracker::destroyed == destroyed);
+        assert(!f);
+    }
+    assert(tracker::live() == 0);
+    printf("callable destroyed exactly once: OK\n");
+}
+
+void test_rethrow() {
+    int rounds = 0;
+    cfib::fiber f([&rounds] {
+        rounds++;
+        cfib::this_fiber::yield();
+        rounds++;
+        throw std::runtime_error("done");
+    });
+    f.resume();
+    assert(rounds == 1);
+    bool caught = false;
+    try {
+        f.resume();
+    } catch(const std::runtime_error& e) {
+        caught = std::string(e.what()) == "done";
+    }
+    assert(caught && rounds == 2 && f.finished());
+    printf("exception rethrown by resume(): OK\n");
+}
+
+void test_move_assign() {
+    int ran_a = 0, ran_b = 0;
+    {
+        cfib::fiber a{tracker(&ran_a)};
+        cfib::fiber b{tracker(&ran_b)};
+        a.resume();
+        assert(tracker::live() == 2);
+        cfib_t* fib_b = b.native_handle();
+        // The unfinished fiber of 'a' is released, and 'a' takes over 'b'
+        a = std::move(b);
+        assert(tracker::live() == 1);
+        assert(!b && a.native_handle() == fib_b);
+        a.resume();
+        a.resume();
+        assert(ran_a == 1 && ran_b == 2 && a.finished());
+        cfib::fiber c(std::move(a));
+        assert(!a && c.finished());
+        a.swap(c);
+        assert(a && !c);
+    }
+    assert(tracker::live() == 0);
+    printf("move construction and assignment: OK\n");
+}
+
+void test_reset_unfinished() {
+    int ran = 0;
+    cfib::fiber f{tracker(&ran)};
+    f.resume();
+    assert(ran == 1 && !f.finished() && tracker::live() == 1);
+    f.reset();
+    assert(!f && f.finished() && tracker::live() == 0);
+    // Resetting an empty fiber does nothing
+    f.reset();
+    assert(tracker::live() == 0);
+    printf("reset() of an unfinished fiber: OK\n");
+}
+
+void test_auto_recycle_ignored() {
+    cfib_attr_t attr = {0, CFIB_AUTO_RECYCLE, NULL, 0};
+    int n = 0;
+    cfib::fiber f([&n] { n++; }, &attr);
+    f.resume();
+    // Still ours to look at and to release
+    assert(n == 1 && f.finished() && cfib_is_finished(f.native_handle()));
+    // A recycled fiber would be handed out again here
+    cfib::fiber g([&n] { n++; }, &attr);
+    assert(g.native_handle() != f.native_handle());
+    g.resume();
+    f.reset();
+    g.reset();
+    assert(n == 2);
+    printf("CFIB_AUTO_RECYCLE ignored: OK\n");
+}
+
+int main() {
+    cfib_init_thread();
+    test_placement();
+    test_destroy_once();
+    test_rethrow();
+    test_move_assign();
+    test_reset_unfinished();
+    test_auto_recycle_ignored();
+    return 0;
+}